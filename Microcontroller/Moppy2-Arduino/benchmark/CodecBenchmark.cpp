@@ -0,0 +1,411 @@
+/*
+ * CodecBenchmark.cpp
+ * Compares the standard, compact (MoppyCompact.h), and COBS (MoppyCobs.h) encodings of the same
+ * stream of events on the native build, and prints the results as JSON:
+ *  - bytesPerEvent: What each event costs on the wire
+ *  - decodeNsPerEvent: Host time MoppySerial::readMessages() takes per event, from the bytes
+ *    arriving on Serial to the instrument's handler being called
+ *
+ * Usage: program [events]  (default 100000)
+ *
+ * The events are a made-up but song-like mix of chords (note-offs followed by note-ons for
+ * consecutive drives), single-drive melody, and pitch bends.  The encoders below are references
+ * for the Controller's side of the compact and COBS encodings.  Each decode is run REPETITIONS times and
+ * the fastest is kept.
+ *
+ * COBS frames are also damaged in a few different ways (see corruptions below) to check that each
+ * bad frame is counted in the link statistics and that decoding picks up again with the next one.
+ * The program exits with 1 if any check fails.
+ */
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../native/MoppySim.h"
+#include "../src/MoppyNetworks/MoppySerial.h"
+
+#define REPETITIONS 5
+#define DRIVES 8
+
+struct Event {
+    uint8_t subAddress;
+    uint8_t command;
+    uint8_t payload[2];
+    uint8_t payloadLength;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+//
+//// Events
+//
+
+static uint32_t randomState = 12345;
+
+static uint32_t nextRandom(uint32_t range) {
+    randomState = randomState * 1103515245 + 12345;
+    return (randomState >> 16) % range;
+}
+
+static void addEvent(std::vector<Event> &events, uint8_t subAddress, uint8_t command, uint8_t a, uint8_t b, uint8_t payloadLength) {
+    Event event = {subAddress, command, {a, b}, payloadLength};
+    events.push_back(event);
+}
+
+static std::vector<Event> makeEvents(size_t count) {
+    std::vector<Event> events;
+    uint8_t playing[DRIVES + 1] = {0};
+    while (events.size() < count) {
+        uint32_t kind = nextRandom(10);
+        if (kind < 5) {
+            // Chord: stop whatever's playing and start 2 to 8 new notes
+            for (uint8_t d = 1; d <= DRIVES; d++) {
+                if (playing[d]) {
+                    addEvent(events, d, NETBYTE_DEV_NOTEOFF, playing[d], 0, 1);
+                    playing[d] = 0;
+                }
+            }
+            uint8_t notes = 2 + nextRandom(DRIVES - 1);
+            uint8_t root = 36 + nextRandom(24);
+            uint8_t velocity = nextRandom(4) == 0 ? 64 + nextRandom(64) : 127;
+            for (uint8_t d = 1; d <= notes; d++) {
+                playing[d] = root + (d - 1) * 4;
+                addEvent(events, d, NETBYTE_DEV_NOTEON, playing[d], velocity, 2);
+            }
+        } else if (kind < 9) {
+            // Melody on the first drive
+            if (playing[1]) {
+                addEvent(events, 1, NETBYTE_DEV_NOTEOFF, playing[1], 0, 1);
+            }
+            playing[1] = 48 + nextRandom(24);
+            addEvent(events, 1, NETBYTE_DEV_NOTEON, playing[1], 127, 2);
+        } else {
+            // A short bend
+            int16_t bend = (int16_t)nextRandom(8192) - 4096;
+            for (uint8_t i = 0; i < 4; i++) {
+                addEvent(events, 1, NETBYTE_DEV_BENDPITCH, (uint8_t)(bend >> 8), (uint8_t)bend, 2);
+                bend /= 2;
+            }
+        }
+    }
+    events.resize(count);
+    return events;
+}
+
+//
+//// Encoders
+//
+
+static void encodeStandard(const std::vector<Event> &events, std::vector<uint8_t> &out) {
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event &e = events[i];
+        uint8_t header[5] = {START_BYTE, DEVICE_ADDRESS, e.subAddress, (uint8_t)(e.payloadLength + 1), e.command};
+        out.insert(out.end(), header, header + sizeof(header));
+        out.insert(out.end(), e.payload, e.payload + e.payloadLength);
+    }
+}
+
+// Reference encoder for MOPPY_ENCODING_COMPACT
+class CompactEncoder {
+public:
+    void encode(const Event &e, std::vector<uint8_t> &out) {
+        switch (e.command) {
+        case NETBYTE_DEV_NOTEOFF:
+            status(0x80, e.subAddress, out);
+            out.push_back(e.payload[0]);
+            break;
+        case NETBYTE_DEV_NOTEON:
+            if (e.payload[1] == velocity) {
+                // Chords run up through consecutive sub-addresses without repeating the status
+                if (runningStatus == 0xB0 && e.subAddress == runningSubAddress + 1) {
+                    runningSubAddress = e.subAddress;
+                } else {
+                    status(0xB0, e.subAddress, out);
+                }
+                out.push_back(e.payload[0]);
+            } else {
+                status(0x90, e.subAddress, out);
+                out.push_back(e.payload[0]);
+                out.push_back(e.payload[1]);
+                velocity = e.payload[1];
+            }
+            break;
+        case NETBYTE_DEV_BENDPITCH: {
+            uint16_t bend = (int16_t)(e.payload[0] << 8 | e.payload[1]) + 0x2000; // As in MIDI
+            status(0xC0, e.subAddress, out);
+            out.push_back(bend & 0x7F);
+            out.push_back(bend >> 7);
+            break;
+        }
+        }
+    }
+
+private:
+    uint8_t runningStatus = 0;
+    uint8_t runningSubAddress = 0;
+    uint8_t velocity = 127;
+
+    // Writes a status byte (and sub-address) unless running status already covers it (which it
+    // never does for a chord's own sub-address, since repeats of those go to the next one)
+    void status(uint8_t type, uint8_t subAddress, std::vector<uint8_t> &out) {
+        if (type != runningStatus || subAddress != runningSubAddress || type == 0xB0) {
+            if (subAddress > 0 && subAddress <= 0x0F) {
+                out.push_back(type | subAddress);
+            } else {
+                out.push_back(type);
+                out.push_back(subAddress);
+            }
+            runningStatus = type;
+        }
+        runningSubAddress = subAddress;
+    }
+};
+
+static void encodeCompact(const std::vector<Event> &events, std::vector<uint8_t> &out) {
+    CompactEncoder encoder;
+    for (size_t i = 0; i < events.size(); i++) {
+        encoder.encode(events[i], out);
+    }
+}
+
+// Reference encoder for MOPPY_ENCODING_COBS, for one message
+static void encodeCobsFrame(uint8_t address, uint8_t subAddress, uint8_t command, const uint8_t payload[], uint8_t payloadLength, std::vector<uint8_t> &out) {
+    uint8_t body[MOPPY_COBS_MAX_BODY + 1] = {address, subAddress, command};
+    uint8_t length = 3;
+    for (uint8_t p = 0; p < payloadLength; p++) {
+        body[length++] = payload[p];
+    }
+    uint8_t crc = 0;
+    for (uint8_t b = 0; b < length; b++) {
+        crc = crc8Update(crc, body[b]);
+    }
+    body[length++] = crc;
+
+    size_t codePos = out.size();
+    uint8_t code = 1;
+    out.push_back(0);
+    for (uint8_t b = 0; b < length; b++) {
+        if (body[b] == 0x00) {
+            out[codePos] = code;
+            codePos = out.size();
+            code = 1;
+            out.push_back(0);
+        } else {
+            out.push_back(body[b]);
+            if (++code == 0xFF) { // A full block doesn't stand for a 0x00
+                out[codePos] = code;
+                codePos = out.size();
+                code = 1;
+                out.push_back(0);
+            }
+        }
+    }
+    out[codePos] = code;
+    out.push_back(0x00);
+}
+
+static void encodeCobs(const std::vector<Event> &events, std::vector<uint8_t> &out) {
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event &e = events[i];
+        encodeCobsFrame(DEVICE_ADDRESS, e.subAddress, e.command, e.payload, e.payloadLength, out);
+    }
+}
+
+//
+//// Decoding
+//
+
+// Counts (and checksums) what it's given, so both encodings can be checked against each other
+class CountingConsumer : public MoppyMessageConsumer {
+public:
+    unsigned long messages = 0;
+    unsigned long checksum = 0;
+
+    void handleDeviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) override {
+        messages++;
+        checksum = checksum * 31 + subAddress;
+        checksum = checksum * 31 + command;
+        checksum = checksum * 31 + payload[0];
+        if (command != NETBYTE_DEV_NOTEOFF) {
+            checksum = checksum * 31 + payload[1];
+        }
+    }
+};
+
+struct DecodeResult {
+    double nsPerEvent;
+    unsigned long messages;
+    unsigned long checksum;
+};
+
+// Runs bytes through MoppySerial (switching it to the given encoding first) and times it
+static DecodeResult decode(const std::vector<uint8_t> &bytes, uint8_t encoding, size_t events) {
+    DecodeResult best = {0, 0, 0};
+    for (int r = 0; r < REPETITIONS; r++) {
+        CountingConsumer consumer;
+        MoppySerial network(&consumer);
+        network.begin();
+        uint8_t setEncoding[] = {START_BYTE, SYSTEM_ADDRESS, 0x00, 0x02, NETBYTE_SYS_SETENCODING, encoding};
+        MoppySim::serialInput(setEncoding, sizeof(setEncoding));
+        network.readMessages();
+
+        MoppySim::serialInput(bytes.data(), bytes.size());
+        Clock::time_point start = Clock::now();
+        while (Serial.available()) {
+            network.readMessages();
+        }
+        network.readMessages(); // Whatever's left in the ring
+        double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count() / (double)events;
+
+        if (r == 0 || ns < best.nsPerEvent) {
+            best.nsPerEvent = ns;
+        }
+        best.messages = consumer.messages;
+        best.checksum = consumer.checksum;
+    }
+    return best;
+}
+
+//
+//// Corruption
+//
+
+/*
+ * Damage done to the middle one of three COBS frames, after which MoppySerial should drop just
+ * that frame (counting it as a CRC or framing error) and carry on with the next one
+ */
+struct Corruption {
+    const char *name;
+    void (*damage)(std::vector<uint8_t> &frame);
+    bool crcError; // Counted as a CRC error, rather than a framing error
+};
+
+// Flips a bit in the sub-address (frames are a code byte followed by the address, sub-address...),
+// which still decodes but leaves the CRC wrong.  The damaged frame's sub-address is 2, so this
+// never turns it into a delimiter.
+static void flipBit(std::vector<uint8_t> &frame) {
+    frame[2] ^= 0x04;
+}
+
+// Loses a byte, so the frame ends before its last block does
+static void dropByte(std::vector<uint8_t> &frame) {
+    frame.erase(frame.begin() + 3);
+}
+
+// Turns a byte into a delimiter, splitting the frame into two bad ones
+static void insertDelimiter(std::vector<uint8_t> &frame) {
+    frame[3] = 0x00;
+}
+
+// Replaces the frame with LENGTH bytes of line noise and no delimiter until the frame's own.
+// From MOPPY_COBS_MAX_FRAME bytes on that's more than any frame can be, and more than the
+// smallest receive ring holds, so the decoder has to give up on it before the delimiter arrives.
+template <size_t LENGTH>
+static void replaceWithNoise(std::vector<uint8_t> &frame) {
+    frame.assign(LENGTH + 1, 0x00);
+    uint8_t noise = 0x5A;
+    for (size_t i = 0; i < LENGTH; i++) {
+        noise = noise * 109 + 89; // Cycles through every byte, and 0 is skipped below
+        frame[i] = noise == 0x00 ? 0xFF : noise;
+    }
+}
+
+static const Corruption corruptions[] = {
+    {"flippedBit", flipBit, true},
+    {"droppedByte", dropByte, false},
+    {"insertedDelimiter", insertDelimiter, false},
+    {"noise255", replaceWithNoise<255>, false},
+    {"noise300", replaceWithNoise<300>, false}};
+
+struct ResyncResult {
+    uint16_t crcErrors;
+    uint16_t framingErrors;
+    bool nextDecoded; // The messages either side of the damaged one came through, and nothing else
+    bool passed;
+};
+
+static uint16_t readShort(const uint8_t bytes[]) {
+    return bytes[0] << 8 | bytes[1];
+}
+
+static ResyncResult checkResync(const Corruption &corruption) {
+    uint8_t before[] = {60, 127}, damaged[] = {64, 100}, after[] = {67, 127};
+
+    CountingConsumer consumer;
+    MoppySerial network(&consumer);
+    network.begin();
+    uint8_t setEncoding[] = {START_BYTE, SYSTEM_ADDRESS, 0x00, 0x02, NETBYTE_SYS_SETENCODING, MOPPY_ENCODING_COBS};
+    MoppySim::serialInput(setEncoding, sizeof(setEncoding));
+    network.readMessages();
+
+    std::vector<uint8_t> bytes, frame;
+    encodeCobsFrame(DEVICE_ADDRESS, 1, NETBYTE_DEV_NOTEON, before, sizeof(before), bytes);
+    encodeCobsFrame(DEVICE_ADDRESS, 2, NETBYTE_DEV_NOTEON, damaged, sizeof(damaged), frame);
+    corruption.damage(frame);
+    bytes.insert(bytes.end(), frame.begin(), frame.end());
+    encodeCobsFrame(DEVICE_ADDRESS, 3, NETBYTE_DEV_NOTEON, after, sizeof(after), bytes);
+    encodeCobsFrame(SYSTEM_ADDRESS, 0x00, NETBYTE_SYS_GETLINKSTATS, NULL, 0, bytes);
+
+    MoppySim::serialOutput().clear();
+    MoppySim::serialInput(bytes.data(), bytes.size());
+    // Bounded, since a decoder that's stuck waiting on a full ring never takes any more
+    for (size_t reads = 0; Serial.available() && reads < bytes.size(); reads++) {
+        network.readMessages();
+    }
+    network.readMessages();
+
+    CountingConsumer expected;
+    expected.handleDeviceMessage(1, NETBYTE_DEV_NOTEON, before);
+    expected.handleDeviceMessage(3, NETBYTE_DEV_NOTEON, after);
+
+    ResyncResult result = {0, 0, false, false};
+    result.nextDecoded = consumer.messages == expected.messages && consumer.checksum == expected.checksum;
+
+    // The reply is always in the standard encoding
+    const std::vector<uint8_t> &reply = MoppySim::serialOutput();
+    const uint8_t header[] = {START_BYTE, SYSTEM_ADDRESS, 0x00, LINK_STATS_PAYLOAD_LENGTH + 1, NETBYTE_SYS_LINKSTATS};
+    if (reply.size() == sizeof(header) + LINK_STATS_PAYLOAD_LENGTH && memcmp(reply.data(), header, sizeof(header)) == 0) {
+        const uint8_t *payload = &reply[sizeof(header)];
+        result.crcErrors = readShort(&payload[4]);
+        result.framingErrors = readShort(&payload[6]);
+    }
+    result.passed = result.nextDecoded && (corruption.crcError ? result.crcErrors > 0 : result.framingErrors > 0);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    std::vector<Event> events = makeEvents(count);
+
+    std::vector<uint8_t> standard, compact, cobs;
+    encodeStandard(events, standard);
+    encodeCompact(events, compact);
+    encodeCobs(events, cobs);
+
+    DecodeResult standardResult = decode(standard, MOPPY_ENCODING_STANDARD, count);
+    DecodeResult compactResult = decode(compact, MOPPY_ENCODING_COMPACT, count);
+    DecodeResult cobsResult = decode(cobs, MOPPY_ENCODING_COBS, count);
+    bool match = standardResult.messages == count && compactResult.messages == count && cobsResult.messages == count &&
+                 standardResult.checksum == compactResult.checksum && standardResult.checksum == cobsResult.checksum;
+
+    printf("{\n  \"benchmark\": \"codec\",\n  \"platform\": \"native\",\n  \"events\": %zu,\n  \"decodedMatch\": %s,\n", count, match ? "true" : "false");
+    printf("  \"results\": [\n");
+    printf("    {\"encoding\": \"standard\", \"bytes\": %zu, \"bytesPerEvent\": %.2f, \"decodeNsPerEvent\": %.1f},\n",
+           standard.size(), (double)standard.size() / count, standardResult.nsPerEvent);
+    printf("    {\"encoding\": \"compact\", \"bytes\": %zu, \"bytesPerEvent\": %.2f, \"decodeNsPerEvent\": %.1f},\n",
+           compact.size(), (double)compact.size() / count, compactResult.nsPerEvent);
+    printf("    {\"encoding\": \"cobs\", \"bytes\": %zu, \"bytesPerEvent\": %.2f, \"decodeNsPerEvent\": %.1f}\n",
+           cobs.size(), (double)cobs.size() / count, cobsResult.nsPerEvent);
+    printf("  ],\n  \"resync\": [");
+
+    bool resynced = true;
+    for (size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++) {
+        ResyncResult result = checkResync(corruptions[i]);
+        resynced = resynced && result.passed;
+        printf("%s\n    {\"corruption\": \"%s\", \"crcErrors\": %u, \"framingErrors\": %u, \"nextFrameDecoded\": %s, \"passed\": %s}",
+               i == 0 ? "" : ",", corruptions[i].name, result.crcErrors, result.framingErrors,
+               result.nextDecoded ? "true" : "false", result.passed ? "true" : "false");
+    }
+    printf("\n  ]\n}\n");
+    return match && resynced ? 0 : 1;
+}
@@ -0,0 +1,310 @@
+/*
+ * TickBenchmark.cpp
+ * Times the timer interrupt (tick(), or the step scheduler) of every instrument on the native
+ * build under a few different loads, and prints the results as JSON so they can be compared
+ * across changes:
+ *  - idle:      Nothing playing
+ *  - one:       A single voice playing
+ *  - all:       Every voice playing a different note
+ *  - allToggle: Every voice playing the same note, so they all step on the same interrupts
+ *
+ * Usage: program [seconds]  (simulated seconds per scenario, default 1)
+ *
+ * Times are host nanoseconds per interrupt, and include the mock Arduino API's digitalWrite(), so
+ * they're only meaningful compared to each other.  A single interrupt is too short to time on its
+ * own (the clock's resolution and cost are about the same as the interrupt), so consecutive
+ * interrupts are timed in batches of up to BATCH_SIZE, with the cost of timing and of the
+ * simulation calling each interrupt taken off.  meanNs is over every batched interrupt; medianNs,
+ * p99Ns, and maxNs are percentiles of the batches' per-interrupt times.  Each scenario is run
+ * REPETITIONS times, and everything is reported from the repetition with the lowest median.  For
+ * cycle counts on a real board, build with ISR_STATS instead (see MoppyIsrStats.h).  Output counts
+ * are pin transitions plus bytes sent over SPI (for instruments behind shift registers).
+ */
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "../native/MoppySim.h"
+#include "../src/MoppyInstruments/EasyDrivers.h"
+#include "../src/MoppyInstruments/FloppyDrives.h"
+#include "../src/MoppyInstruments/L298N.h"
+#include "../src/MoppyInstruments/ShiftRegister.h"
+#include "../src/MoppyInstruments/ShiftedFloppyDrives.h"
+
+// Notes are (re)started this often, so short notes (e.g. on ShiftRegister) keep playing
+#define RETRIGGER_INTERVAL 100000UL
+
+#define REPETITIONS 5
+
+// Most interrupts timed together.  Batches are also cut short whenever the simulation stops
+// advancing (i.e. at each retrigger), so nothing but interrupts ever happens inside one.
+#define BATCH_SIZE 64
+
+struct BenchInstrument {
+    const char *name;
+    MoppyInstrument *instrument;
+    uint8_t firstSubAddress;
+    uint8_t voices;
+    uint8_t firstNote;
+    uint8_t noteSpacing;
+    bool voicesAreNotes; // Each note is its own output (e.g. ShiftRegister), so sub-addresses don't matter
+};
+
+#define ALL_VOICES 0xFF
+
+struct Scenario {
+    const char *name;
+    uint8_t voices; // Number of voices playing (or ALL_VOICES)
+    bool sameNote;
+};
+
+static const Scenario scenarios[] = {
+    {"idle", 0, false},
+    {"one", 1, false},
+    {"all", ALL_VOICES, false},
+    {"allToggle", ALL_VOICES, true}};
+
+typedef std::chrono::steady_clock Clock;
+
+// A batch of size interrupts costs about batchOverheadNs + size * interruptOverheadNs more than
+// the interrupts themselves (see measureOverhead()).  batchOverheadNs can come out negative, since
+// there's one less trip through the simulation between interrupts than there are interrupts.
+static double batchOverheadNs = 0;
+static double interruptOverheadNs = 0;
+
+// Filled in by timedIsr() around each call to the instrument's interrupt
+static void (*instrumentIsr)() = NULL;
+static unsigned batchLimit = BATCH_SIZE;
+static unsigned batchInterrupts;
+static Clock::time_point batchStart;
+static Clock::time_point batchEnd;
+static std::vector<double> batchNs; // Per-interrupt time of each batch
+static std::vector<unsigned> batchSizes;
+static uint64_t interruptCount;
+static unsigned long maxOutputs;
+static unsigned long totalTransitions;
+static size_t totalSpiBytes;
+
+static void emptyIsr() {}
+
+static void endBatch() {
+    if (batchInterrupts == 0) {
+        return;
+    }
+    double ns = std::chrono::duration_cast<std::chrono::duration<double, std::nano> >(batchEnd - batchStart).count();
+    ns = (ns - batchOverheadNs) / batchInterrupts - interruptOverheadNs;
+    batchNs.push_back(ns > 0 ? ns : 0);
+    batchSizes.push_back(batchInterrupts);
+    batchInterrupts = 0;
+}
+
+static void timedIsr() {
+    unsigned long transitionsBefore = MoppySim::transitionCount();
+    size_t spiBefore = MoppySim::spiTransfers().size();
+
+    if (batchInterrupts == 0) {
+        batchStart = Clock::now();
+    }
+    instrumentIsr();
+    batchInterrupts++;
+    if (batchInterrupts == batchLimit) {
+        batchEnd = Clock::now();
+        endBatch();
+    } else {
+        batchEnd = Clock::now(); // In case the simulation stops here and cuts the batch short
+    }
+
+    unsigned long transitions = MoppySim::transitionCount() - transitionsBefore;
+    size_t spiBytes = MoppySim::spiTransfers().size() - spiBefore;
+    unsigned long outputs = transitions + spiBytes;
+
+    interruptCount++;
+    totalTransitions += transitions;
+    totalSpiBytes += spiBytes;
+    if (outputs > maxOutputs) {
+        maxOutputs = outputs;
+    }
+}
+
+// Moves the simulation along without letting a batch span anything but interrupts
+static void advance(uint64_t microseconds) {
+    MoppySim::advance(microseconds);
+    endBatch();
+}
+
+static void resetCounters() {
+    batchInterrupts = 0;
+    batchNs.clear();
+    batchSizes.clear();
+    interruptCount = 0;
+    maxOutputs = 0;
+    totalTransitions = 0;
+    totalSpiBytes = 0;
+    MoppySim::spiTransfers().clear();
+}
+
+// Value that the given fraction of (sorted) values are no more than
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(sorted.size() * fraction + 0.5);
+    return sorted[index > 0 ? index - 1 : 0];
+}
+
+// Median per-interrupt time of batches of the given size of an interrupt that does nothing, run
+// from the STEP alarm just like the instruments' interrupts
+static double emptyBatchNs(unsigned size) {
+    MoppySim::Alarm &alarm = MoppySim::alarm(MoppyTimer::STEP);
+    alarm.isr = timedIsr;
+    alarm.interval = TIMER_RESOLUTION;
+    alarm.due = MoppySim::now() + alarm.interval;
+    alarm.active = true;
+
+    instrumentIsr = emptyIsr;
+    batchLimit = size;
+    batchOverheadNs = 0;
+    interruptOverheadNs = 0;
+    resetCounters();
+    for (int i = 0; i < 10; i++) {
+        advance(RETRIGGER_INTERVAL);
+    }
+    alarm.active = false;
+    batchLimit = BATCH_SIZE;
+
+    std::sort(batchNs.begin(), batchNs.end());
+    return percentile(batchNs, 0.5);
+}
+
+// Splits the cost of timing into what each batch and each interrupt in it adds
+static void measureOverhead() {
+    double single = emptyBatchNs(1);
+    double full = emptyBatchNs(BATCH_SIZE);
+    interruptOverheadNs = (BATCH_SIZE * full - single) / (BATCH_SIZE - 1);
+    batchOverheadNs = single - interruptOverheadNs;
+}
+
+static uint8_t voicesFor(const BenchInstrument &bench, const Scenario &scenario) {
+    return scenario.voices == ALL_VOICES ? bench.voices : scenario.voices;
+}
+
+static void startNotes(const BenchInstrument &bench, const Scenario &scenario) {
+    uint8_t voices = voicesFor(bench, scenario);
+    for (uint8_t v = 0; v < voices; v++) {
+        uint8_t payload[2] = {(uint8_t)(bench.firstNote + (scenario.sameNote && !bench.voicesAreNotes ? 0 : v * bench.noteSpacing)), 127};
+        uint8_t subAddress = bench.voicesAreNotes ? bench.firstSubAddress : bench.firstSubAddress + v;
+        bench.instrument->handleDeviceMessage(subAddress, NETBYTE_DEV_NOTEON, payload);
+    }
+}
+
+// Everything reported for one repetition of a scenario
+struct Result {
+    uint64_t interrupts;
+    double meanNs;
+    double medianNs;
+    double p99Ns;
+    double maxNs;
+    unsigned long maxOutputs;
+    double togglesPerSecond;
+    double spiBytesPerSecond;
+};
+
+static Result runRepetition(const BenchInstrument &bench, const Scenario &scenario, double seconds) {
+    // Start from silence each time, and let anything left over from the last run finish
+    bench.instrument->handleSystemMessage(NETBYTE_SYS_STOP, NULL);
+    advance(RETRIGGER_INTERVAL);
+    resetCounters();
+
+    uint64_t start = MoppySim::now();
+    uint64_t end = start + (uint64_t)(seconds * 1000000);
+    while (MoppySim::now() < end) {
+        startNotes(bench, scenario);
+        advance(RETRIGGER_INTERVAL);
+    }
+    double simulated = (MoppySim::now() - start) / 1000000.0;
+
+    Result result;
+    double totalNs = 0;
+    uint64_t timed = 0;
+    for (size_t b = 0; b < batchNs.size(); b++) {
+        totalNs += batchNs[b] * batchSizes[b];
+        timed += batchSizes[b];
+    }
+    std::sort(batchNs.begin(), batchNs.end());
+    result.interrupts = interruptCount;
+    result.meanNs = timed > 0 ? totalNs / timed : 0;
+    result.medianNs = percentile(batchNs, 0.5);
+    result.p99Ns = percentile(batchNs, 0.99);
+    result.maxNs = percentile(batchNs, 1);
+    result.maxOutputs = maxOutputs;
+    result.togglesPerSecond = totalTransitions / simulated;
+    result.spiBytesPerSecond = totalSpiBytes / simulated;
+    return result;
+}
+
+static void runScenario(const BenchInstrument &bench, const Scenario &scenario, double seconds, bool first) {
+    Result best = Result();
+    for (int r = 0; r < REPETITIONS; r++) {
+        Result result = runRepetition(bench, scenario, seconds);
+        if (r == 0 || result.medianNs < best.medianNs) {
+            best = result;
+        }
+    }
+
+    printf("%s\n    {\"instrument\": \"%s\", \"scenario\": \"%s\", \"voices\": %u, \"interrupts\": %llu, "
+           "\"meanNs\": %.1f, \"medianNs\": %.1f, \"p99Ns\": %.1f, \"maxNs\": %.1f, "
+           "\"maxOutputsPerInterrupt\": %lu, \"togglesPerSecond\": %.1f, \"spiBytesPerSecond\": %.1f}",
+           first ? "" : ",", bench.name, scenario.name, voicesFor(bench, scenario), (unsigned long long)best.interrupts,
+           best.meanNs, best.medianNs, best.p99Ns, best.maxNs, best.maxOutputs, best.togglesPerSecond, best.spiBytesPerSecond);
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+
+    BenchInstrument instruments[] = {
+        {"FloppyDrives", new instruments::FloppyDrives(), 1, 8, 36, 3, false},
+        {"ShiftedFloppyDrives", new instruments::ShiftedFloppyDrives(), 1, 8, 36, 3, false},
+        {"EasyDrivers", new instruments::EasyDrivers(), 1, 3, 36, 5, false},
+        {"L298N", new instruments::L298N(), 1, 4, 36, 5, false},
+        {"ShiftRegister", new instruments::ShiftRegister(), 1, 24, 79, 1, true}};
+
+    measureOverhead();
+
+    printf("{\n  \"benchmark\": \"tick\",\n  \"platform\": \"native\",\n  \"timerResolution\": %d,\n", TIMER_RESOLUTION);
+    printf("  \"options\": {\"STEP_SCHEDULER\": %s, \"PHASE_ACCUMULATOR\": %s, \"BATCHED_OUTPUT\": %s},\n",
+#ifdef STEP_SCHEDULER
+           "true",
+#else
+           "false",
+#endif
+#ifdef PHASE_ACCUMULATOR
+           "true",
+#else
+           "false",
+#endif
+#ifdef BATCHED_OUTPUT
+           "true");
+#else
+           "false");
+#endif
+    printf("  \"batchSize\": %d,\n  \"batchOverheadNs\": %.1f,\n  \"interruptOverheadNs\": %.1f,\n  \"results\": [",
+           BATCH_SIZE, batchOverheadNs, interruptOverheadNs);
+
+    bool first = true;
+    MoppySim::setRecording(false);
+    for (size_t i = 0; i < sizeof(instruments) / sizeof(instruments[0]); i++) {
+        // Each instrument's setup() attaches its own interrupt to the timer, which is then wrapped
+        instruments[i].instrument->setup();
+        instrumentIsr = MoppySim::alarm(MoppyTimer::STEP).isr;
+        MoppySim::alarm(MoppyTimer::STEP).isr = timedIsr;
+
+        for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+            runScenario(instruments[i], scenarios[s], seconds, first);
+            first = false;
+        }
+        instruments[i].instrument->handleSystemMessage(NETBYTE_SYS_STOP, NULL);
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Arduino.h
+ * Just enough of the Arduino API to build and run the firmware on the host (see MoppySim.h).
+ * Time only moves when the simulation is advanced (delay() does that too), and pins, Serial, and
+ * SPI are all recorded instead of going anywhere.
+ */
+
+#ifndef MOPPY_NATIVE_ARDUINO_H_
+#define MOPPY_NATIVE_ARDUINO_H_
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "binary.h"
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef uint16_t word;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+// Simulated clock speed, the same as an Uno
+#define F_CPU 16000000UL
+#define clockCyclesPerMicrosecond() (F_CPU / 1000000L)
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+
+#define NUM_DIGITAL_PINS 64
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Set and clear the simulated interrupt flag (see MoppySim::interruptsEnabled())
+void interrupts();
+void noInterrupts();
+
+/*
+ * Serial reads from bytes given to MoppySim::serialInput() and keeps everything written to it
+ * for MoppySim::serialOutput().
+ */
+class HardwareSerial {
+public:
+    void begin(unsigned long baud);
+    void updateBaudRate(unsigned long baud) { this->baud = baud; }
+    void end() {}
+    int available();
+    int peek();
+    int read();
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t *buffer, size_t size);
+    size_t print(const char *str);
+    size_t println(const char *str = "");
+    void flush() {}
+    operator bool() { return true; }
+
+    unsigned long baudRate() const { return baud; }
+
+private:
+    unsigned long baud = 0;
+};
+
+extern HardwareSerial Serial;
+
+#endif /* MOPPY_NATIVE_ARDUINO_H_ */
@@ -0,0 +1,272 @@
+/*
+ * MoppySim.cpp
+ * Virtual clock and the mock Arduino API built on it.
+ */
+#include "MoppySim.h"
+#include <Arduino.h>
+#include <SPI.h>
+#include <deque>
+
+HardwareSerial Serial;
+SPIClass SPI;
+
+namespace MoppySim {
+
+static uint64_t currentTime = 0;
+static bool inInterrupt = false;
+static bool interruptFlag = true;
+static Alarm alarms[ALARM_COUNT];
+
+static uint8_t pinModes[NUM_DIGITAL_PINS];
+static uint8_t pinLevels[NUM_DIGITAL_PINS];
+static uint8_t inputLevels[NUM_DIGITAL_PINS];
+static bool recordingTransitions = true;
+static unsigned long pinTransitionCount = 0;
+static std::vector<PinTransition> pinTransitions;
+
+static std::deque<uint8_t> serialIn;
+static std::vector<uint8_t> serialOut;
+static std::vector<SpiTransfer> spiLog;
+
+uint64_t now() {
+    return currentTime;
+}
+
+void advanceTo(uint64_t time) {
+    while (interruptFlag) {
+        // Find whichever alarm is due first (the lowest index wins a tie)
+        Alarm *next = NULL;
+        for (uint8_t i = 0; i < ALARM_COUNT; i++) {
+            if (alarms[i].active && alarms[i].due <= time && (next == NULL || alarms[i].due < next->due)) {
+                next = &alarms[i];
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+
+        if (next->due < currentTime) {
+            next->due = currentTime; // Armed for a time that's already passed, so it fires right away
+        }
+        currentTime = next->due;
+        next->lastExpiry = next->due;
+        if (next->interval > 0) {
+            next->due += next->interval;
+        } else {
+            next->active = false;
+        }
+        next->fired++;
+        inInterrupt = true;
+        interruptFlag = false;
+        next->isr();
+        interruptFlag = true;
+        inInterrupt = false;
+    }
+
+    if (time > currentTime) {
+        currentTime = time;
+    }
+}
+
+void advance(uint64_t microseconds) {
+    advanceTo(currentTime + microseconds);
+}
+
+bool interruptsEnabled() {
+    return interruptFlag;
+}
+
+void reset() {
+    currentTime = 0;
+    interruptFlag = true;
+    memset(alarms, 0, sizeof(alarms));
+    memset(pinModes, INPUT, sizeof(pinModes));
+    memset(pinLevels, LOW, sizeof(pinLevels));
+    memset(inputLevels, LOW, sizeof(inputLevels));
+    pinTransitions.clear();
+    pinTransitionCount = 0;
+    serialIn.clear();
+    serialOut.clear();
+    spiLog.clear();
+}
+
+Alarm &alarm(uint8_t index) {
+    return alarms[index];
+}
+
+uint8_t pinLevel(uint8_t pin) {
+    return pin < NUM_DIGITAL_PINS ? pinLevels[pin] : LOW;
+}
+
+std::vector<PinTransition> &transitions() {
+    return pinTransitions;
+}
+
+void setRecording(bool recording) {
+    recordingTransitions = recording;
+}
+
+unsigned long transitionCount() {
+    return pinTransitionCount;
+}
+
+void setInput(uint8_t pin, uint8_t level) {
+    if (pin < NUM_DIGITAL_PINS) {
+        inputLevels[pin] = level;
+    }
+}
+
+void serialInput(const uint8_t *data, size_t length) {
+    serialIn.insert(serialIn.end(), data, data + length);
+}
+
+std::vector<uint8_t> &serialOutput() {
+    return serialOut;
+}
+
+std::vector<SpiTransfer> &spiTransfers() {
+    return spiLog;
+}
+
+} // namespace MoppySim
+
+using namespace MoppySim;
+
+//
+//// Arduino API
+//
+
+void pinMode(uint8_t pin, uint8_t mode) {
+    if (pin >= NUM_DIGITAL_PINS) {
+        return;
+    }
+    pinModes[pin] = mode;
+    if (mode == INPUT_PULLUP) {
+        inputLevels[pin] = HIGH;
+    }
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if (pin >= NUM_DIGITAL_PINS) {
+        return;
+    }
+    uint8_t level = val ? HIGH : LOW;
+    if (pinLevels[pin] != level) {
+        pinLevels[pin] = level;
+        pinTransitionCount++;
+        if (recordingTransitions) {
+            PinTransition transition = {currentTime, pin, level};
+            pinTransitions.push_back(transition);
+        }
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    if (pin >= NUM_DIGITAL_PINS) {
+        return LOW;
+    }
+    return pinModes[pin] == OUTPUT ? pinLevels[pin] : inputLevels[pin];
+}
+
+void shiftOut(uint8_t dataPin, uint8_t clockPin, uint8_t bitOrder, uint8_t val) {
+    for (uint8_t i = 0; i < 8; i++) {
+        digitalWrite(dataPin, bitOrder == LSBFIRST ? (val >> i) & 1 : (val >> (7 - i)) & 1);
+        digitalWrite(clockPin, HIGH);
+        digitalWrite(clockPin, LOW);
+    }
+}
+
+// Busy-waiting on the clock (like the instruments' startup sounds do) would never end if reading it
+// took no time at all, so each read from outside of an interrupt moves time along a microsecond
+static void clockRead() {
+    if (!inInterrupt) {
+        advance(1);
+    }
+}
+
+unsigned long millis() {
+    clockRead();
+    return currentTime / 1000;
+}
+
+unsigned long micros() {
+    clockRead();
+    return currentTime;
+}
+
+void interrupts() {
+    interruptFlag = true;
+}
+
+void noInterrupts() {
+    interruptFlag = false;
+}
+
+void delay(unsigned long ms) {
+    advance((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    advance(us);
+}
+
+//
+//// Serial
+//
+
+void HardwareSerial::begin(unsigned long baud) {
+    this->baud = baud;
+}
+
+int HardwareSerial::available() {
+    return serialIn.size();
+}
+
+int HardwareSerial::peek() {
+    return serialIn.empty() ? -1 : serialIn.front();
+}
+
+int HardwareSerial::read() {
+    if (serialIn.empty()) {
+        return -1;
+    }
+    uint8_t b = serialIn.front();
+    serialIn.pop_front();
+    return b;
+}
+
+size_t HardwareSerial::readBytes(uint8_t *buffer, size_t length) {
+    size_t count = 0;
+    while (count < length && !serialIn.empty()) {
+        buffer[count++] = read();
+    }
+    return count;
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+    serialOut.push_back(b);
+    return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size) {
+    serialOut.insert(serialOut.end(), buffer, buffer + size);
+    return size;
+}
+
+size_t HardwareSerial::print(const char *str) {
+    return write((const uint8_t *)str, strlen(str));
+}
+
+size_t HardwareSerial::println(const char *str) {
+    return print(str) + print("\r\n");
+}
+
+//
+//// SPI
+//
+
+uint8_t SPIClass::transfer(uint8_t data) {
+    SpiTransfer transfer = {currentTime, data};
+    spiLog.push_back(transfer);
+    return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * MoppySim.h
+ * Virtual time and recorded I/O behind the native build's Arduino.h, SPI.h, and MoppyTimer.
+ *
+ * Nothing happens on its own: time only moves forward when advance() is called (or the firmware
+ * calls delay()), and any timer interrupts that come due along the way are called in order, each
+ * with the clock set to exactly when it was due.  That makes every run deterministic, so pin
+ * timings can be compared between runs (and between changes to the firmware).
+ */
+
+#ifndef MOPPY_NATIVE_MOPPYSIM_H_
+#define MOPPY_NATIVE_MOPPYSIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace MoppySim {
+
+// A change of output level on a pin, time in microseconds
+struct PinTransition {
+    uint64_t time;
+    uint8_t pin;
+    uint8_t level;
+};
+
+// A byte sent with SPI.transfer(), time in microseconds
+struct SpiTransfer {
+    uint64_t time;
+    uint8_t data;
+};
+
+/*
+ * Alarms are what MoppyTimer's channels run on.  An active alarm calls isr at due and then
+ * reloads itself for interval microseconds later (an interval of 0 deactivates it instead).
+ * lastExpiry and due are both updated before isr is called, so it can re-arm itself from there.
+ */
+struct Alarm {
+    void (*isr)();
+    bool active;
+    uint64_t due;
+    uint64_t lastExpiry;
+    unsigned long interval;
+    unsigned long fired; // Number of times isr has been called
+};
+
+static const uint8_t ALARM_COUNT = 2;
+
+// Current virtual time in microseconds
+uint64_t now();
+
+// Moves time forward, calling any alarms that come due on the way.  Reading millis() or micros()
+// (outside of an interrupt) also moves time forward by a microsecond.
+void advance(uint64_t microseconds);
+void advanceTo(uint64_t time);
+
+// The simulated global interrupt flag, cleared by noInterrupts() (or MoppyCriticalSection) and
+// while an alarm's isr runs.  Alarms that come due while it's cleared wait until time is next
+// advanced with it set, and then fire late like they would on hardware.
+bool interruptsEnabled();
+
+// Back to time 0 with every pin low, all alarms off, and everything recorded cleared
+void reset();
+
+Alarm &alarm(uint8_t index);
+
+// Output levels and recorded transitions for every pin
+uint8_t pinLevel(uint8_t pin);
+std::vector<PinTransition> &transitions();
+void setRecording(bool recording); // Transitions aren't recorded while off (defaults to on)
+unsigned long transitionCount();   // Every transition since the last reset, recorded or not
+
+// Level digitalRead() will return for a pin that isn't an output (INPUT_PULLUP pins default HIGH)
+void setInput(uint8_t pin, uint8_t level);
+
+// Bytes for Serial to read, and everything that's been written to it
+void serialInput(const uint8_t *data, size_t length);
+std::vector<uint8_t> &serialOutput();
+
+std::vector<SpiTransfer> &spiTransfers();
+
+} // namespace MoppySim
+
+#endif /* MOPPY_NATIVE_MOPPYSIM_H_ */
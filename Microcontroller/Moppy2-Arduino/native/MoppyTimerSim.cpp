@@ -0,0 +1,121 @@
+/*
+ * MoppyTimerSim.cpp
+ * MoppyTimer for the native build (in place of src/MoppyInstruments/MoppyTimer.cpp), with each
+ * channel running on a MoppySim alarm.  One-shots behave like the Uno's Timer1 in CTC mode:
+ * intervals are rounded down to ONESHOT_RESOLUTION and measured from the last expiry.
+ */
+#include "../src/MoppyInstruments/MoppyTimer.h"
+#include "MoppySim.h"
+
+static unsigned long channelPeriod[MoppyTimer::CHANNEL_COUNT] = {0, 0};
+
+MoppyTimerHandle MoppyTimer::initialize(unsigned long microseconds, void (*isr)(), uint8_t channel) {
+    if (channel >= CHANNEL_COUNT) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    MoppySim::alarm(channel).isr = isr;
+    setPeriod(channel, microseconds);
+    start(channel);
+    return channel;
+}
+
+void MoppyTimer::start(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT || isRunning(timer) || channelPeriod[timer] == 0) {
+        return;
+    }
+    MoppySim::Alarm &alarm = MoppySim::alarm(timer);
+    alarm.lastExpiry = MoppySim::now();
+    alarm.interval = channelPeriod[timer];
+    alarm.due = alarm.lastExpiry + alarm.interval;
+    alarm.active = true;
+}
+
+void MoppyTimer::stop(MoppyTimerHandle timer) {
+    if (timer < CHANNEL_COUNT) {
+        MoppySim::alarm(timer).active = false;
+    }
+}
+
+void MoppyTimer::setPeriod(MoppyTimerHandle timer, unsigned long microseconds) {
+    if (timer >= CHANNEL_COUNT) {
+        return;
+    }
+    channelPeriod[timer] = microseconds;
+    MoppySim::alarm(timer).interval = microseconds; // The current interval is left to finish
+}
+
+bool MoppyTimer::isRunning(MoppyTimerHandle timer) {
+    return timer < CHANNEL_COUNT && MoppySim::alarm(timer).active;
+}
+
+// A held channel's alarm calls heldIsr() in place of its own, which just notes that it came due
+static void (*heldChannelIsr[MoppyTimer::CHANNEL_COUNT])() = {NULL, NULL};
+static bool channelPending[MoppyTimer::CHANNEL_COUNT] = {false, false};
+
+static void heldStep() {
+    channelPending[MoppyTimer::STEP] = true;
+}
+
+static void heldControl() {
+    channelPending[MoppyTimer::CONTROL] = true;
+}
+
+void MoppyTimer::hold(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT || heldChannelIsr[timer] != NULL) {
+        return;
+    }
+    heldChannelIsr[timer] = MoppySim::alarm(timer).isr;
+    MoppySim::alarm(timer).isr = timer == STEP ? heldStep : heldControl;
+}
+
+void MoppyTimer::release(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT || heldChannelIsr[timer] == NULL) {
+        return;
+    }
+    MoppySim::alarm(timer).isr = heldChannelIsr[timer];
+    heldChannelIsr[timer] = NULL;
+    if (channelPending[timer]) {
+        channelPending[timer] = false;
+        MoppySim::alarm(timer).isr();
+    }
+}
+
+MoppyTimerHandle MoppyTimer::initializeOneShot(void (*isr)(), uint8_t channel) {
+    if (channel != STEP) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    MoppySim::alarm(channel).isr = isr;
+    return channel;
+}
+
+void MoppyTimer::arm(MoppyTimerHandle timer, unsigned long microseconds) {
+    MoppySim::Alarm &alarm = MoppySim::alarm(timer);
+    if (!alarm.active) {
+        alarm.lastExpiry = MoppySim::now();
+        alarm.active = true;
+    }
+    // Like the hardware, keeps firing at this interval until it's re-armed or disarmed
+    alarm.interval = (microseconds / ONESHOT_RESOLUTION) * ONESHOT_RESOLUTION;
+    alarm.due = alarm.lastExpiry + alarm.interval;
+}
+
+void MoppyTimer::disarm(MoppyTimerHandle timer) {
+    MoppySim::alarm(timer).active = false;
+}
+
+unsigned long MoppyTimer::elapsed(MoppyTimerHandle timer) {
+    MoppySim::Alarm &alarm = MoppySim::alarm(timer);
+    if (!alarm.active) {
+        return 0;
+    }
+    return ((MoppySim::now() - alarm.lastExpiry) / ONESHOT_RESOLUTION) * ONESHOT_RESOLUTION;
+}
+
+bool MoppyTimer::expiryPending(MoppyTimerHandle timer) {
+    // Alarms fire as soon as time reaches them, so one's only ever pending while time stands still
+    // at its due time (i.e. from another alarm's isr)
+    MoppySim::Alarm &alarm = MoppySim::alarm(timer);
+    return alarm.active && MoppySim::now() >= alarm.due;
+}
@@ -0,0 +1,33 @@
+/*
+ * SPI.h
+ * Mock SPI for the native build.  Transfers are recorded by MoppySim rather than sent anywhere.
+ */
+
+#ifndef MOPPY_NATIVE_SPI_H_
+#define MOPPY_NATIVE_SPI_H_
+
+#include <stdint.h>
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPISettings {
+public:
+    SPISettings() {}
+    SPISettings(uint32_t clock, uint8_t bitOrder, uint8_t dataMode) {}
+};
+
+class SPIClass {
+public:
+    void begin() {}
+    void end() {}
+    void beginTransaction(SPISettings settings) {}
+    void endTransaction() {}
+    uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif /* MOPPY_NATIVE_SPI_H_ */
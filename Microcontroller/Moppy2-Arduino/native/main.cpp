@@ -0,0 +1,51 @@
+/*
+ * main.cpp
+ * Entry point for the native build: runs the firmware's setup() and loop() against the
+ * simulated clock and prints every pin transition as CSV (time in microseconds, pin, level).
+ *
+ * Usage: program [seconds] < messages
+ *
+ * Anything piped in is fed to Serial (all at once, before setup()), so a recorded stream of
+ * Moppy messages can be played through the configured instrument and network.  The simulation
+ * runs for the given number of virtual seconds (default 5) after setup() returns, calling loop()
+ * every LOOP_INTERVAL microseconds.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "MoppySim.h"
+
+#define LOOP_INTERVAL 100
+
+// From src/main.cpp
+void setup();
+void loop();
+
+int main(int argc, char *argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 5;
+
+    if (!isatty(fileno(stdin))) {
+        uint8_t buffer[256];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+            MoppySim::serialInput(buffer, length);
+        }
+    }
+
+    setup();
+
+    uint64_t end = MoppySim::now() + (uint64_t)(seconds * 1000000);
+    while (MoppySim::now() < end) {
+        loop();
+        MoppySim::advance(LOOP_INTERVAL);
+    }
+
+    printf("time,pin,level\n");
+    const std::vector<MoppySim::PinTransition> &transitions = MoppySim::transitions();
+    for (size_t i = 0; i < transitions.size(); i++) {
+        printf("%llu,%u,%u\n", (unsigned long long)transitions[i].time, transitions[i].pin, transitions[i].level);
+    }
+    fprintf(stderr, "Simulated %.3fs: %zu pin transitions, %lu timer interrupts, %zu bytes sent on Serial\n",
+            MoppySim::now() / 1000000.0, transitions.size(), MoppySim::alarm(0).fired, MoppySim::serialOutput().size());
+    return 0;
+}
@@ -25,6 +25,18 @@
 
 #define NETWORK_SERIAL
 //#define NETWORK_UDP
+//#define NETWORK_MIDI // Plain MIDI at 31250 baud, straight from a MIDI device instead of the Controller
+
+// On the ESP32, receive NETWORK_UDP packets (and OTA updates) in a separate task on the core that
+// runs WiFi, and pass messages to the instrument on the other core through a queue.  Keeps WiFi
+// from holding up notes, at the cost of up to a millisecond of latency polling for packets.
+// Queue depth and latency can be requested with a NETBYTE_SYS_GETQUEUESTATS message.
+//#define UDP_NETWORK_TASK
+
+// Size in bytes of the buffer that NETWORK_SERIAL receives into.  Must be a power of two larger
+// than the longest message body (255 bytes).  Defaults to 256 on AVR and 1024 everywhere else; a
+// bigger buffer leaves loop() longer to get to messages before any are dropped.
+//#define MOPPY_SERIAL_BUFFER_SIZE 256
 
 // Play a startup sound when the Arduino is initialized.  Helpful
 // for debugging purposes, but can be turned off once everything
@@ -40,5 +52,63 @@
 #define MIN_SUB_ADDRESS 1
 #define MAX_SUB_ADDRESS 8
 
+// Let the Controller send notes to the device as a whole (NETBYTE_DEV_POOLNOTEON and
+// NETBYTE_DEV_POOLNOTEOFF, to sub-address 0) and pick a free drive for each one here, rather than
+// having to keep track of every drive itself.  When every drive is busy the one that's been playing
+// longest is taken over.  Costs about 180 bytes of RAM.
+// Supported by FloppyDrives, ShiftedFloppyDrives, EasyDrivers, and L298N
+//#define VOICE_POOL
+
+////
+// Timing options
+////
+
+// Use the event-driven step scheduler instead of a fixed-rate timer tick.  Rather than
+// interrupting every TIMER_RESOLUTION microseconds to check on every drive, the timer only
+// fires when a drive actually needs to step and is stopped completely while nothing is
+// playing, leaving more time for everything else (e.g. WiFi on the ESP8266).
+// Supported by FloppyDrives, ShiftedFloppyDrives, EasyDrivers, and L298N
+//#define STEP_SCHEDULER
+
+// Keep track of fractions of a tick when timing steps with the fixed-rate tick.  Notes whose
+// period isn't a whole number of ticks (most of them above C5 or so) then play at the right
+// pitch on average instead of being rounded to the nearest tick, and pitch-bends move smoothly
+// instead of in whole-tick jumps.  Costs a little RAM and some 32-bit math in the tick on AVR.
+// Can't be combined with STEP_SCHEDULER.
+//#define PHASE_ACCUMULATOR
+
+// Rather than writing each pin as soon as a drive steps, work out all of the pin changes for a
+// tick and write them together (one write per port) at the start of the next tick.  Every drive
+// then steps at the same, fixed point in the interrupt no matter how many other drives are
+// stepping, at the cost of a constant one-tick delay.
+// Supported by FloppyDrives
+//#define BATCHED_OUTPUT
+
+// Let each drive play a chord by switching between its notes ARPEGGIO_RATE times a second.  Notes
+// sent to a drive that's already playing are added to what it's playing (up to ARPEGGIO_NOTES,
+// after which the oldest is dropped) instead of replacing it, until they're turned off again.
+// Can't be combined with STEP_SCHEDULER.
+// Supported by FloppyDrives
+//#define ARPEGGIO
+//#define ARPEGGIO_RATE 40 // Notes per second (defaults to 40; 30 to 60 works well)
+//#define ARPEGGIO_NOTES 4 // Most notes in a drive's chord (defaults to 4)
+
+// Work out glides, vibrato, and pitch-bend ramps on the device (see
+// MoppyInstruments/MoppyModulation.h), so the Controller can send one message to start each of them
+// instead of a stream of pitch bends.  Pitches are updated MODULATION_RATE times a second from
+// loop().  Can't be combined with ARPEGGIO.
+// Supported by FloppyDrives
+//#define MODULATION
+//#define MODULATION_RATE 100 // Updates per second (defaults to 100)
+
+// Pitch of A4 in Hz that all of the note periods are calculated from (defaults to 440)
+//#define A4_TUNING 440
+
+// Measure how long every timer interrupt (i.e. the instrument's tick) takes, and how often it
+// doesn't finish before the next one is due.  The results can be requested from the Controller
+// with a NETBYTE_SYS_GETISRSTATS message (see MoppyInstruments/MoppyIsrStats.h).  Adds a little
+// time to every interrupt, so leave this off unless you're using it.
+//#define ISR_STATS
+
 
 #endif /* SRC_MOPPYCONFIG_H_ */
@@ -51,17 +51,23 @@ NOTE: This integer controls the "resetAll" function, and should contain the high
 /*Array to keep track of state of each pin.  Even indexes track the step-pins for toggle purposes.  Odd indexes
  track direction-pins.  LOW = forward, HIGH=reverse <- This depends on the wiring of the stepper motor with the EasyDriver.
  */
-int EasyDrivers::currentState[] = {0,0,LOW,LOW,LOW,LOW,LOW,LOW};
+int EasyDrivers::currentState[] = {0,0,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW}; // Up to pin 11 (driver 3)
 
 // Current period assigned to each driver.  0 = off.  Each period is two-ticks (as defined by
 // TIMER_RESOLUTION in MoppyInstrument.h) long.
-unsigned int EasyDrivers::currentPeriod[] = {0,0,0,0,0};
+period_t EasyDrivers::currentPeriod[] = {0,0,0,0,0};
 
 // Tracks the current tick-count for each driver (see EasyDrivers::tick() below)
-unsigned int EasyDrivers::currentTick[] = {0,0,0,0,0};
+period_t EasyDrivers::currentTick[] = {0,0,0,0,0};
 
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
-unsigned int EasyDrivers::originalPeriod[] = {0,0,0,0,0};
+period_t EasyDrivers::originalPeriod[] = {0,0,0,0,0};
+
+void EasyDrivers::describe(MoppyCapabilities &capabilities) {
+  MoppyInstrument::describe(capabilities);
+  capabilities.instrumentType = MOPPY_INSTRUMENT_EASYDRIVER;
+  capabilities.voices = LAST_DRIVER - FIRST_DRIVER + 1;
+}
 
 void EasyDrivers::setup() {
 
@@ -100,7 +106,11 @@ void EasyDrivers::setup() {
   delay(500); // Wait a half second for safety
 
   // Setup timer to handle interrupts for drivers driving
+#ifdef STEP_SCHEDULER
+  MoppyScheduler::initialize(step);
+#else
   MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+#endif
 
   // If MoppyConfig wants a startup sound, play the startupSound on the
   // first driver.
@@ -113,11 +123,11 @@ void EasyDrivers::setup() {
 
 // Play startup sound to confirm driver functionality
 void EasyDrivers::startupSound(byte driverNum) {
-  unsigned int chargeNotes[] = {
-      noteDoubleTicks[31],
-      noteDoubleTicks[36],
-      noteDoubleTicks[38],
-      noteDoubleTicks[43],
+  period_t chargeNotes[] = {
+      doubleTicksForNote(31),
+      doubleTicksForNote(36),
+      doubleTicksForNote(38),
+      doubleTicksForNote(43),
       0
   };
   byte i = 0;
@@ -125,7 +135,7 @@ void EasyDrivers::startupSound(byte driverNum) {
   while(i < 5) {
     if (millis() - 200 > lastRun) {
       lastRun = millis();
-      currentPeriod[driverNum] = chargeNotes[i++];
+      setPeriod(driverNum, chargeNotes[i++]);
     }
   }
 }
@@ -154,12 +164,14 @@ void EasyDrivers::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
     // Set the current period to the new value to play it immediately
     // Also set the originalPeriod in-case we pitch-bend
     if (payload[0] <= MAX_DRIVER_NOTE) {
-        currentPeriod[subAddress] = originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+        originalPeriod[subAddress] = doubleTicksForNote(payload[0]);
+        setPeriod(subAddress, originalPeriod[subAddress]);
     }
 }
 
 void EasyDrivers::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    originalPeriod[subAddress] = 0;
+    setPeriod(subAddress, 0);
 }
 
 void EasyDrivers::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
@@ -167,9 +179,9 @@ void EasyDrivers::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
     // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
+    // Calculate bend based on BEND_OCTAVES (from MoppyTables.h) and percentage of deflection
     //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    setPeriod(subAddress, bendPeriod(originalPeriod[subAddress], bendDeflection));
 }
 
 //
@@ -187,41 +199,51 @@ void EasyDrivers::tick()
    ticks that pass, and toggle the pin if the current period is reached.
    */
   if (currentPeriod[1]>0){
-    currentTick[1]++;
+    currentTick[1] += PERIOD_ONE_TICK;
     if (currentTick[1] >= currentPeriod[1]){
-      togglePin(1,2,3); // Drive 1 is on pins 2 and 3
-      currentTick[1]=0;
+      togglePin<1>(); // Drive 1 is on pins 2 and 3
+      currentTick[1] = (currentTick[1] - currentPeriod[1]) & PERIOD_FRACTION_MASK;
     }
   }
   if (currentPeriod[2]>0){
-    currentTick[2]++;
+    currentTick[2] += PERIOD_ONE_TICK;
     if (currentTick[2] >= currentPeriod[2]){
-      togglePin(2,6,7);
-      currentTick[2]=0;
+      togglePin<2>();
+      currentTick[2] = (currentTick[2] - currentPeriod[2]) & PERIOD_FRACTION_MASK;
     }
   }
   if (currentPeriod[3]>0){
-    currentTick[3]++;
+    currentTick[3] += PERIOD_ONE_TICK;
     if (currentTick[3] >= currentPeriod[3]){
-      togglePin(3,10,11);
-      currentTick[3]=0;
+      togglePin<3>();
+      currentTick[3] = (currentTick[3] - currentPeriod[3]) & PERIOD_FRACTION_MASK;
     }
   }
 }
 
-void EasyDrivers::togglePin(byte driverNum, byte pin, byte direction_pin) {
+// Called by the step scheduler (instead of tick()) whenever a driver is due to step
+void EasyDrivers::step(byte driverNum) {
+  static void (*const togglePins[])() = {NULL, togglePin<1>, togglePin<2>, togglePin<3>};
+  togglePins[driverNum]();
+}
+
+template <byte DRIVER>
+void EasyDrivers::togglePin() {
+  const byte pin = (DRIVER - 1) * 4 + 2; // 2, 6, 10
+  const byte direction_pin = pin + 1;
+
 // Switch directions if either end has been reached.
-  if (digitalRead(driverNum*2+12)==LOW) { // If front direction pin is on, change direction.
+  if (!FastPin<DRIVER*2+12>::read()) { // If front direction pin is on, change direction.
     currentState[direction_pin] = HIGH;
-    digitalWrite(direction_pin,HIGH);
+    FastPin<direction_pin>::high();
   }
-  else if (digitalRead(driverNum*2+13)==LOW) { // If rear direction pin is on, change direction.
+  else if (!FastPin<DRIVER*2+13>::read()) { // If rear direction pin is on, change direction.
     currentState[direction_pin] = LOW;
-    digitalWrite(direction_pin,LOW);
+    FastPin<direction_pin>::low();
   }
 
   // Pulse the step pin
-  digitalWrite(pin,currentState[pin]);
+  FastPin<pin>::write(currentState[pin] != LOW);
   currentState[pin] = ~currentState[pin];
 }
 
@@ -237,17 +259,30 @@ void EasyDrivers::blinkLED(){
   digitalWrite(13, LOW);
 }
 
+// Sets the period for a driver, letting the step scheduler know about it if that's in use
+void EasyDrivers::setPeriod(byte driverNum, period_t period) {
+  MoppyCriticalSection critical; // tick() reads these, and a period_t isn't written in one go
+  currentPeriod[driverNum] = period;
+#ifdef STEP_SCHEDULER
+  MoppyScheduler::setPeriod(driverNum, period);
+#else
+  if (period == 0) {
+    currentTick[driverNum] = 0; // So the next note starts from the beginning of its period
+  }
+#endif
+}
+
 // Immediately stops all drivers
 void EasyDrivers::haltAllDrivers() {
   for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
   }
 }
 
 // For a given driver number, runs e.g. the scanner-head all the way back to the rear
 void EasyDrivers::reset(byte driverNum)
 {
-  currentPeriod[driverNum] = 0; // Stop note
+  setPeriod(driverNum, 0); // Stop note
 
   byte stepPin = (driverNum - 1) * 4 + 2; //2, 6, 10
 
@@ -272,7 +307,7 @@ void EasyDrivers::resetAll()
   // Stop all drivers and set to reverse
   for (byte d=FIRST_DRIVER;d<=LAST_DRIVER;d++) {
     byte stepPin = (d - 1) * 4 + 2; //2, 6, 10
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
     digitalWrite(stepPin+1,HIGH);
   }
 
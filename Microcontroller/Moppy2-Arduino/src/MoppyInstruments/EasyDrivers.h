@@ -8,7 +8,9 @@
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyScheduler.h"
 #include "MoppyInstrument.h"
+#include "FastPin.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
@@ -16,6 +18,7 @@ namespace instruments {
   class EasyDrivers : public MoppyInstrument {
   public:
     void setup();
+    void describe(MoppyCapabilities &capabilities) override;
   protected:
       void sys_sequenceStop() override;
       void sys_reset() override;
@@ -28,15 +31,17 @@ namespace instruments {
     static unsigned int MAX_POSITION[];
     static unsigned int currentPosition[];
     static int currentState[];
-    static unsigned int currentPeriod[];
-    static unsigned int currentTick[];
-    static unsigned int originalPeriod[];
+    static period_t currentPeriod[];
+    static period_t currentTick[];
+    static period_t originalPeriod[];
 
     static void resetAll();
-    static void togglePin(byte driverNum, byte pin, byte direction_pin);
+    template <byte DRIVER> static void togglePin();
     static void haltAllDrivers();
     static void reset(byte driverNum);
     static void tick();
+    static void step(byte driverNum);
+    static void setPeriod(byte driverNum, period_t period);
     static void blinkLED();
     static void startupSound(byte driverNum);
   };
@@ -0,0 +1,199 @@
+/*
+ * FastPin.h
+ * Pin access resolved at compile time, for use where digitalWrite/digitalRead are too slow (i.e. in
+ * the timer interrupts).  Since the pin number is a template parameter, each call compiles down to a
+ * single register write on the supported platforms:
+ *  - ATmega328P/168 (Uno, Nano, etc.): sbi/cbi on the pin's PORT register, toggles via PINx
+ *  - ESP8266: GPOS/GPOC set and clear registers (GPIO 0-15)
+ *  - ESP32: GPIO out_w1ts/out_w1tc set and clear registers
+ * Anything else falls back to digitalWrite/digitalRead.
+ *
+ * Pins still need to be set up with pinMode() beforehand, and on AVR any PWM on the pin should be
+ * off (which the first digitalWrite() to it takes care of).
+ *
+ * FastPort writes several pins on the same port at once: with a single register write on AVR and
+ * the ESP8266, and with one write to each of the set and clear registers on the ESP32 (so nothing
+ * else on the port can be overwritten by the other core).  FastPin<PIN>::PORT and
+ * FastPin<PIN>::MASK give the port and bit to use for a pin (PORT is FASTPORT_NONE for pins that
+ * can't be written that way).  The native build pretends to have 8-pin ports like the Uno's, and
+ * writes the pins one by one.
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_FASTPIN_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_FASTPIN_H_
+
+#include <Arduino.h>
+#ifdef ARDUINO_ARCH_ESP32
+#include <soc/gpio_struct.h>
+#endif
+
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega168__)
+#define FASTPIN_AVR_328
+#endif
+
+#define FASTPORT_NONE 0xFF
+#ifdef FASTPIN_AVR_328
+#define FASTPORT_COUNT 3 // PORTD, PORTB, PORTC
+typedef uint8_t fastport_mask_t;
+#elif ARDUINO_ARCH_ESP8266
+#define FASTPORT_COUNT 1 // GPIO 0-15
+typedef uint32_t fastport_mask_t;
+#elif ARDUINO_ARCH_ESP32
+#define FASTPORT_COUNT 2 // GPIO 0-31 and 32-39
+typedef uint32_t fastport_mask_t;
+#elif ARDUINO_ARCH_NATIVE
+#define FASTPORT_COUNT 3 // Pins 0-7, 8-15, and 16-23
+typedef uint8_t fastport_mask_t;
+#else
+#define FASTPORT_COUNT 1 // Never actually used
+typedef uint8_t fastport_mask_t;
+#endif
+
+template <uint8_t PIN>
+class FastPin {
+public:
+#ifdef FASTPIN_AVR_328
+    // Digital pins 0-7 are PORTD, 8-13 PORTB, and 14-19 (A0-A5) PORTC
+    static_assert(PIN < 20, "FastPin only covers digital pins 0-19 on this board");
+    static const uint8_t PORT = PIN < 8 ? 0 : PIN < 14 ? 1 : 2;
+    static const fastport_mask_t MASK = 1 << (PIN < 8 ? PIN : PIN < 14 ? PIN - 8 : PIN - 14);
+#elif ARDUINO_ARCH_ESP8266
+    static const uint8_t PORT = PIN < 16 ? 0 : FASTPORT_NONE;
+    static const fastport_mask_t MASK = 1UL << (PIN & 31);
+#elif ARDUINO_ARCH_ESP32
+    static const uint8_t PORT = PIN < 32 ? 0 : 1;
+    static const fastport_mask_t MASK = 1UL << (PIN & 31);
+#elif ARDUINO_ARCH_NATIVE
+    static const uint8_t PORT = PIN < 24 ? PIN / 8 : FASTPORT_NONE;
+    static const fastport_mask_t MASK = 1 << (PIN & 7);
+#else
+    static const uint8_t PORT = FASTPORT_NONE;
+    static const fastport_mask_t MASK = 0;
+#endif
+
+    static inline void high() __attribute__((always_inline)) {
+#ifdef FASTPIN_AVR_328
+        port() |= mask();
+#elif ARDUINO_ARCH_ESP8266
+        if (PIN < 16) {
+            GPOS = mask();
+        } else {
+            digitalWrite(PIN, HIGH);
+        }
+#elif ARDUINO_ARCH_ESP32
+        if (PIN < 32) {
+            GPIO.out_w1ts = mask();
+        } else {
+            GPIO.out1_w1ts.val = mask();
+        }
+#else
+        digitalWrite(PIN, HIGH);
+#endif
+    }
+
+    static inline void low() __attribute__((always_inline)) {
+#ifdef FASTPIN_AVR_328
+        port() &= ~mask();
+#elif ARDUINO_ARCH_ESP8266
+        if (PIN < 16) {
+            GPOC = mask();
+        } else {
+            digitalWrite(PIN, LOW);
+        }
+#elif ARDUINO_ARCH_ESP32
+        if (PIN < 32) {
+            GPIO.out_w1tc = mask();
+        } else {
+            GPIO.out1_w1tc.val = mask();
+        }
+#else
+        digitalWrite(PIN, LOW);
+#endif
+    }
+
+    static inline void write(bool value) __attribute__((always_inline)) {
+        if (value) {
+            high();
+        } else {
+            low();
+        }
+    }
+
+    static inline void toggle() __attribute__((always_inline)) {
+#ifdef FASTPIN_AVR_328
+        pinReg() = mask(); // Writing a one to PINx flips the output
+#else
+        write(!isHigh());
+#endif
+    }
+
+    static inline bool read() __attribute__((always_inline)) {
+#ifdef FASTPIN_AVR_328
+        return (pinReg() & mask()) != 0;
+#elif ARDUINO_ARCH_ESP8266
+        return PIN < 16 ? (GPI & mask()) != 0 : digitalRead(PIN) == HIGH;
+#elif ARDUINO_ARCH_ESP32
+        return PIN < 32 ? (GPIO.in & mask()) != 0 : (GPIO.in1.val & mask()) != 0;
+#else
+        return digitalRead(PIN) == HIGH;
+#endif
+    }
+
+private:
+#ifdef FASTPIN_AVR_328
+    static inline volatile uint8_t &port() __attribute__((always_inline)) {
+        return PIN < 8 ? PORTD : PIN < 14 ? PORTB : PORTC;
+    }
+
+    static inline volatile uint8_t &pinReg() __attribute__((always_inline)) {
+        return PIN < 8 ? PIND : PIN < 14 ? PINB : PINC;
+    }
+#endif
+
+    static inline fastport_mask_t mask() __attribute__((always_inline)) {
+        return MASK;
+    }
+
+#if !defined(FASTPIN_AVR_328)
+    // The state currently being output by the pin
+    static inline bool isHigh() __attribute__((always_inline)) {
+#ifdef ARDUINO_ARCH_ESP8266
+        return PIN < 16 ? (GPO & mask()) != 0 : digitalRead(PIN) == HIGH;
+#elif ARDUINO_ARCH_ESP32
+        return PIN < 32 ? (GPIO.out & mask()) != 0 : (GPIO.out1.val & mask()) != 0;
+#else
+        return digitalRead(PIN) == HIGH;
+#endif
+    }
+#endif
+};
+
+class FastPort {
+public:
+    // Sets the pins in set and clears the pins in clear (everything else is left alone).  Always
+    // call with a constant port so this compiles down to the register writes.
+    static inline void write(uint8_t port, fastport_mask_t set, fastport_mask_t clear) __attribute__((always_inline)) {
+#ifdef FASTPIN_AVR_328
+        volatile uint8_t &reg = port == 0 ? PORTD : port == 1 ? PORTB : PORTC;
+        reg = (reg & ~clear) | set;
+#elif ARDUINO_ARCH_ESP8266
+        GPO = (GPO & ~clear) | set; // Safe as a read-modify-write, since there's only one core
+#elif ARDUINO_ARCH_ESP32
+        if (port == 0) {
+            GPIO.out_w1ts = set;
+            GPIO.out_w1tc = clear;
+        } else {
+            GPIO.out1_w1ts.val = set;
+            GPIO.out1_w1tc.val = clear;
+        }
+#elif ARDUINO_ARCH_NATIVE
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            if ((set | clear) & (1 << bit)) {
+                digitalWrite(port * 8 + bit, (set & (1 << bit)) ? HIGH : LOW);
+            }
+        }
+#endif
+    }
+};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_FASTPIN_H_ */
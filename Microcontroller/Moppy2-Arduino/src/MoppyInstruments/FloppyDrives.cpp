@@ -33,13 +33,53 @@ int FloppyDrives::currentState[] = {0,0,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW,LOW,
 
 // Current period assigned to each drive.  0 = off.  Each period is two-ticks (as defined by
 // TIMER_RESOLUTION in MoppyInstrument.h) long.
-unsigned int FloppyDrives::currentPeriod[] = {0,0,0,0,0,0,0,0,0,0};
+period_t FloppyDrives::currentPeriod[] = {0,0,0,0,0,0,0,0,0,0};
 
 // Tracks the current tick-count for each drive (see FloppyDrives::tick() below)
-unsigned int FloppyDrives::currentTick[] = {0,0,0,0,0,0,0,0,0,0};
+period_t FloppyDrives::currentTick[] = {0,0,0,0,0,0,0,0,0,0};
 
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
-unsigned int FloppyDrives::originalPeriod[] = {0,0,0,0,0,0,0,0,0,0};
+period_t FloppyDrives::originalPeriod[] = {0,0,0,0,0,0,0,0,0,0};
+
+#ifdef MODULATION
+MoppyModulator FloppyDrives::modulators[LAST_DRIVE + 1];
+unsigned long FloppyDrives::lastModulation = 0;
+#endif
+
+#ifdef ARPEGGIO
+static_assert(ARPEGGIO_SLICE_TICKS > 0 && ARPEGGIO_SLICE_TICKS <= 0xFFFF, "ARPEGGIO_RATE is out of range for this TIMER_RESOLUTION");
+
+uint8_t FloppyDrives::chordNotes[LAST_DRIVE + 1][ARPEGGIO_NOTES];
+period_t FloppyDrives::chordPeriods[LAST_DRIVE + 1][ARPEGGIO_NOTES];
+byte FloppyDrives::chordSize[LAST_DRIVE + 1];
+byte FloppyDrives::chordPosition[LAST_DRIVE + 1];
+int16_t FloppyDrives::bendDeflection[LAST_DRIVE + 1];
+uint16_t FloppyDrives::sliceTicksLeft = ARPEGGIO_SLICE_TICKS;
+#endif
+
+#ifdef BATCHED_OUTPUT
+// Pin changes worked out by the last tick, per port, waiting to be written by commitOutputs()
+fastport_mask_t FloppyDrives::pendingDirectionSet[FASTPORT_COUNT];
+fastport_mask_t FloppyDrives::pendingDirectionClear[FASTPORT_COUNT];
+fastport_mask_t FloppyDrives::pendingStepSet[FASTPORT_COUNT];
+fastport_mask_t FloppyDrives::pendingStepClear[FASTPORT_COUNT];
+#endif
+
+void FloppyDrives::describe(MoppyCapabilities &capabilities) {
+  MoppyInstrument::describe(capabilities);
+  capabilities.instrumentType = MOPPY_INSTRUMENT_FLOPPIES;
+  capabilities.voices = LAST_DRIVE - FIRST_DRIVE + 1;
+#ifdef ARPEGGIO
+  capabilities.voices *= ARPEGGIO_NOTES;
+  capabilities.features |= MOPPY_FEATURE_ARPEGGIO;
+#endif
+#ifdef MODULATION
+  capabilities.features |= MOPPY_FEATURE_MODULATION;
+#endif
+#ifdef BATCHED_OUTPUT
+  capabilities.features |= MOPPY_FEATURE_BATCHED_OUTPUT;
+#endif
+}
 
 void FloppyDrives::setup() {
 
@@ -69,7 +109,15 @@ void FloppyDrives::setup() {
   delay(500); // Wait a half second for safety
 
   // Setup timer to handle interrupts for floppy driving
+#ifdef STEP_SCHEDULER
+#ifdef BATCHED_OUTPUT
+  MoppyScheduler::initialize(step, commitOutputs); // Write once for all the drives stepped together
+#else
+  MoppyScheduler::initialize(step);
+#endif
+#else
   MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+#endif
 
   // If MoppyConfig wants a startup sound, play the startupSound on the
   // first drive.
@@ -82,11 +130,11 @@ void FloppyDrives::setup() {
 
 // Play startup sound to confirm drive functionality
 void FloppyDrives::startupSound(byte driveNum) {
-  unsigned int chargeNotes[] = {
-      noteDoubleTicks[31],
-      noteDoubleTicks[36],
-      noteDoubleTicks[38],
-      noteDoubleTicks[43],
+  period_t chargeNotes[] = {
+      doubleTicksForNote(31),
+      doubleTicksForNote(36),
+      doubleTicksForNote(38),
+      doubleTicksForNote(43),
       0
   };
   byte i = 0;
@@ -94,7 +142,7 @@ void FloppyDrives::startupSound(byte driveNum) {
   while(i < 5) {
     if (millis() - 200 > lastRun) {
       lastRun = millis();
-      currentPeriod[driveNum] = chargeNotes[i++];
+      setPeriod(driveNum, chargeNotes[i++]);
     }
   }
 }
@@ -119,14 +167,130 @@ void FloppyDrives::dev_reset(uint8_t subAddress) {
     }
 }
 
+#ifdef ARPEGGIO
+void FloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
+    if (payload[0] > MAX_FLOPPY_NOTE) {
+        return;
+    }
+    MoppyCriticalSection critical; // Keep tick() from switching notes while the chord changes
+    byte size = chordSize[subAddress];
+    for (byte i = 0; i < size; i++) {
+        if (chordNotes[subAddress][i] == payload[0]) {
+            return; // Already in the chord
+        }
+    }
+    if (size == 0) {
+        bendDeflection[subAddress] = 0; // New notes start unbent, as without ARPEGGIO
+    } else if (size == ARPEGGIO_NOTES) {
+        removeChordNote(subAddress, 0); // Make room by dropping the oldest
+        size--;
+    }
+    chordNotes[subAddress][size] = payload[0];
+    chordPeriods[subAddress][size] = bendPeriod(doubleTicksForNote(payload[0]), bendDeflection[subAddress]);
+    chordSize[subAddress] = size + 1;
+    if (size == 0) {
+        setPeriod(subAddress, chordPeriods[subAddress][0]);
+    } else {
+        currentPeriod[subAddress] = chordPeriods[subAddress][chordPosition[subAddress]];
+    }
+}
+
+void FloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
+    MoppyCriticalSection critical;
+    byte size = chordSize[subAddress];
+    for (byte i = 0; i < size; i++) {
+        if (chordNotes[subAddress][i] == payload[0]) {
+            removeChordNote(subAddress, i);
+            if (size == 1) {
+                setPeriod(subAddress, 0);
+            } else {
+                currentPeriod[subAddress] = chordPeriods[subAddress][chordPosition[subAddress]];
+            }
+            return;
+        }
+    }
+}
+
+void FloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
+    // A value from -8192 to 8191 representing the pitch deflection
+    bendDeflection[subAddress] = payload[0] << 8 | payload[1];
+
+    // Work out the bent periods first so interrupts are only held off to copy them in
+    period_t bent[ARPEGGIO_NOTES];
+    for (byte i = 0; i < ARPEGGIO_NOTES; i++) {
+        bent[i] = bendPeriod(doubleTicksForNote(chordNotes[subAddress][i]), bendDeflection[subAddress]);
+    }
+    MoppyCriticalSection critical;
+    byte size = chordSize[subAddress];
+    if (size == 0) {
+        return;
+    }
+    for (byte i = 0; i < size; i++) {
+        chordPeriods[subAddress][i] = bent[i];
+    }
+    currentPeriod[subAddress] = chordPeriods[subAddress][chordPosition[subAddress]];
+}
+
+// Takes a note out of a drive's chord (interrupts must be off), leaving chordPosition on the note
+// after it if it was the one playing
+void FloppyDrives::removeChordNote(byte driveNum, byte index) {
+    byte size = --chordSize[driveNum];
+    for (byte i = index; i < size; i++) {
+        chordNotes[driveNum][i] = chordNotes[driveNum][i + 1];
+        chordPeriods[driveNum][i] = chordPeriods[driveNum][i + 1];
+    }
+    if (index < chordPosition[driveNum]) {
+        chordPosition[driveNum]--;
+    }
+    if (chordPosition[driveNum] >= size) {
+        chordPosition[driveNum] = 0;
+    }
+}
+#elif defined(MODULATION)
 void FloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
     if (payload[0] <= MAX_FLOPPY_NOTE) {
-        currentPeriod[subAddress] = originalPeriod[subAddress] = noteDoubleTicks[payload[0]];
+        modulators[subAddress].noteOn(payload[0]);
+        setPeriod(subAddress, doubleTicksForPitch(modulators[subAddress].pitch()));
     }
 }
 
 void FloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    setPeriod(subAddress, 0); // Stops the modulator as well
+}
+
+void FloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
+    // A value from -8192 to 8191 representing the pitch deflection
+    modulators[subAddress].bend(payload[0] << 8 | payload[1]);
+    if (modulators[subAddress].isPlaying()) {
+        setPeriod(subAddress, doubleTicksForPitch(modulators[subAddress].pitch()));
+    }
+}
+
+// Sets a new period for every drive whose pitch has moved since the last update
+void FloppyDrives::update() {
+    unsigned long now = micros();
+    if (now - lastModulation < MODULATION_INTERVAL) {
+        return;
+    }
+    // Keep to the rate on average, but don't try to catch up after a long wait (e.g. a reset)
+    lastModulation = (now - lastModulation < 2 * MODULATION_INTERVAL) ? lastModulation + MODULATION_INTERVAL : now;
+    for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++) {
+        if (modulators[d].update()) {
+            setPeriod(d, doubleTicksForPitch(modulators[d].pitch()));
+        }
+    }
+}
+#else
+void FloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
+    if (payload[0] <= MAX_FLOPPY_NOTE) {
+        originalPeriod[subAddress] = doubleTicksForNote(payload[0]);
+        setPeriod(subAddress, originalPeriod[subAddress]);
+    }
+}
+
+void FloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
+    originalPeriod[subAddress] = 0;
+    setPeriod(subAddress, 0);
 }
 
 void FloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
@@ -134,19 +298,44 @@ void FloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
     // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
+    // Calculate bend based on BEND_OCTAVES (from MoppyTables.h) and percentage of deflection
     //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    setPeriod(subAddress, bendPeriod(originalPeriod[subAddress], bendDeflection));
 }
+#endif
 
 void FloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
     switch (command) {
     case NETBYTE_DEV_SETMOVEMENT:
         setMovement(subAddress, payload[0] == 0); // MIDI bytes only go to 127, so * 2
         break;
+#ifdef MODULATION
+    default:
+        if (subAddress == 0x00) {
+            for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++) {
+                modulators[d].handleMessage(command, payload);
+            }
+        } else {
+            modulators[subAddress].handleMessage(command, payload);
+        }
+        break;
+#endif
     }
 }
 
+#ifdef VOICE_POOL
+// For picking a pooled drive (see MoppyInstrument::preferredVoice()).  A HIGH direction pin means
+// the head's heading back toward MIN_POSITION.
+bool FloppyDrives::driveHead(uint8_t voice, DriveHead &head) {
+    byte d = MIN_SUB_ADDRESS + voice;
+    head.position = currentPosition[d];
+    head.minPosition = MIN_POSITION[d];
+    head.maxPosition = MAX_POSITION[d];
+    head.reversed = currentState[d * 2 + 1] == HIGH;
+    return true;
+}
+#endif
+
 void FloppyDrives::setMovement(byte driveNum, bool movementEnabled) {
     if (movementEnabled) {
         MIN_POSITION[driveNum] = 0;
@@ -169,6 +358,22 @@ Additionally, the ICACHE_RAM_ATTR helps avoid crashes with WiFi libraries, but m
  */
 #pragma GCC push_options
 #pragma GCC optimize("Ofast") // Required to unroll this loop, but useful to try to keep this speedy
+// Ticks DRIVE and then each drive after it (always inlined, so it all ends up in tick())
+template <byte DRIVE>
+inline __attribute__((always_inline)) void FloppyDrives::tickDrives() {
+  if (currentPeriod[DRIVE] > 0) {
+    currentTick[DRIVE] += PERIOD_ONE_TICK;
+    if (currentTick[DRIVE] >= currentPeriod[DRIVE]) {
+      togglePin<DRIVE>();
+      currentTick[DRIVE] = (currentTick[DRIVE] - currentPeriod[DRIVE]) & PERIOD_FRACTION_MASK;
+    }
+  }
+  tickDrives<DRIVE + 1>();
+}
+
+template <>
+inline __attribute__((always_inline)) void FloppyDrives::tickDrives<FloppyDrives::LAST_DRIVE + 1>() {}
+
 #ifdef ARDUINO_ARCH_ESP8266
 void ICACHE_RAM_ATTR FloppyDrives::tick() {
 #elif ARDUINO_ARCH_ESP32
@@ -176,49 +381,170 @@ void IRAM_ATTR FloppyDrives::tick() {
 #else
 void FloppyDrives::tick() {
 #endif
+#ifdef BATCHED_OUTPUT
+  // Write out the steps the previous tick decided on first, so they always happen at the same
+  // point in the interrupt no matter how many drives are stepping
+  commitOutputs();
+#endif
+
+#ifdef ARPEGGIO
+  if (--sliceTicksLeft == 0) {
+    sliceTicksLeft = ARPEGGIO_SLICE_TICKS;
+    nextChordNotes();
+  }
+#endif
+
   /*
    For each drive, count the number of
    ticks that pass, and toggle the pin if the current period is reached.
+   (The loop over drives is unrolled by tickDrives so every pin number is a constant.)
    */
-  for (int d = 1; d <= LAST_DRIVE; d++) {
-      if (currentPeriod[d] > 0) {
-          currentTick[d]++;
-          if (currentTick[d] >= currentPeriod[d]) {
-              togglePin(d, d*2, (d*2)+1); // Drive 1 is on pins 2 and 3, etc.
-              currentTick[d] = 0;
-          }
+  tickDrives<FIRST_DRIVE>();
+
+#ifdef BATCHED_OUTPUT
+  // Drives only change direction when they reverse, so there's rarely anything to write here.
+  // Doing it now puts a whole tick between the direction change and the step that needs it.
+  commitDirections();
+#endif
+}
+
+#ifdef ARPEGGIO
+// Moves every drive that's playing a chord on to the chord's next note.  The drive carries on
+// from wherever it was in its last period, so the switch doesn't add a step.
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR FloppyDrives::nextChordNotes() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR FloppyDrives::nextChordNotes() {
+#else
+void FloppyDrives::nextChordNotes() {
+#endif
+  for (byte d = FIRST_DRIVE; d <= LAST_DRIVE; d++) {
+    if (chordSize[d] > 1) {
+      byte position = chordPosition[d] + 1;
+      if (position >= chordSize[d]) {
+        position = 0;
       }
+      chordPosition[d] = position;
+      currentPeriod[d] = chordPeriods[d][position];
+    }
   }
 }
+#endif
 
+// Called by the step scheduler (instead of tick()) whenever a drive is due to step
 #ifdef ARDUINO_ARCH_ESP8266
-void ICACHE_RAM_ATTR FloppyDrives::togglePin(byte driveNum, byte pin, byte direction_pin) {
+void ICACHE_RAM_ATTR FloppyDrives::step(byte driveNum) {
 #elif ARDUINO_ARCH_ESP32
-void IRAM_ATTR FloppyDrives::togglePin(byte driveNum, byte pin, byte direction_pin) {
+void IRAM_ATTR FloppyDrives::step(byte driveNum) {
 #else
-void FloppyDrives::togglePin(byte driveNum, byte pin, byte direction_pin) {
+void FloppyDrives::step(byte driveNum) {
 #endif
+  static void (*const togglePins[])() = {
+      NULL, togglePin<1>, togglePin<2>, togglePin<3>, togglePin<4>,
+      togglePin<5>, togglePin<6>, togglePin<7>, togglePin<8>};
+  static_assert(sizeof(togglePins) / sizeof(togglePins[0]) == LAST_DRIVE + 1, "One togglePin per drive");
+  togglePins[driveNum]();
+}
 
-        //Switch directions if end has been reached
-        if (currentPosition[driveNum] >= MAX_POSITION[driveNum]) {
-            currentState[direction_pin] = HIGH;
-            digitalWrite(direction_pin, HIGH);
-        } else if (currentPosition[driveNum] <= MIN_POSITION[driveNum]) {
-            currentState[direction_pin] = LOW;
-            digitalWrite(direction_pin, LOW);
-        }
+// Drive 1 is on pins 2 and 3, etc.
+template <byte DRIVE>
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR FloppyDrives::togglePin() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR FloppyDrives::togglePin() {
+#else
+void FloppyDrives::togglePin() {
+#endif
+  const byte pin = DRIVE * 2;
+  const byte direction_pin = DRIVE * 2 + 1;
+
+  //Switch directions if end has been reached
+  if (currentPosition[DRIVE] >= MAX_POSITION[DRIVE]) {
+    currentState[direction_pin] = HIGH;
+    writeDirection<direction_pin>(HIGH);
+  } else if (currentPosition[DRIVE] <= MIN_POSITION[DRIVE]) {
+    currentState[direction_pin] = LOW;
+    writeDirection<direction_pin>(LOW);
+  }
 
-        //Update currentPosition
-        if (currentState[direction_pin] == HIGH) {
-            currentPosition[driveNum]--;
-        } else {
-            currentPosition[driveNum]++;
-        }
+  //Update currentPosition
+  if (currentState[direction_pin] == HIGH) {
+    currentPosition[DRIVE]--;
+  } else {
+    currentPosition[DRIVE]++;
+  }
+
+  //Pulse the control pin
+  writeStep<pin>(currentState[pin] != LOW);
+  currentState[pin] = ~currentState[pin];
+}
 
-        //Pulse the control pin
-        digitalWrite(pin, currentState[pin]);
-        currentState[pin] = ~currentState[pin];
+// Outputs a new state for a direction or step pin, either right away or (with BATCHED_OUTPUT)
+// at the next commitOutputs()
+template <byte PIN>
+inline __attribute__((always_inline)) void FloppyDrives::writeDirection(bool value) {
+#ifdef BATCHED_OUTPUT
+  queueWrite<PIN>(value, pendingDirectionSet, pendingDirectionClear);
+#else
+  FastPin<PIN>::write(value);
+#endif
+}
+
+template <byte PIN>
+inline __attribute__((always_inline)) void FloppyDrives::writeStep(bool value) {
+#ifdef BATCHED_OUTPUT
+  queueWrite<PIN>(value, pendingStepSet, pendingStepClear);
+#else
+  FastPin<PIN>::write(value);
+#endif
+}
+
+#ifdef BATCHED_OUTPUT
+template <byte PIN>
+inline __attribute__((always_inline)) void FloppyDrives::queueWrite(bool value, fastport_mask_t set[], fastport_mask_t clear[]) {
+  if (FastPin<PIN>::PORT == FASTPORT_NONE) {
+    FastPin<PIN>::write(value); // Not on a port that can be written all at once, so just write it now
+  } else if (value) {
+    set[FastPin<PIN>::PORT] |= FastPin<PIN>::MASK;
+  } else {
+    clear[FastPin<PIN>::PORT] |= FastPin<PIN>::MASK;
+  }
+}
+
+// Writes the queued step changes with one write per port, after any direction changes that are
+// still waiting (so they're settled before the step pins change), then starts the queue over
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR FloppyDrives::commitOutputs() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR FloppyDrives::commitOutputs() {
+#else
+void FloppyDrives::commitOutputs() {
+#endif
+  commitDirections(); // Only ever anything left here with the step scheduler
+  for (byte p = 0; p < FASTPORT_COUNT; p++) {
+    FastPort::write(p, pendingStepSet[p], pendingStepClear[p]);
+    pendingStepSet[p] = 0;
+    pendingStepClear[p] = 0;
+  }
+}
+
+// Writes the queued direction changes, only touching ports that have any
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR FloppyDrives::commitDirections() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR FloppyDrives::commitDirections() {
+#else
+void FloppyDrives::commitDirections() {
+#endif
+  for (byte p = 0; p < FASTPORT_COUNT; p++) {
+    if ((pendingDirectionSet[p] | pendingDirectionClear[p]) != 0) {
+      FastPort::write(p, pendingDirectionSet[p], pendingDirectionClear[p]);
+      pendingDirectionSet[p] = 0;
+      pendingDirectionClear[p] = 0;
     }
+  }
+}
+#endif
 #pragma GCC pop_options
 
 //
@@ -232,17 +558,42 @@ void FloppyDrives::blinkLED(){
   digitalWrite(13, LOW);
 }
 
+// Sets the period for a drive, letting the step scheduler know about it if that's in use
+void FloppyDrives::setPeriod(byte driveNum, period_t period) {
+  // Called from loop() (e.g. by update()), and tick() mustn't see a period_t half written
+  MoppyCriticalSection critical;
+  currentPeriod[driveNum] = period;
+#ifdef ARPEGGIO
+  if (period == 0) {
+    chordSize[driveNum] = 0; // Stopping a drive drops its whole chord
+    chordPosition[driveNum] = 0;
+  }
+#endif
+#ifdef MODULATION
+  if (period == 0) {
+    modulators[driveNum].noteOff();
+  }
+#endif
+#ifdef STEP_SCHEDULER
+  MoppyScheduler::setPeriod(driveNum, period);
+#else
+  if (period == 0) {
+    currentTick[driveNum] = 0; // So the next note starts from the beginning of its period
+  }
+#endif
+}
+
 // Immediately stops all drives
 void FloppyDrives::haltAllDrives() {
   for (byte d=FIRST_DRIVE;d<=LAST_DRIVE;d++) {
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
   }
 }
 
 //For a given floppy number, runs the read-head all the way back to 0
 void FloppyDrives::reset(byte driveNum)
 {
-  currentPeriod[driveNum] = 0; // Stop note
+  setPeriod(driveNum, 0); // Stop note
 
   byte stepPin = driveNum * 2;
   digitalWrite(stepPin+1,HIGH); // Go in reverse
@@ -265,7 +616,7 @@ void FloppyDrives::resetAll()
   // Stop all drives and set to reverse
   for (byte d=FIRST_DRIVE;d<=LAST_DRIVE;d++) {
     byte stepPin = d * 2;
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
     digitalWrite(stepPin+1,HIGH);
   }
 
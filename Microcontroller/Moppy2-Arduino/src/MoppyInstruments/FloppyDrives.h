@@ -8,14 +8,39 @@
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyScheduler.h"
 #include "MoppyInstrument.h"
+#include "FastPin.h"
+#include "MoppyModulation.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
+#ifdef ARPEGGIO
+#ifdef STEP_SCHEDULER
+#error "ARPEGGIO switches notes in the fixed-rate tick, so can't be used with STEP_SCHEDULER"
+#endif
+#ifndef ARPEGGIO_RATE
+#define ARPEGGIO_RATE 40
+#endif
+#ifndef ARPEGGIO_NOTES
+#define ARPEGGIO_NOTES 4
+#endif
+// Ticks that each note of a chord plays for before switching to the next
+#define ARPEGGIO_SLICE_TICKS (1000000UL / ((unsigned long)TIMER_RESOLUTION * ARPEGGIO_RATE))
+#endif
+
+#if defined(MODULATION) && defined(ARPEGGIO)
+#error "MODULATION and ARPEGGIO both set drives' periods outside of note messages, enable only one"
+#endif
+
 namespace instruments {
   class FloppyDrives : public MoppyInstrument {
   public:
       void setup();
+      void describe(MoppyCapabilities &capabilities) override;
+#ifdef MODULATION
+      void update() override;
+#endif
 
   protected:
       void sys_sequenceStop() override;
@@ -27,15 +52,36 @@ namespace instruments {
       void dev_bendPitch(uint8_t subAddress, uint8_t payload[]) override;
 
       void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
+#ifdef VOICE_POOL
+      bool driveHead(uint8_t voice, DriveHead &head) override;
+#endif
 
   private:
     static unsigned int MIN_POSITION[];
     static unsigned int MAX_POSITION[];
     static unsigned int currentPosition[];
     static int currentState[];
-    static unsigned int currentPeriod[];
-    static unsigned int currentTick[];
-    static unsigned int originalPeriod[];
+    static period_t currentPeriod[];
+    static period_t currentTick[];
+    static period_t originalPeriod[];
+
+#ifdef MODULATION
+    static MoppyModulator modulators[];
+    static unsigned long lastModulation;
+#endif
+
+#ifdef ARPEGGIO
+    // Notes each drive is switching between (oldest first), and their periods after any bend
+    static uint8_t chordNotes[][ARPEGGIO_NOTES];
+    static period_t chordPeriods[][ARPEGGIO_NOTES];
+    static byte chordSize[];
+    static byte chordPosition[]; // Which of the chord's notes is playing
+    static int16_t bendDeflection[];
+    static uint16_t sliceTicksLeft;
+
+    static void nextChordNotes();
+    static void removeChordNote(byte driveNum, byte index);
+#endif
 
     // First drive being used for floppies, and the last drive.  Used for calculating
     // step and direction pins.
@@ -47,13 +93,29 @@ namespace instruments {
     static const byte MAX_FLOPPY_NOTE = 71;
 
     static void resetAll();
-    static void togglePin(byte driveNum, byte pin, byte direction_pin);
+    template <byte DRIVE> static void togglePin();
+    template <byte PIN> static void writeDirection(bool value);
+    template <byte PIN> static void writeStep(bool value);
     static void haltAllDrives();
     static void reset(byte driveNum);
     static void tick();
+    template <byte DRIVE> static void tickDrives();
+    static void step(byte driveNum);
+    static void setPeriod(byte driveNum, period_t period);
     static void blinkLED();
     static void startupSound(byte driveNum);
     static void setMovement(byte driveNum, bool movementEnabled);
+
+#ifdef BATCHED_OUTPUT
+    static fastport_mask_t pendingDirectionSet[FASTPORT_COUNT];
+    static fastport_mask_t pendingDirectionClear[FASTPORT_COUNT];
+    static fastport_mask_t pendingStepSet[FASTPORT_COUNT];
+    static fastport_mask_t pendingStepClear[FASTPORT_COUNT];
+
+    template <byte PIN> static void queueWrite(bool value, fastport_mask_t set[], fastport_mask_t clear[]);
+    static void commitOutputs();
+    static void commitDirections();
+#endif
   };
 }
 
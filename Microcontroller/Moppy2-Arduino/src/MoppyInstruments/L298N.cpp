@@ -34,13 +34,19 @@ int L298N::currentDir[] = {0,0,0,0,0};
 
 // Current period assigned to each drive.  0 = off.  Each period is two-ticks (as defined by
 // TIMER_RESOLUTION in MoppyInstrument.h) long.
-unsigned int L298N::currentPeriod[] = {0,0,0,0,0};
+period_t L298N::currentPeriod[] = {0,0,0,0,0};
 
 // Tracks the current tick-count for each drive (see FloppyDrives::tick() below)
-unsigned int L298N::currentTick[] = {0,0,0,0,0};
+period_t L298N::currentTick[] = {0,0,0,0,0};
 
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
-unsigned int L298N::originalPeriod[] = {0,0,0,0,0};
+period_t L298N::originalPeriod[] = {0,0,0,0,0};
+
+void L298N::describe(MoppyCapabilities &capabilities) {
+  MoppyInstrument::describe(capabilities);
+  capabilities.instrumentType = MOPPY_INSTRUMENT_L298N;
+  capabilities.voices = LAST_BRIDGE - FIRST_BRIDGE + 1;
+}
 
 void L298N::setup() {
 
@@ -68,7 +74,11 @@ void L298N::setup() {
   delay(500); // Wait a half second for safety
 
   // Setup timer to handle interrupts for driving the bridges
+#ifdef STEP_SCHEDULER
+  MoppyScheduler::initialize(stepBridge);
+#else
   MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+#endif
 
   // If MoppyConfig wants a startup sound, play the startupSound on the
   // first drive.
@@ -81,11 +91,11 @@ void L298N::setup() {
 
 // Play startup sound to confirm drive functionality
 void L298N::startupSound(byte driveNum) {
-  unsigned int chargeNotes[] = {
-      noteTicks[31],
-      noteTicks[36],
-      noteTicks[38],
-      noteTicks[43],
+  period_t chargeNotes[] = {
+      ticksForNote(31),
+      ticksForNote(36),
+      ticksForNote(38),
+      ticksForNote(43),
       0
   };
   byte i = 0;
@@ -93,7 +103,7 @@ void L298N::startupSound(byte driveNum) {
   while(i < 5) {
     if (millis() - 200 > lastRun) {
       lastRun = millis();
-      currentPeriod[driveNum] = chargeNotes[i++];
+      setPeriod(driveNum, chargeNotes[i++]);
     }
   }
 }
@@ -119,11 +129,13 @@ void L298N::dev_reset(uint8_t subAddress) {
 }
 
 void L298N::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = noteTicks[payload[0]];
+    originalPeriod[subAddress] = ticksForNote(payload[0]);
+    setPeriod(subAddress, originalPeriod[subAddress]);
 }
 
 void L298N::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress] = originalPeriod[subAddress] = 0;
+    originalPeriod[subAddress] = 0;
+    setPeriod(subAddress, 0);
 };
 
 void L298N::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
@@ -131,9 +143,9 @@ void L298N::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
     // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
+    // Calculate bend based on BEND_OCTAVES (from MoppyTables.h) and percentage of deflection
     //L298N::currentPeriod[subAddress] = L298N::originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress] = originalPeriod[subAddress] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    setPeriod(subAddress, bendPeriod(originalPeriod[subAddress], bendDeflection));
 };
 
 //
@@ -151,37 +163,49 @@ void L298N::tick()
    ticks that pass, and toggle the pin if the current period is reached.
    */
   if (currentPeriod[1]>0){
-    currentTick[1]++;
+    currentTick[1] += PERIOD_ONE_TICK;
     if (currentTick[1] >= currentPeriod[1]){
-      step(1,2,3,4,5); // Bridge 1 is on pin 2,3,4,5
-      currentTick[1]=0;
+      step<1>(); // Bridge 1 is on pin 2,3,4,5
+      currentTick[1] = (currentTick[1] - currentPeriod[1]) & PERIOD_FRACTION_MASK;
     }
   }
   if (currentPeriod[2]>0){
-    currentTick[2]++;
+    currentTick[2] += PERIOD_ONE_TICK;
     if (currentTick[2] >= currentPeriod[2]){
-      step(2,6,7,8,9);
-      currentTick[2]=0;
+      step<2>();
+      currentTick[2] = (currentTick[2] - currentPeriod[2]) & PERIOD_FRACTION_MASK;
     }
   }
   if (currentPeriod[3]>0){
-    currentTick[3]++;
+    currentTick[3] += PERIOD_ONE_TICK;
     if (currentTick[3] >= currentPeriod[3]){
-      step(3,10,11,12,13);
-      currentTick[3]=0;
+      step<3>();
+      currentTick[3] = (currentTick[3] - currentPeriod[3]) & PERIOD_FRACTION_MASK;
     }
   }
-  if (currentPeriod[3]>0){
-    currentTick[3]++;
-    if (currentTick[3] >= currentPeriod[3]){
-      step(4,14,15,16,17);
-      currentTick[3]=0;
+  if (currentPeriod[4]>0){
+    currentTick[4] += PERIOD_ONE_TICK;
+    if (currentTick[4] >= currentPeriod[4]){
+      step<4>();
+      currentTick[4] = (currentTick[4] - currentPeriod[4]) & PERIOD_FRACTION_MASK;
     }
   }
 }
 
+// Called by the step scheduler (instead of tick()) whenever a bridge is due to step
+void L298N::stepBridge(byte bridgeNum) {
+  static void (*const steps[])() = {NULL, step<1>, step<2>, step<3>, step<4>};
+  steps[bridgeNum]();
+}
+
+template <byte BRIDGE>
+void L298N::step() {
+  const byte bridgeNum = BRIDGE;
+  const byte pin1 = (BRIDGE - 1) * 4 + 2; // 2, 6, 10, 14
+  const byte pin2 = pin1 + 1;
+  const byte pin3 = pin1 + 2;
+  const byte pin4 = pin1 + 3;
 
-void L298N::step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4) {
   //Switch directions if end has been reached
   if (currentPosition[bridgeNum] >= MAX_POSITION[bridgeNum]) {
     currentDir[bridgeNum] = 1;
@@ -218,30 +242,30 @@ void L298N::step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4) {
 switch (currentStep[bridgeNum]) { // Table of steps. Steps need to follow this order. If in reverse,
 // we start from the bottom.
       case 0:  
-        digitalWrite(pin1, HIGH);
-        digitalWrite(pin2, LOW);
-        digitalWrite(pin3, HIGH);
-        digitalWrite(pin4, LOW);
+        FastPin<pin1>::high();
+        FastPin<pin2>::low();
+        FastPin<pin3>::high();
+        FastPin<pin4>::low();
       break;
       case 1:   
-        digitalWrite(pin1, LOW);
-        digitalWrite(pin2, HIGH);
-        digitalWrite(pin3, HIGH);
-        digitalWrite(pin4, LOW);
+        FastPin<pin1>::low();
+        FastPin<pin2>::high();
+        FastPin<pin3>::high();
+        FastPin<pin4>::low();
 
       break;
       case 2:  	 
-        digitalWrite(pin1, LOW);
-        digitalWrite(pin2, HIGH);
-        digitalWrite(pin3, LOW);
-        digitalWrite(pin4, HIGH);
+        FastPin<pin1>::low();
+        FastPin<pin2>::high();
+        FastPin<pin3>::low();
+        FastPin<pin4>::high();
       break;
       case 3:  
  
-        digitalWrite(pin1, HIGH);
-        digitalWrite(pin2, LOW);
-        digitalWrite(pin3, LOW);
-        digitalWrite(pin4, HIGH);
+        FastPin<pin1>::high();
+        FastPin<pin2>::low();
+        FastPin<pin3>::low();
+        FastPin<pin4>::high();
       break;
     }
 }
@@ -258,17 +282,30 @@ void L298N::blinkLED(){
   digitalWrite(13, LOW);
 }
 
+// Sets the period for a bridge, letting the step scheduler know about it if that's in use
+void L298N::setPeriod(byte bridgeNum, period_t period) {
+  MoppyCriticalSection critical; // Keep tick() from reading a half-written period
+  currentPeriod[bridgeNum] = period;
+#ifdef STEP_SCHEDULER
+  MoppyScheduler::setPeriod(bridgeNum, period);
+#else
+  if (period == 0) {
+    currentTick[bridgeNum] = 0; // So the next note starts from the beginning of its period
+  }
+#endif
+}
+
 // Immediately stops all drives
 void L298N::haltAllDrives() {
   for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
   }
 }
 
 //For a given bridge number, stop the note and set its position to zero
 void L298N::reset(byte bridgeNum)
 {
-  currentPeriod[bridgeNum] = 0; // Stop note
+  setPeriod(bridgeNum, 0); // Stop note
   currentPosition[bridgeNum] = 0; // We're reset.
 }
 
@@ -278,7 +315,7 @@ void L298N::resetAll()
 
   // Stop all bridges and set to reverse
   for (byte d=FIRST_BRIDGE;d<=LAST_BRIDGE;d++) {
-    currentPeriod[d] = 0;
+    setPeriod(d, 0);
   }
 
   // Reset all drives together
@@ -24,7 +24,9 @@ pin 17 (A3), IN4 for bridge 4
 
 #include <Arduino.h>
 #include "MoppyTimer.h"
+#include "MoppyScheduler.h"
 #include "MoppyInstrument.h"
+#include "FastPin.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
@@ -32,6 +34,7 @@ namespace instruments {
   class L298N : public MoppyInstrument {
   public:
     void setup();
+    void describe(MoppyCapabilities &capabilities) override;
   protected:
     void sys_sequenceStop() override;
     void sys_reset() override;
@@ -47,14 +50,16 @@ namespace instruments {
     static unsigned int currentPosition[];
     static int currentStep[];
     static int currentDir[];
-    static unsigned int currentPeriod[];
-    static unsigned int currentTick[];
-    static unsigned int originalPeriod[];
+    static period_t currentPeriod[];
+    static period_t currentTick[];
+    static period_t originalPeriod[];
     static void resetAll();
-    static void step(byte bridgeNum, byte pin1, byte pin2, byte pin3, byte pin4);
+    template <byte BRIDGE> static void step();
     static void haltAllDrives();
     static void reset(byte bridgeNum);
     static void tick();
+    static void stepBridge(byte bridgeNum);
+    static void setPeriod(byte bridgeNum, period_t period);
     static void blinkLED();
     static void startupSound(byte bridgeNum);
     static void L298Nvariables();
@@ -0,0 +1,129 @@
+/*
+ * MoppyIsrStats.cpp
+ *
+ */
+#include "MoppyIsrStats.h"
+
+#ifdef ISR_STATS
+#include "MoppyTimer.h"
+
+uint32_t MoppyIsrStats::count = 0;
+uint32_t MoppyIsrStats::countForMean = 0;
+uint32_t MoppyIsrStats::total = 0;
+uint32_t MoppyIsrStats::minimum = 0xFFFFFFFF;
+uint32_t MoppyIsrStats::maximum = 0;
+uint32_t MoppyIsrStats::overruns = 0;
+uint16_t MoppyIsrStats::buckets[ISR_STATS_BUCKETS];
+
+#ifdef ARDUINO_ARCH_ESP32
+static portMUX_TYPE statsMux = portMUX_INITIALIZER_UNLOCKED;
+#endif
+
+/*
+ * Keeps record() out while the stats are read or reset.  On the ESP32 they can be read from the
+ * other core (by the UDP network task), where masking interrupts doesn't stop the timer
+ * interrupt, so both sides take a spinlock there instead.
+ */
+class StatsLock {
+#ifdef ARDUINO_ARCH_ESP32
+public:
+    StatsLock() { portENTER_CRITICAL(&statsMux); }
+    ~StatsLock() { portEXIT_CRITICAL(&statsMux); }
+#else
+    MoppyCriticalSection critical;
+#endif
+};
+
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyIsrStats::record(uint32_t cycles, bool overrun) {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyIsrStats::record(uint32_t cycles, bool overrun) {
+#else
+void MoppyIsrStats::record(uint32_t cycles, bool overrun) {
+#endif
+#ifdef ARDUINO_ARCH_ESP32
+    portENTER_CRITICAL_ISR(&statsMux);
+#endif
+    count++;
+    if (overrun) {
+        overruns++;
+    }
+    if (cycles < minimum) {
+        minimum = cycles;
+    }
+    if (cycles > maximum) {
+        maximum = cycles;
+    }
+
+    // Halving both keeps the mean the same, and is much cheaper than 64-bit math
+    if (total + cycles < total) {
+        total >>= 1;
+        countForMean >>= 1;
+    }
+    total += cycles;
+    countForMean++;
+
+    uint8_t bucket = 0;
+    while ((cycles >>= 1) != 0 && bucket < ISR_STATS_BUCKETS - 1) {
+        bucket++;
+    }
+    if (buckets[bucket] != 0xFFFF) {
+        buckets[bucket]++;
+    }
+#ifdef ARDUINO_ARCH_ESP32
+    portEXIT_CRITICAL_ISR(&statsMux);
+#endif
+}
+#pragma GCC pop_options
+
+static uint8_t *writeLong(uint8_t *out, uint32_t value) {
+    *out++ = value >> 24;
+    *out++ = value >> 16;
+    *out++ = value >> 8;
+    *out++ = value;
+    return out;
+}
+
+uint8_t MoppyIsrStats::write(uint8_t payload[]) {
+    uint32_t snapshotCount, snapshotMin, snapshotMean, snapshotMax, snapshotOverruns;
+    uint16_t snapshotBuckets[ISR_STATS_BUCKETS];
+    {
+        StatsLock lock;
+        snapshotCount = count;
+        snapshotMin = count > 0 ? minimum : 0;
+        snapshotMean = countForMean > 0 ? total / countForMean : 0;
+        snapshotMax = maximum;
+        snapshotOverruns = overruns;
+        memcpy(snapshotBuckets, buckets, sizeof(buckets));
+    }
+
+    uint8_t *out = payload;
+    *out++ = DEVICE_ADDRESS;
+    *out++ = F_CPU / 1000000UL;
+    out = writeLong(out, snapshotCount);
+    out = writeLong(out, snapshotMin);
+    out = writeLong(out, snapshotMean);
+    out = writeLong(out, snapshotMax);
+    out = writeLong(out, snapshotOverruns);
+    *out++ = ISR_STATS_BUCKETS;
+    for (uint8_t i = 0; i < ISR_STATS_BUCKETS; i++) {
+        *out++ = snapshotBuckets[i] >> 8;
+        *out++ = snapshotBuckets[i];
+    }
+    return out - payload;
+}
+
+void MoppyIsrStats::reset() {
+    StatsLock lock;
+    count = 0;
+    countForMean = 0;
+    total = 0;
+    minimum = 0xFFFFFFFF;
+    maximum = 0;
+    overruns = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+#endif /* ISR_STATS */
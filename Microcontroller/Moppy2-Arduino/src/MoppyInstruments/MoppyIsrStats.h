@@ -0,0 +1,58 @@
+/*
+ * MoppyIsrStats.h
+ * Keeps track of how long the STEP timer interrupt (i.e. the instrument's tick() or the step
+ * scheduler) takes, so the number of drives a board can handle can be worked out from data rather
+ * than by listening for glitches.  Only compiled in when ISR_STATS is defined in MoppyConfig.h.
+ *
+ * Times are in CPU cycles.  On AVR they're measured from the moment the interrupt was due (so they
+ * include the interrupt latency), on the ESPs from the start of the interrupt handler.  An overrun
+ * is counted whenever the interrupt doesn't finish before the next one is due.
+ */
+
+#ifndef SRC_MOPPYINSTRUMENTS_MOPPYISRSTATS_H_
+#define SRC_MOPPYINSTRUMENTS_MOPPYISRSTATS_H_
+
+#include <Arduino.h>
+#include "../MoppyConfig.h"
+
+#ifdef ISR_STATS
+
+// Histogram bucket i counts interrupts that took 2^i to 2^(i+1)-1 cycles (the last bucket also
+// counts anything longer)
+#define ISR_STATS_BUCKETS 16
+
+// Length of the payload written by MoppyIsrStats::write()
+#define ISR_STATS_PAYLOAD_LENGTH (23 + ISR_STATS_BUCKETS * 2)
+
+class MoppyIsrStats {
+public:
+    // Adds one interrupt's duration (called from the timer interrupt)
+    static void record(uint32_t cycles, bool overrun);
+
+    // Writes the current statistics to payload (ISR_STATS_PAYLOAD_LENGTH bytes, big-endian):
+    //  0     - Device address
+    //  1     - CPU cycles per microsecond
+    //  2-5   - Number of interrupts measured
+    //  6-9   - Minimum cycles
+    //  10-13 - Mean cycles
+    //  14-17 - Maximum cycles
+    //  18-21 - Number of overruns
+    //  22    - Number of histogram buckets (ISR_STATS_BUCKETS)
+    //  23... - Two-byte count for each histogram bucket
+    static uint8_t write(uint8_t payload[]);
+
+    // Starts over from nothing
+    static void reset();
+
+private:
+    static uint32_t count;
+    static uint32_t countForMean; // Halved along with total whenever total would overflow
+    static uint32_t total;
+    static uint32_t minimum;
+    static uint32_t maximum;
+    static uint32_t overruns;
+    static uint16_t buckets[ISR_STATS_BUCKETS];
+};
+
+#endif /* ISR_STATS */
+#endif /* SRC_MOPPYINSTRUMENTS_MOPPYISRSTATS_H_ */
@@ -0,0 +1,155 @@
+/*
+ * MoppyModulation.cpp
+ *
+ */
+#include "MoppyModulation.h"
+
+#ifdef MODULATION
+#include <Arduino.h>
+#include "MoppyTables.h"
+#include "../MoppyNetworks/MoppyNetwork.h"
+
+// Pitch-bend range in 256ths of a semitone
+#define BEND_RANGE ((int32_t)((BEND_OCTAVES) * 12 * 256 + 0.5))
+
+// Modulation stays within the note tables, so it never turns a note off
+#define MIN_PITCH ((int32_t)FIRST_TABLE_NOTE << 16)
+#define MAX_PITCH ((int32_t)LAST_TABLE_NOTE << 16)
+
+// Vibrato rate until one's been set, so the modulation wheel works on its own
+#define DEFAULT_VIBRATO_RATE 50 // Tenths of a Hz
+
+// Number of updates in a time in milliseconds
+static uint16_t updatesFor(uint16_t milliseconds) {
+    return ((uint32_t)milliseconds * MODULATION_RATE + 500) / 1000;
+}
+
+// A pitch-bend deflection as an offset in 65536ths of a semitone
+static int32_t bendToPitch(int16_t deflection) {
+    return ((int32_t)deflection * BEND_RANGE) >> 5; // * 65536 / 256 / 8192
+}
+
+void MoppyModulator::noteOn(uint8_t note) {
+    targetPitch = (int32_t)note << 16;
+    int32_t distance = targetPitch - notePitch;
+    if (glideUpdates > 0 && started && distance != 0) {
+        glideStep = distance / glideUpdates;
+        if (glideStep == 0) {
+            glideStep = distance > 0 ? 1 : -1;
+        }
+    } else {
+        notePitch = targetPitch;
+    }
+    started = true;
+    playing = true;
+
+    bendPitch = bendTarget = 0;
+    bendUpdatesLeft = 0;
+    vibratoPhase = 0;
+    lastPitch = calculatePitch();
+}
+
+void MoppyModulator::noteOff() {
+    playing = false;
+}
+
+void MoppyModulator::setGlide(uint16_t milliseconds) {
+    glideUpdates = updatesFor(milliseconds);
+}
+
+void MoppyModulator::setVibrato(uint8_t depthCents, uint8_t rateTenthsHz) {
+    setVibratoDepth(depthCents);
+    vibratoStep = (uint32_t)rateTenthsHz * 65536 / (10 * MODULATION_RATE);
+}
+
+void MoppyModulator::setVibratoDepth(uint8_t depthCents) {
+    vibratoDepth = (uint16_t)depthCents * 256 / 100;
+    if (vibratoStep == 0) {
+        vibratoStep = (uint32_t)DEFAULT_VIBRATO_RATE * 65536 / (10 * MODULATION_RATE);
+    }
+}
+
+void MoppyModulator::bend(int16_t deflection) {
+    bendPitch = bendTarget = bendToPitch(deflection);
+    bendUpdatesLeft = 0;
+    lastPitch = calculatePitch(); // Takes effect right away rather than at the next update
+}
+
+void MoppyModulator::rampBend(int16_t deflection, uint16_t milliseconds) {
+    bendTarget = bendToPitch(deflection);
+    bendUpdatesLeft = updatesFor(milliseconds);
+    if (bendUpdatesLeft == 0) {
+        bend(deflection);
+    } else {
+        bendStep = (bendTarget - bendPitch) / bendUpdatesLeft;
+    }
+}
+
+bool MoppyModulator::handleMessage(uint8_t command, uint8_t payload[]) {
+    switch (command) {
+    case NETBYTE_DEV_GLIDE:
+        setGlide(payload[0] << 8 | payload[1]);
+        return true;
+    case NETBYTE_DEV_VIBRATO:
+        setVibrato(payload[0], payload[1]);
+        return true;
+    case NETBYTE_DEV_BENDRAMP:
+        rampBend(payload[0] << 8 | payload[1], payload[2] << 8 | payload[3]);
+        return true;
+    case NETBYTE_DEV_CONTROLCHANGE:
+        if (payload[0] == MIDI_CC_MODULATION) {
+            setVibratoDepth(payload[1]);
+            return true;
+        } else if (payload[0] == MIDI_CC_PORTAMENTOTIME) {
+            setGlide(payload[1] * 10);
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool MoppyModulator::update() {
+    if (!playing) {
+        return false;
+    }
+    if (notePitch != targetPitch) {
+        notePitch += glideStep;
+        if ((glideStep > 0 && notePitch > targetPitch) || (glideStep < 0 && notePitch < targetPitch)) {
+            notePitch = targetPitch;
+        }
+    }
+    if (bendUpdatesLeft > 0) {
+        bendPitch = --bendUpdatesLeft == 0 ? bendTarget : bendPitch + bendStep;
+    }
+    if (vibratoDepth > 0) {
+        vibratoPhase += vibratoStep;
+    }
+
+    uint16_t pitch = calculatePitch();
+    if (pitch == lastPitch) {
+        return false;
+    }
+    lastPitch = pitch;
+    return true;
+}
+
+uint16_t MoppyModulator::calculatePitch() const {
+    int32_t pitch = notePitch + bendPitch;
+    if (vibratoDepth > 0) {
+        // Triangle wave from -32767 to 32767, starting from 0 on the way up
+        uint16_t phase = vibratoPhase + 0x4000;
+        uint16_t rise = (phase & 0x8000) ? (~phase & 0x7FFF) : (phase & 0x7FFF);
+        int32_t wave = 2 * (int32_t)rise - 0x7FFF;
+        pitch += ((int32_t)vibratoDepth * wave) >> 7; // 256ths times Q15, to 65536ths
+    }
+    if (pitch < MIN_PITCH) {
+        pitch = MIN_PITCH;
+    } else if (pitch > MAX_PITCH) {
+        pitch = MAX_PITCH;
+    }
+    return (pitch + 0x80) >> 8;
+}
+
+#endif /* MODULATION */
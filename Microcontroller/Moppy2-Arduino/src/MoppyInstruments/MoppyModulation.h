@@ -0,0 +1,83 @@
+/*
+ * MoppyModulation.h
+ * Glide (portamento), vibrato, and pitch-bend ramps worked out on the device, so the Controller
+ * only has to send one message to start each of them rather than a stream of pitch bends.  Only
+ * compiled in when MODULATION is defined in MoppyConfig.h.
+ *
+ * Each voice has a MoppyModulator that keeps track of its pitch in fixed point (65536ths of a
+ * semitone).  The instrument calls update() on every voice MODULATION_RATE times a second from
+ * loop(), and sets a new period for any voice whose pitch has changed.
+ *
+ * Device messages (to a sub-address, or to sub-address 0 for every voice):
+ *  NETBYTE_DEV_GLIDE    - Time in milliseconds for each new note to slide from the last one
+ *  NETBYTE_DEV_VIBRATO  - Vibrato depth (either side of the note) in cents and rate in tenths of a
+ *                         Hz
+ *  NETBYTE_DEV_BENDRAMP - Bend smoothly from the current bend to a new one over a time in
+ *                         milliseconds
+ * And for MIDI control changes (see MoppyMidi.h): the modulation wheel (CC 1) sets the vibrato
+ * depth in cents, and portamento time (CC 5) sets the glide time in tens of milliseconds.
+ */
+
+#ifndef SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_
+#define SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_
+
+#include <stdint.h>
+#include "../MoppyConfig.h"
+
+#ifdef MODULATION
+
+#ifndef MODULATION_RATE
+#define MODULATION_RATE 100
+#endif
+#define MODULATION_INTERVAL (1000000UL / MODULATION_RATE) // Microseconds between updates
+
+#define MIDI_CC_MODULATION 1
+#define MIDI_CC_PORTAMENTOTIME 5
+
+class MoppyModulator {
+public:
+    // Starts a note, from the last note's pitch if there's a glide.  Any bend is cleared.
+    void noteOn(uint8_t note);
+    void noteOff();
+    bool isPlaying() const { return playing; }
+
+    void setGlide(uint16_t milliseconds);
+    void setVibrato(uint8_t depthCents, uint8_t rateTenthsHz);
+    void setVibratoDepth(uint8_t depthCents);
+    // Deflections are from -8192 to 8191, as for NETBYTE_DEV_BENDPITCH
+    void bend(int16_t deflection);
+    void rampBend(int16_t deflection, uint16_t milliseconds);
+
+    // Handles any of the device messages above, returning false for anything else
+    bool handleMessage(uint8_t command, uint8_t payload[]);
+
+    // Moves everything on by one update, returning true if the pitch has changed
+    bool update();
+
+    // Current pitch in 256ths of a semitone
+    uint16_t pitch() const { return lastPitch; }
+
+private:
+    int32_t notePitch = 0;   // Where the glide's got to
+    int32_t targetPitch = 0; // The note's own pitch
+    int32_t glideStep = 0;   // Per update
+    uint16_t glideUpdates = 0;
+
+    int32_t bendPitch = 0; // Offset from the bend
+    int32_t bendTarget = 0;
+    int32_t bendStep = 0;
+    uint16_t bendUpdatesLeft = 0;
+
+    uint16_t vibratoDepth = 0; // In 256ths of a semitone
+    uint16_t vibratoPhase = 0;
+    uint16_t vibratoStep = 0; // Per update
+
+    uint16_t lastPitch = 0;
+    bool playing = false;
+    bool started = false; // Whether there's been a note to glide from
+
+    uint16_t calculatePitch() const;
+};
+
+#endif /* MODULATION */
+#endif /* SRC_MOPPYINSTRUMENTS_MOPPYMODULATION_H_ */
@@ -0,0 +1,149 @@
+/*
+ * MoppyScheduler.cpp
+ *
+ * Next-deadline step scheduling on top of MoppyTimer's one-shot mode.
+ */
+#include "MoppyScheduler.h"
+
+// Voices due within this many microseconds of an expiry are stepped along with it rather than
+// arming a separate (tiny) interval for them
+#define SCHEDULER_SLACK ((long)(2 * ONESHOT_RESOLUTION))
+
+// Never arm an interval ending sooner than this after "now", so there's time to finish
+// what we're doing before the timer fires
+#ifdef ARDUINO_ARCH_AVR
+#define SCHEDULER_LEAD 16
+#else
+#define SCHEDULER_LEAD 4
+#endif
+
+void (*MoppyScheduler::stepHandler)(byte voice) = NULL;
+void (*MoppyScheduler::commitHandler)() = NULL;
+volatile period_t MoppyScheduler::period[MAX_VOICES];
+volatile long MoppyScheduler::remaining[MAX_VOICES];
+volatile unsigned long MoppyScheduler::armed = 0;
+volatile bool MoppyScheduler::running = false;
+MoppyTimerHandle MoppyScheduler::timer = MOPPY_TIMER_NONE;
+
+void MoppyScheduler::initialize(void (*stepHandler)(byte voice), void (*commitHandler)()) {
+    MoppyScheduler::stepHandler = stepHandler;
+    MoppyScheduler::commitHandler = commitHandler;
+    for (byte v = 0; v < MAX_VOICES; v++) {
+        period[v] = 0;
+    }
+    timer = MoppyTimer::initializeOneShot(expire);
+}
+
+void MoppyScheduler::setPeriod(byte voice, period_t microseconds) {
+    if (voice >= MAX_VOICES) {
+        return;
+    }
+
+    MoppyCriticalSection critical;
+    bool starting = (period[voice] == 0);
+    period[voice] = microseconds;
+
+    // Stopped voices are simply skipped from now on (the timer stops itself once none are left)
+    if (microseconds == 0) {
+        return;
+    }
+
+    if (!running) {
+        // Nothing else is playing, so the timer starts fresh for this voice
+        remaining[voice] = microseconds;
+        running = true;
+        arm(microseconds);
+        return;
+    }
+
+    // If the timer has expired but expire() hasn't run yet (interrupts are masked), remaining times
+    // are still measured from the expiry before it, so the interval that just ended counts too
+    bool pending;
+    unsigned long sinceExpiry;
+    do {
+        pending = MoppyTimer::expiryPending(timer);
+        sinceExpiry = MoppyTimer::elapsed(timer);
+    } while (pending != MoppyTimer::expiryPending(timer)); // Expired while we were reading
+    unsigned long now = sinceExpiry + (pending ? armed : 0) + SCHEDULER_LEAD;
+
+    // New voices (or ones whose period just got short enough that they'd be late) count from now
+    if (starting || (unsigned long)remaining[voice] > now + microseconds) {
+        remaining[voice] = now + microseconds;
+    }
+
+    // A pending expire() re-arms the timer for whichever voice is next (this one included) anyway
+    if (!pending && (unsigned long)remaining[voice] < armed) {
+        arm(remaining[voice]);
+    }
+}
+
+/*
+Called by the one-shot timer each time an armed interval expires.  Steps every voice that's due,
+then re-arms the timer for whichever voice is due next.
+ */
+#pragma GCC push_options
+#pragma GCC optimize("Ofast")
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyScheduler::expire() {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyScheduler::expire() {
+#else
+void MoppyScheduler::expire() {
+#endif
+    unsigned long next = ONESHOT_MAX_INTERVAL;
+    bool stepped = false;
+    bool playing = false;
+
+    for (byte v = 0; v < MAX_VOICES; v++) {
+        if (period[v] == 0) {
+            continue;
+        }
+        playing = true;
+
+        long left = remaining[v] - (long)armed;
+        if (left <= SCHEDULER_SLACK) {
+            stepHandler(v);
+            stepped = true;
+            left += (long)period[v];
+            if (left <= SCHEDULER_SLACK) {
+                left = (long)period[v]; // We've fallen behind; don't try to catch up with a burst of steps
+            }
+        }
+        remaining[v] = left;
+
+        if ((unsigned long)left < next) {
+            next = left;
+        }
+    }
+
+    if (stepped && commitHandler != NULL) {
+        commitHandler();
+    }
+
+    if (!playing) {
+        MoppyTimer::disarm(timer);
+        running = false;
+        return;
+    }
+
+    // If stepping took long enough that the next voice is already due, fire again as soon as possible
+    unsigned long earliest = MoppyTimer::elapsed(timer) + SCHEDULER_LEAD;
+    arm(next > earliest ? next : earliest + ONESHOT_RESOLUTION - 1);
+}
+
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR MoppyScheduler::arm(unsigned long microseconds) {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR MoppyScheduler::arm(unsigned long microseconds) {
+#else
+void MoppyScheduler::arm(unsigned long microseconds) {
+#endif
+    if (microseconds > ONESHOT_MAX_INTERVAL) {
+        microseconds = ONESHOT_MAX_INTERVAL;
+    }
+    // Only whole multiples of the timer resolution can be armed, and since remaining times are
+    // kept exact the rounding never accumulates
+    armed = microseconds - (microseconds % ONESHOT_RESOLUTION);
+    MoppyTimer::arm(timer, armed);
+}
+#pragma GCC pop_options
@@ -0,0 +1,43 @@
+/*
+ * MoppyScheduler.h
+ * Event-driven alternative to a fixed-rate tick.  Rather than interrupting every TIMER_RESOLUTION
+ * microseconds to check on every voice, the one-shot timer is armed for the earliest pending step
+ * of any voice, every voice that's due is stepped, and the timer is stopped entirely while
+ * nothing is playing.
+ */
+
+#ifndef SRC_MOPPYINSTRUMENTS_MOPPYSCHEDULER_H_
+#define SRC_MOPPYINSTRUMENTS_MOPPYSCHEDULER_H_
+
+#include <Arduino.h>
+#include "MoppyTimer.h"
+#include "MoppyInstrument.h"
+#include "../MoppyConfig.h"
+
+class MoppyScheduler {
+public:
+    // Voices are indexed from zero up to MAX_SUB_ADDRESS so instruments can use either
+    // zero or one-based drive numbers directly
+    static const byte MAX_VOICES = MAX_SUB_ADDRESS + 1;
+
+    // stepHandler is called (from the timer interrupt) each time a voice is due.  If provided, commitHandler
+    // is called once after all of the voices due at the same moment have been stepped.
+    static void initialize(void (*stepHandler)(byte voice), void (*commitHandler)() = NULL);
+
+    // Sets the time between steps for a voice in microseconds (0 = off)
+    static void setPeriod(byte voice, period_t microseconds);
+
+private:
+    static void (*stepHandler)(byte voice);
+    static void (*commitHandler)();
+    static volatile period_t period[MAX_VOICES];
+    static volatile long remaining[MAX_VOICES]; // Time from the last expiry until each voice is next due
+    static volatile unsigned long armed;        // Length of the currently armed interval
+    static volatile bool running;
+    static MoppyTimerHandle timer;
+
+    static void expire();
+    static void arm(unsigned long microseconds);
+};
+
+#endif /* SRC_MOPPYINSTRUMENTS_MOPPYSCHEDULER_H_ */
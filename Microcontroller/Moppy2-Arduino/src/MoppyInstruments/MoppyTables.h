@@ -0,0 +1,185 @@
+/*
+ * MoppyTables.h
+ * Lookup tables for MoppyInstrument implementations that are generated by the compiler
+ * rather than calculated at runtime (or typed out by hand).  Doesn't depend on Arduino.h so
+ * the tables can also be checked on the host (see tools/).
+ */
+
+#ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTABLES_H_
+#define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTABLES_H_
+
+#include <stdint.h>
+
+/*
+ * Where tables are stored.  On AVR they go in flash to save SRAM.  On the ESPs they're kept in RAM
+ * (there's plenty of it) so they're always safe to read from an ISR, even while the flash cache
+ * is disabled: plain const data already lands in DRAM on the ESP8266, but the ESP32 puts it in
+ * flash unless asked otherwise.
+ */
+#ifdef ARDUINO_ARCH_AVR
+#define TABLE_ATTR PROGMEM
+#define TABLE_READ_BYTE(addr) pgm_read_byte(addr)
+#define TABLE_READ_WORD(addr) pgm_read_word(addr)
+#define TABLE_READ_DWORD(addr) pgm_read_dword(addr)
+#else
+#ifdef ARDUINO_ARCH_ESP32
+#define TABLE_ATTR DRAM_ATTR
+#else
+#define TABLE_ATTR
+#endif
+#define TABLE_READ_BYTE(addr) (*(const uint8_t *)(addr))
+#define TABLE_READ_WORD(addr) (*(const uint16_t *)(addr))
+#define TABLE_READ_DWORD(addr) (*(const uint32_t *)(addr))
+#endif
+
+// Reads an 8, 16, or 32-bit table entry
+template <typename T> inline T tableRead(const T *addr) {
+    return sizeof(T) == 4 ? (T)TABLE_READ_DWORD(addr) : sizeof(T) == 2 ? (T)TABLE_READ_WORD(addr) : (T)TABLE_READ_BYTE(addr);
+}
+
+// Tuning (in Hz) of A4, which all of the note tables are calculated from
+#ifndef A4_TUNING
+#define A4_TUNING 440
+#endif
+
+// Number of octaves to bend notes by at full-deflection (MIDI pitch bending is weird).
+// Described as cents/cents-in-an-octave
+#define BEND_OCTAVES 200/(float)1200
+
+/*
+ * Compile-time math.  Only single-return-statement constexpr functions are allowed in C++11,
+ * hence the recursion.
+ */
+
+// e^x from its Taylor series (only used for 0 <= x < ln(2) so it converges quickly)
+constexpr double tableExpSeries(double x, int n, double term, double sum) {
+    return n > 16 ? sum : tableExpSeries(x, n + 1, term * x / n, sum + term * x / n);
+}
+
+// 2^x, handling whole octaves separately so the series only ever sees the fraction
+constexpr double tableExp2(double x) {
+    return x < 0 ? 1.0 / tableExp2(-x)
+         : x >= 1 ? 2.0 * tableExp2(x - 1)
+         : tableExpSeries(x * 0.69314718055994531, 1, 1.0, 1.0);
+}
+
+// Builds the list of indexes 0..N-1 used to expand a generator function into a table
+template <int... Is> struct TableIndexes {};
+template <int N, int... Is> struct MakeTableIndexes : MakeTableIndexes<N - 1, N - 1, Is...> {};
+template <int... Is> struct MakeTableIndexes<0, Is...> {
+    typedef TableIndexes<Is...> type;
+};
+
+/*
+ * Pitch-bend period multipliers in unsigned Q15 (32768 = 1.0).  Entry i is the amount to scale a
+ * period by for a deflection of (i - 128) * 64, so the table covers -8192 to 8192 and the 64
+ * deflections between entries are filled in by interpolation.
+ */
+#define BEND_TABLE_BITS 6
+#define BEND_TABLE_SIZE ((16384 >> BEND_TABLE_BITS) + 1)
+
+constexpr uint16_t bendTableEntry(int i) {
+    return (uint16_t)(tableExp2(-(BEND_OCTAVES) * (i - (BEND_TABLE_SIZE / 2)) / (double)(BEND_TABLE_SIZE / 2)) * 32768 + 0.5);
+}
+
+template <typename Indexes> struct BendTable;
+template <int... Is> struct BendTable<TableIndexes<Is...> > {
+    static const uint16_t factors[sizeof...(Is)];
+};
+template <int... Is>
+const uint16_t BendTable<TableIndexes<Is...> >::factors[sizeof...(Is)] TABLE_ATTR = {bendTableEntry(Is)...};
+
+typedef BendTable<MakeTableIndexes<BEND_TABLE_SIZE>::type> bendTable;
+
+// Period multiplier (Q15) for a pitch-bend deflection from -8192 to 8191 (anything outside that
+// is treated as the nearest end)
+inline uint16_t bendFactor(int16_t deflection) {
+    if (deflection < -8192) {
+        deflection = -8192;
+    } else if (deflection > 8191) {
+        deflection = 8191;
+    }
+    uint16_t offset = deflection + 8192;
+    uint16_t index = offset >> BEND_TABLE_BITS;
+    uint8_t fraction = offset & ((1 << BEND_TABLE_BITS) - 1);
+    uint16_t lower = tableRead(&bendTable::factors[index]);
+    uint16_t upper = tableRead(&bendTable::factors[index + 1]);
+    // Periods get shorter as the deflection goes up, so upper <= lower
+    return lower - (uint16_t)(((uint32_t)(lower - upper) * fraction) >> BEND_TABLE_BITS);
+}
+
+/*
+ * Period multipliers in unsigned Q15 for fractions of a semitone: entry i is for i /
+ * SEMITONE_TABLE_STEPS of a semitone up, and the fractions in between are filled in by
+ * interpolation.
+ */
+#define SEMITONE_TABLE_BITS 4
+#define SEMITONE_TABLE_STEPS (1 << SEMITONE_TABLE_BITS)
+
+constexpr uint16_t semitoneTableEntry(int i) {
+    return (uint16_t)(tableExp2(-i / (12.0 * SEMITONE_TABLE_STEPS)) * 32768 + 0.5);
+}
+
+template <typename Indexes> struct SemitoneTable;
+template <int... Is> struct SemitoneTable<TableIndexes<Is...> > {
+    static const uint16_t factors[sizeof...(Is)];
+};
+template <int... Is>
+const uint16_t SemitoneTable<TableIndexes<Is...> >::factors[sizeof...(Is)] TABLE_ATTR = {semitoneTableEntry(Is)...};
+
+typedef SemitoneTable<MakeTableIndexes<SEMITONE_TABLE_STEPS + 1>::type> semitoneTable;
+
+// Period multiplier (Q15) for a fraction of a semitone up, in 256ths
+inline uint16_t semitoneFactor(uint8_t fraction) {
+    uint8_t index = fraction >> (8 - SEMITONE_TABLE_BITS);
+    uint8_t remainder = fraction & ((1 << (8 - SEMITONE_TABLE_BITS)) - 1);
+    uint16_t lower = tableRead(&semitoneTable::factors[index]);
+    uint16_t upper = tableRead(&semitoneTable::factors[index + 1]);
+    return lower - (uint16_t)(((uint32_t)(lower - upper) * remainder) >> (8 - SEMITONE_TABLE_BITS));
+}
+
+// Scales a period (of up to 24 bits) by a Q15 multiplier using only integer math
+inline uint32_t scalePeriod(uint32_t period, uint16_t factor) {
+    // Split the multiply so nothing overflows 32 bits
+    return (period >> 15) * factor + (((period & 0x7FFF) * factor + 0x4000) >> 15);
+}
+
+// Scales a period (of up to 24 bits) by the given pitch-bend deflection
+inline uint32_t bendPeriod(uint32_t period, int16_t deflection) {
+    return scalePeriod(period, bendFactor(deflection));
+}
+
+/*
+ * Equal-tempered note periods for MIDI notes 0-127, in units of Divisor microseconds with
+ * FractionBits of fixed-point fraction.  Only C0 (12) to B8 (119) are filled in, everything
+ * else is 0 (off).  Each combination of parameters is only stored once no matter how many
+ * files use it.
+ */
+#define FIRST_TABLE_NOTE 12
+#define LAST_TABLE_NOTE 119
+
+constexpr uint32_t noteTableEntry(int note, long divisor, int fractionBits) {
+    return (note < FIRST_TABLE_NOTE || note > LAST_TABLE_NOTE) ? 0
+         : (uint32_t)(1000000.0 / (A4_TUNING * tableExp2((note - 69) / 12.0)) * (1UL << fractionBits) / divisor + 0.5);
+}
+
+// Longest period in a note table once it's been bent all the way down, which is the most a period
+// variable ever has to hold
+constexpr uint32_t maxBentPeriod(long divisor, int fractionBits) {
+    return (uint32_t)(((uint64_t)noteTableEntry(FIRST_TABLE_NOTE, divisor, fractionBits) * bendTableEntry(0) + 0x4000) >> 15);
+}
+
+template <typename T, long Divisor, int FractionBits, typename Indexes> struct NoteTable;
+template <typename T, long Divisor, int FractionBits, int... Is>
+struct NoteTable<T, Divisor, FractionBits, TableIndexes<Is...> > {
+    static const T periods[sizeof...(Is)];
+
+    static T period(uint8_t note) {
+        return note < sizeof...(Is) ? tableRead(&periods[note]) : 0;
+    }
+};
+template <typename T, long Divisor, int FractionBits, int... Is>
+const T NoteTable<T, Divisor, FractionBits, TableIndexes<Is...> >::periods[sizeof...(Is)] TABLE_ATTR =
+    {(T)noteTableEntry(Is, Divisor, FractionBits)...};
+
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTABLES_H_ */
@@ -1,24 +1,499 @@
 #include "MoppyTimer.h"
+#include "MoppyIsrStats.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "soc/timer_group_struct.h"
+#endif
+
+static void (*channelIsr[MoppyTimer::CHANNEL_COUNT])() = {NULL, NULL};
+static unsigned long channelPeriod[MoppyTimer::CHANNEL_COUNT] = {0, 0};
+static volatile bool channelRunning[MoppyTimer::CHANNEL_COUNT] = {false, false};
+static volatile bool channelHeld[MoppyTimer::CHANNEL_COUNT] = {false, false};
+static volatile bool channelPending[MoppyTimer::CHANNEL_COUNT] = {false, false}; // An interrupt came due while held
+
+// Platform-specific parts (below) for periodic channels
+static void attachChannel(uint8_t channel);
+static void configureChannel(uint8_t channel, unsigned long microseconds);
+static void startChannel(uint8_t channel);
+static void stopChannel(uint8_t channel);
+
+typedef void (*isr_t)();
+
+// Checked at the start of every interrupt: if the channel is held, just note that it came due
+static inline bool deferred(uint8_t channel) {
+    if (channelHeld[channel]) {
+        channelPending[channel] = true;
+        return true;
+    }
+    return false;
+}
+
+#if defined(ISR_STATS) && !defined(ARDUINO_ARCH_AVR)
+// Microseconds from the last STEP interrupt until the next one is due
+static volatile unsigned long stepBudget = 0;
+#endif
+
+#if defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
+// Attached to the STEP timer in place of its isr (the AVR ISRs do all of this themselves)
+#ifdef ARDUINO_ARCH_ESP8266
+static void ICACHE_RAM_ATTR stepInterrupt() {
+#else
+static void IRAM_ATTR stepInterrupt() {
+#endif
+    if (deferred(MoppyTimer::STEP)) {
+        return;
+    }
+#ifdef ISR_STATS
+    // Time the isr.  The budget is read afterwards, since a one-shot isr re-arms the timer for the next interval.
+    uint32_t start = ESP.getCycleCount();
+    channelIsr[MoppyTimer::STEP]();
+    uint32_t cycles = ESP.getCycleCount() - start;
+    MoppyIsrStats::record(cycles, cycles >= stepBudget * (F_CPU / 1000000UL));
+#else
+    channelIsr[MoppyTimer::STEP]();
+#endif
+}
+
+#ifdef ARDUINO_ARCH_ESP32
+static void IRAM_ATTR controlInterrupt() {
+    if (!deferred(MoppyTimer::CONTROL)) {
+        channelIsr[MoppyTimer::CONTROL]();
+    }
+}
+
+// The function that actually gets called from each channel's interrupt
+static inline isr_t attachedIsr(uint8_t channel) {
+    return channel == MoppyTimer::STEP ? stepInterrupt : controlInterrupt;
+}
+#endif
+#endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
+
+MoppyTimerHandle MoppyTimer::initialize(unsigned long microseconds, void (*isr)(), uint8_t channel) {
+    if (channel >= CHANNEL_COUNT) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    channelIsr[channel] = isr;
+    attachChannel(channel);
+    setPeriod(channel, microseconds);
+    start(channel);
+    return channel;
+}
+
+void MoppyTimer::start(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT || channelRunning[timer] || channelPeriod[timer] == 0) {
+        return;
+    }
+    channelRunning[timer] = true;
+    startChannel(timer);
+}
+
+void MoppyTimer::stop(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT || !channelRunning[timer]) {
+        return;
+    }
+    stopChannel(timer);
+    channelRunning[timer] = false;
+}
+
+void MoppyTimer::setPeriod(MoppyTimerHandle timer, unsigned long microseconds) {
+    if (timer >= CHANNEL_COUNT) {
+        return;
+    }
+    channelPeriod[timer] = microseconds;
+#if defined(ISR_STATS) && !defined(ARDUINO_ARCH_AVR)
+    if (timer == STEP) {
+        stepBudget = microseconds;
+    }
+#endif
+    configureChannel(timer, microseconds);
+}
+
+bool MoppyTimer::isRunning(MoppyTimerHandle timer) {
+    return timer < CHANNEL_COUNT && channelRunning[timer];
+}
+
+void MoppyTimer::hold(MoppyTimerHandle timer) {
+    if (timer < CHANNEL_COUNT) {
+        channelHeld[timer] = true;
+    }
+}
+
+void MoppyTimer::release(MoppyTimerHandle timer) {
+    if (timer >= CHANNEL_COUNT) {
+        return;
+    }
+    MoppyCriticalSection critical; // Run the missed interrupt as if it were one
+    channelHeld[timer] = false;
+    if (channelPending[timer]) {
+        channelPending[timer] = false;
+        channelIsr[timer]();
+    }
+}
 
 #ifdef ARDUINO_ARCH_AVR
-#include <TimerOne.h>
-#elif ARDUINO_ARCH_ESP8266 || ARDUINO_ARCH_ESP32
-#include <Arduino.h>
+/*
+ * STEP is Timer1 (16-bit) and CONTROL is Timer2 (8-bit), both in CTC mode so the counter is
+ * cleared by hardware on every compare match.  The smallest prescaler that fits the period is
+ * used, and since Timer2 runs out of room after about 16ms at 16MHz, longer CONTROL periods are
+ * made up of several shorter interrupts.
+ */
+static uint8_t timerClock[MoppyTimer::CHANNEL_COUNT];  // CSn bits for the selected prescaler
+static uint8_t controlPostscale = 1;                    // Timer2 interrupts per CONTROL period
+static volatile uint8_t controlPostscaleLeft = 1;
+
+// Prescalers in the order of their CSn bit values (starting at 1)
+static const uint16_t timer1Prescalers[] = {1, 8, 64, 256, 1024};
+static const uint16_t timer2Prescalers[] = {1, 8, 32, 64, 128, 256, 1024};
+
+// Finds the smallest prescaler that fits cycles into maxCounts, returning its CSn bits and
+// setting counts to the number of (prescaled) counts to use
+static uint8_t selectPrescaler(unsigned long cycles, unsigned long maxCounts, const uint16_t prescalers[], uint8_t numPrescalers, unsigned long &counts) {
+    for (uint8_t i = 0; i < numPrescalers; i++) {
+        counts = cycles / prescalers[i];
+        if (counts <= maxCounts) {
+            return i + 1;
+        }
+    }
+    counts = maxCounts; // Too long, so just use the longest period we can
+    return numPrescalers;
+}
+
+ISR(TIMER1_COMPA_vect) {
+    if (deferred(MoppyTimer::STEP)) {
+        return;
+    }
+    channelIsr[MoppyTimer::STEP]();
+#ifdef ISR_STATS
+    // The compare match cleared TCNT1, so it's now the time since this interrupt was due.  If the
+    // next match has already happened (read TCNT1 first so we can't miss one) it's been cleared again.
+    uint32_t counts = TCNT1;
+    bool overrun = TIFR1 & _BV(OCF1A);
+    if (overrun) {
+        counts += (uint32_t)OCR1A + 1;
+    }
+    MoppyIsrStats::record(counts * timer1Prescalers[timerClock[MoppyTimer::STEP] - 1], overrun);
 #endif
+}
+
+ISR(TIMER2_COMPA_vect) {
+    if (--controlPostscaleLeft == 0) {
+        controlPostscaleLeft = controlPostscale;
+        if (!deferred(MoppyTimer::CONTROL)) {
+            channelIsr[MoppyTimer::CONTROL]();
+        }
+    }
+}
+
+static void attachChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        TCCR1A = 0;
+        TCCR1B = _BV(WGM12); // CTC mode, clock stopped until started
+        TIMSK1 = _BV(OCIE1A);
+    } else {
+        TCCR2A = _BV(WGM21); // CTC mode
+        TCCR2B = 0;          // Clock stopped until started
+        ASSR = 0;
+        TIMSK2 = _BV(OCIE2A);
+    }
+}
+
+static void configureChannel(uint8_t channel, unsigned long microseconds) {
+    unsigned long cycles = microseconds * (F_CPU / 1000000UL);
+    unsigned long counts;
+    MoppyCriticalSection critical;
+
+    if (channel == MoppyTimer::STEP) {
+        timerClock[channel] = selectPrescaler(cycles, 65536UL, timer1Prescalers, sizeof(timer1Prescalers) / sizeof(timer1Prescalers[0]), counts);
+        OCR1A = counts > 0 ? counts - 1 : 0;
+        if (channelRunning[channel]) {
+            if (TCNT1 > OCR1A) {
+                TCNT1 = 0; // We'd otherwise have to wait for the counter to wrap all the way around
+            }
+            TCCR1B = _BV(WGM12) | timerClock[channel];
+        }
+    } else {
+        unsigned long postscale = cycles / (256UL * 1024) + 1;
+        if (postscale > 255) {
+            postscale = 255; // About 4 seconds at 16MHz, which is plenty for a control channel
+        }
+        timerClock[channel] = selectPrescaler(cycles / postscale, 256UL, timer2Prescalers, sizeof(timer2Prescalers) / sizeof(timer2Prescalers[0]), counts);
+        OCR2A = counts > 0 ? counts - 1 : 0;
+        controlPostscale = postscale;
+        if (controlPostscaleLeft > postscale) {
+            controlPostscaleLeft = postscale;
+        }
+        if (channelRunning[channel]) {
+            if (TCNT2 > OCR2A) {
+                TCNT2 = 0;
+            }
+            TCCR2B = timerClock[channel];
+        }
+    }
+}
+
+static void startChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        TCNT1 = 0;
+        TIFR1 = _BV(OCF1A); // Clear any stale match
+        TCCR1B = _BV(WGM12) | timerClock[channel];
+    } else {
+        TCNT2 = 0;
+        TIFR2 = _BV(OCF2A);
+        controlPostscaleLeft = controlPostscale;
+        TCCR2B = timerClock[channel];
+    }
+}
+
+static void stopChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        TCCR1B = _BV(WGM12);
+    } else {
+        TCCR2B = 0;
+    }
+}
+
+#elif ARDUINO_ARCH_ESP8266
+/*
+ * STEP is timer1 (at 5 ticks/us).  CONTROL is timer0, which is really just a compare against the
+ * CPU cycle counter, so it's re-armed from its own interrupt to make it periodic.
+ */
+static uint32_t controlCycles = 0;
+static volatile uint32_t controlNext = 0;
+
+static void ICACHE_RAM_ATTR controlExpired() {
+    controlNext += controlCycles;
+    if ((int32_t)(controlNext - ESP.getCycleCount()) <= 0) {
+        controlNext = ESP.getCycleCount() + controlCycles; // Fell behind, so start over from now
+    }
+    timer0_write(controlNext);
+    if (!deferred(MoppyTimer::CONTROL)) {
+        channelIsr[MoppyTimer::CONTROL]();
+    }
+}
+
+static void attachChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        timer1_isr_init();
+        timer1_attachInterrupt(stepInterrupt);
+    } else {
+        timer0_isr_init();
+    }
+}
+
+static void configureChannel(uint8_t channel, unsigned long microseconds) {
+    if (channel == MoppyTimer::STEP) {
+        if (channelRunning[channel]) {
+            timer1_write(5 * microseconds);
+        }
+    } else {
+        controlCycles = microseconds * clockCyclesPerMicrosecond();
+    }
+}
+
+static void startChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+        timer1_write(5 * channelPeriod[channel]);
+    } else {
+        controlNext = ESP.getCycleCount() + controlCycles;
+        timer0_attachInterrupt(controlExpired);
+        timer0_write(controlNext);
+    }
+}
+
+static void stopChannel(uint8_t channel) {
+    if (channel == MoppyTimer::STEP) {
+        timer1_disable();
+    } else {
+        timer0_detachInterrupt();
+    }
+}
+
+#elif ARDUINO_ARCH_ESP32
+/*
+ * STEP and CONTROL are hardware timers 0 and 1, each counting microseconds.  The hw_timer_t for
+ * each is kept (and reused if the channel is initialized again).
+ */
+static hw_timer_t *channelTimer[MoppyTimer::CHANNEL_COUNT] = {NULL, NULL};
+
+static void attachChannel(uint8_t channel) {
+    if (channelTimer[channel] == NULL) {
+        channelTimer[channel] = timerBegin(channel, 80, true);
+    } else {
+        timerDetachInterrupt(channelTimer[channel]);
+    }
+    timerAttachInterrupt(channelTimer[channel], attachedIsr(channel), true);
+}
+
+static void configureChannel(uint8_t channel, unsigned long microseconds) {
+    timerAlarmWrite(channelTimer[channel], microseconds, true);
+}
+
+static void startChannel(uint8_t channel) {
+    timerWrite(channelTimer[channel], 0);
+    timerAlarmEnable(channelTimer[channel]);
+}
+
+static void stopChannel(uint8_t channel) {
+    timerAlarmDisable(channelTimer[channel]);
+}
+#endif
+
+//
+//// One-shot mode
+//
+
+static volatile bool oneShotRunning = false;
 
-void MoppyTimer::initialize(unsigned long microseconds, void (*isr)()) {
 #ifdef ARDUINO_ARCH_AVR
-    Timer1.initialize(microseconds);
-    Timer1.attachInterrupt(isr);
+/*
+ * One-shots run on Timer1 in CTC mode with a fixed /64 prescaler.  That makes TCNT1 the time since
+ * the last expiry, and a new OCR1A written from the isr is automatically measured from that expiry.
+ */
+MoppyTimerHandle MoppyTimer::initializeOneShot(void (*isr)(), uint8_t channel) {
+    if (channel != STEP) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    channelIsr[channel] = isr;
+    attachChannel(channel);
+    timerClock[channel] = _BV(CS11) | _BV(CS10); // Always /64 (see arm())
+    return channel;
+}
+
+void MoppyTimer::arm(MoppyTimerHandle timer, unsigned long microseconds) {
+    OCR1A = (microseconds / ONESHOT_RESOLUTION) - 1;
+    if (!oneShotRunning) {
+        TCNT1 = 0;
+        TIFR1 = _BV(OCF1A); // Clear any stale match
+        TCCR1B = _BV(WGM12) | timerClock[STEP]; // Start with a /64 prescaler
+        oneShotRunning = true;
+    }
+}
+
+void MoppyTimer::disarm(MoppyTimerHandle timer) {
+    TCCR1B = _BV(WGM12);
+    oneShotRunning = false;
+}
+
+unsigned long MoppyTimer::elapsed(MoppyTimerHandle timer) {
+    return oneShotRunning ? (unsigned long)TCNT1 * ONESHOT_RESOLUTION : 0;
+}
+
+bool MoppyTimer::expiryPending(MoppyTimerHandle timer) {
+    // The match flag is only cleared once the ISR runs, while TCNT1 has already started over
+    return oneShotRunning && (TIFR1 & _BV(OCF1A));
+}
+
 #elif ARDUINO_ARCH_ESP8266
+/*
+ * timer1 counts down and (in TIM_LOOP mode) reloads at expiry, but writing a new value restarts
+ * it immediately.  To measure from the last expiry anyway, we track how much time had already
+ * passed when each value was written and take it off the next one.
+ */
+static volatile uint32_t oneShotLoad = 0;   // Ticks last written to timer1
+static volatile uint32_t oneShotOffset = 0; // Ticks since the last expiry when oneShotLoad was written
+
+// Whether timer1's (edge) interrupt has been raised but not yet handled
+static bool ICACHE_RAM_ATTR timer1Pending() {
+    uint32_t interrupts;
+    __asm__ __volatile__("rsr %0, interrupt" : "=a"(interrupts));
+    return interrupts & (1 << ETS_FRC_TIMER1_INUM);
+}
+
+static uint32_t ICACHE_RAM_ATTR elapsedTicks() {
+    if (!oneShotRunning) {
+        return 0;
+    }
+    // Once it's expired the counter has been reloaded, but oneShotOffset isn't cleared until the isr
+    return (timer1Pending() ? 0 : oneShotOffset) + (oneShotLoad - timer1_read());
+}
+
+static void ICACHE_RAM_ATTR oneShotExpired() {
+    oneShotOffset = 0; // The counter has just been reloaded with oneShotLoad
+    stepInterrupt();
+}
+
+MoppyTimerHandle MoppyTimer::initializeOneShot(void (*isr)(), uint8_t channel) {
+    if (channel != STEP) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    channelIsr[channel] = isr;
     timer1_isr_init();
-    timer1_attachInterrupt(isr);
-    timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
-    timer1_write(5 * microseconds);
+    timer1_attachInterrupt(oneShotExpired);
+    return channel;
+}
+
+void ICACHE_RAM_ATTR MoppyTimer::arm(MoppyTimerHandle timer, unsigned long microseconds) {
+    uint32_t alreadyElapsed = elapsedTicks();
+    uint32_t ticks = 5 * microseconds;
+    ticks = ticks > alreadyElapsed + 10 ? ticks - alreadyElapsed : 10;
+
+    if (!oneShotRunning) {
+        timer1_enable(TIM_DIV16, TIM_EDGE, TIM_LOOP);
+        oneShotRunning = true;
+    }
+    oneShotOffset = alreadyElapsed;
+    oneShotLoad = ticks;
+#ifdef ISR_STATS
+    stepBudget = microseconds;
+#endif
+    timer1_write(ticks);
+}
+
+void ICACHE_RAM_ATTR MoppyTimer::disarm(MoppyTimerHandle timer) {
+    timer1_disable();
+    oneShotRunning = false;
+}
+
+unsigned long ICACHE_RAM_ATTR MoppyTimer::elapsed(MoppyTimerHandle timer) {
+    return elapsedTicks() / 5;
+}
+
+bool ICACHE_RAM_ATTR MoppyTimer::expiryPending(MoppyTimerHandle timer) {
+    return oneShotRunning && timer1Pending();
+}
+
 #elif ARDUINO_ARCH_ESP32
-    hw_timer_t *timer = timerBegin(0, 80, true);
-    timerAttachInterrupt(timer, isr, true);
-    timerAlarmWrite(timer, microseconds, true);
-    timerAlarmEnable(timer);
+/*
+ * With auto-reload enabled the counter is reset at every alarm, so the counter value is the
+ * time since the last expiry and new alarm values are measured from it.
+ */
+MoppyTimerHandle MoppyTimer::initializeOneShot(void (*isr)(), uint8_t channel) {
+    if (channel != STEP) {
+        return MOPPY_TIMER_NONE;
+    }
+    stop(channel);
+    channelIsr[channel] = isr;
+    attachChannel(channel);
+    return channel;
+}
+
+void IRAM_ATTR MoppyTimer::arm(MoppyTimerHandle timer, unsigned long microseconds) {
+    timerAlarmWrite(channelTimer[timer], microseconds, true);
+#ifdef ISR_STATS
+    stepBudget = microseconds;
+#endif
+    if (!oneShotRunning) {
+        timerWrite(channelTimer[timer], 0);
+        timerAlarmEnable(channelTimer[timer]);
+        oneShotRunning = true;
+    }
+}
+
+void IRAM_ATTR MoppyTimer::disarm(MoppyTimerHandle timer) {
+    timerAlarmDisable(channelTimer[timer]);
+    oneShotRunning = false;
+}
+
+unsigned long IRAM_ATTR MoppyTimer::elapsed(MoppyTimerHandle timer) {
+    return oneShotRunning ? (unsigned long)timerRead(channelTimer[timer]) : 0;
+}
+
+bool IRAM_ATTR MoppyTimer::expiryPending(MoppyTimerHandle timer) {
+    // Hardware timers 0 and 1 are the two timers in group 0.  The raw interrupt bit stays set until
+    // the isr clears it.
+    return oneShotRunning && (timer == 0 ? TIMERG0.int_raw.t0 : TIMERG0.int_raw.t1);
+}
 #endif
-}
\ No newline at end of file
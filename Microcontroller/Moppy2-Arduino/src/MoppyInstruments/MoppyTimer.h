@@ -1,14 +1,116 @@
 /*
  * MoppyTimer.h
  * Attempt at making a high-precision timer that's relatively platform-agnostic
+ *
+ * Two independent hardware timer channels are available on every platform:
+ *  - STEP: The high-precision channel that instruments step from (Timer1 on AVR, timer1 on the
+ *    ESP8266, timer 0 on the ESP32).  Can run periodically or as a one-shot.
+ *  - CONTROL: A second channel for slower periodic work (envelopes, sequencing, etc.) that
+ *    shouldn't hold up the steps (Timer2 on AVR, timer0 on the ESP8266, timer 1 on the ESP32).
+ *    Periodic only.  On AVR this conflicts with tone().
+ *
+ * Each initialize call returns a handle for that channel which can then be used to stop, start,
+ * or change the period of the timer at any time.
  */
 
 #ifndef MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_
 #define MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_
 
+#include <Arduino.h>
+#ifdef ARDUINO_ARCH_NATIVE
+#include <MoppySim.h>
+#endif
+
+/*
+ * Granularity and maximum length (both in microseconds) of intervals for the one-shot timer.
+ * Intervals are always armed as a multiple of ONESHOT_RESOLUTION.
+ */
+#ifdef ARDUINO_ARCH_AVR
+#define ONESHOT_RESOLUTION (64000000UL / F_CPU) // Timer1 with a /64 prescaler (4us at 16MHz)
+#define ONESHOT_MAX_INTERVAL (65536UL * ONESHOT_RESOLUTION)
+#elif ARDUINO_ARCH_ESP8266
+#define ONESHOT_RESOLUTION 1
+#define ONESHOT_MAX_INTERVAL 1600000UL // timer1 only has 23 bits at 5 ticks/us
+#elif ARDUINO_ARCH_ESP32
+#define ONESHOT_RESOLUTION 1
+#define ONESHOT_MAX_INTERVAL 1600000UL // Plenty of room in a 64-bit timer, but matches the ESP8266
+#elif ARDUINO_ARCH_NATIVE
+#define ONESHOT_RESOLUTION 4 // Same as the Uno (see native/)
+#define ONESHOT_MAX_INTERVAL (65536UL * ONESHOT_RESOLUTION)
+#endif
+
+// Identifies an initialized timer channel
+typedef uint8_t MoppyTimerHandle;
+#define MOPPY_TIMER_NONE 0xFF // Returned when the requested channel or mode isn't available
+
 class MoppyTimer {
 public:
-    static void initialize(unsigned long microseconds, void (*isr)());
+    static const uint8_t STEP = 0;
+    static const uint8_t CONTROL = 1;
+    static const uint8_t CHANNEL_COUNT = 2;
+
+    // Calls isr every given number of microseconds on a channel, starting right away
+    static MoppyTimerHandle initialize(unsigned long microseconds, void (*isr)(), uint8_t channel = STEP);
+
+    // Periodic control.  Changing the period of a running timer takes effect from the next interrupt.
+    static void start(MoppyTimerHandle timer);
+    static void stop(MoppyTimerHandle timer);
+    static void setPeriod(MoppyTimerHandle timer, unsigned long microseconds);
+    static bool isRunning(MoppyTimerHandle timer);
+
+    // Holds off a channel's isr without stopping the timer.  An interrupt that comes due while the
+    // channel is held is run (just once) when it's released, so every change made in between
+    // takes effect on the same interrupt.  Holds don't nest.
+    static void hold(MoppyTimerHandle timer);
+    static void release(MoppyTimerHandle timer);
+
+    // One-shot mode (STEP channel only, used by MoppyScheduler).  After each call to arm() the isr
+    // is called once, and intervals are measured from the previous expiry so that re-arming from
+    // inside the isr doesn't accumulate any drift.
+    static MoppyTimerHandle initializeOneShot(void (*isr)(), uint8_t channel = STEP);
+    static void arm(MoppyTimerHandle timer, unsigned long microseconds);
+    static void disarm(MoppyTimerHandle timer);
+    static unsigned long elapsed(MoppyTimerHandle timer); // Microseconds since the last expiry (0 if disarmed)
+    // Whether the timer has expired but the isr hasn't been called for it yet (e.g. because
+    // interrupts are masked).  elapsed() is then measured from that expiry.
+    static bool expiryPending(MoppyTimerHandle timer);
+};
+
+/*
+ * Masks interrupts for as long as it's in scope.  The previous interrupt state is restored
+ * afterwards (rather than just enabling interrupts) so this is also safe to use from inside an ISR.
+ */
+class MoppyCriticalSection {
+public:
+#ifdef ARDUINO_ARCH_AVR
+    MoppyCriticalSection() : savedState(SREG) { cli(); }
+    ~MoppyCriticalSection() { SREG = savedState; }
+
+private:
+    uint8_t savedState;
+#elif ARDUINO_ARCH_ESP8266
+    MoppyCriticalSection() : savedState(xt_rsil(15)) {}
+    ~MoppyCriticalSection() { xt_wsr_ps(savedState); }
+
+private:
+    uint32_t savedState;
+#elif ARDUINO_ARCH_ESP32
+    MoppyCriticalSection() : savedState(portSET_INTERRUPT_MASK_FROM_ISR()) {}
+    ~MoppyCriticalSection() { portCLEAR_INTERRUPT_MASK_FROM_ISR(savedState); }
+
+private:
+    uint32_t savedState;
+#elif ARDUINO_ARCH_NATIVE
+    MoppyCriticalSection() : savedState(MoppySim::interruptsEnabled()) { noInterrupts(); }
+    ~MoppyCriticalSection() {
+        if (savedState) {
+            interrupts();
+        }
+    }
+
+private:
+    bool savedState;
+#endif
 };
 
-#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_ */
\ No newline at end of file
+#endif /* MOPPY_SRC_MOPPYINSTRUMENTS_MOPPYTIMER_H_ */
@@ -34,6 +34,14 @@ uint8_t ShiftRegister::activeTicksLeft[NUM_NOTES];
 
 boolean ShiftRegister::shouldShift = false; // When true, a shift will occur during the next tick
 
+// One voice per output, and notes are just switched on and off (no pitches) so none of the
+// timing features apply
+void ShiftRegister::describe(MoppyCapabilities &capabilities) {
+  capabilities.instrumentType = MOPPY_INSTRUMENT_SHIFT_REGISTER;
+  capabilities.voices = NUM_NOTES;
+  capabilities.tickMicros = SHIFT_TIMER_RESOLUTION;
+}
+
 void ShiftRegister::setup() {
 
   // Prepare pins
@@ -122,13 +130,23 @@ void blinkLED(){
 // Shifting and bitsetting functions
 ////
 
+// Same as shiftOut(DATA_PIN, SHIFT_CLOCK_PIN, MSBFIRST, data), but fast enough to use from tick()
+static void shiftOutByte(uint8_t data)
+{
+  for (int8_t b = 7; b >= 0; b--) {
+    FastPin<DATA_PIN>::write(bitRead(data, b));
+    FastPin<SHIFT_CLOCK_PIN>::high();
+    FastPin<SHIFT_CLOCK_PIN>::low();
+  }
+}
+
 void ShiftRegister::shiftAllData()
 {
-  digitalWrite(LATCH_PIN, LOW);
+  FastPin<LATCH_PIN>::low();
   for (int i=SHIFT_DATA_BYTES-1;i>=0;i--){
-    shiftOut(DATA_PIN, SHIFT_CLOCK_PIN, MSBFIRST, shiftData[i]);
+    shiftOutByte(shiftData[i]);
   }
-  digitalWrite(LATCH_PIN, HIGH);
+  FastPin<LATCH_PIN>::high();
 }
 
 void ShiftRegister::outputOn(byte outputNum){
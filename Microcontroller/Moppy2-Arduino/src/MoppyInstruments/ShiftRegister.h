@@ -9,6 +9,7 @@
 #include <Arduino.h>
 #include "MoppyTimer.h"
 #include "MoppyInstrument.h"
+#include "FastPin.h"
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 
@@ -16,6 +17,7 @@ namespace instruments {
   class ShiftRegister : public MoppyInstrument {
   public:
     void setup();
+    void describe(MoppyCapabilities &capabilities) override;
 
   protected:
     void sys_sequenceStop() override;
@@ -25,13 +25,19 @@ unsigned int ShiftedFloppyDrives::currentPosition[] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 // Current period assigned to each drive.  0 = off.  Each period is two-ticks (as defined by
 // TIMER_RESOLUTION in MoppyInstrument.h) long.
-unsigned int ShiftedFloppyDrives::currentPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
+period_t ShiftedFloppyDrives::currentPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 // Tracks the current tick-count for each drive (see ShiftedFloppyDrives::tick() below)
-unsigned int ShiftedFloppyDrives::currentTick[] = {0, 0, 0, 0, 0, 0, 0, 0};
+period_t ShiftedFloppyDrives::currentTick[] = {0, 0, 0, 0, 0, 0, 0, 0};
 
 // The period originally set by incoming messages (prior to any modifications from pitch-bending)
-unsigned int ShiftedFloppyDrives::originalPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
+period_t ShiftedFloppyDrives::originalPeriod[] = {0, 0, 0, 0, 0, 0, 0, 0};
+
+void ShiftedFloppyDrives::describe(MoppyCapabilities &capabilities) {
+    MoppyInstrument::describe(capabilities);
+    capabilities.instrumentType = MOPPY_INSTRUMENT_SHIFTED_FLOPPIES;
+    capabilities.voices = LAST_DRIVE;
+}
 
 void ShiftedFloppyDrives::setup() {
 
@@ -44,7 +50,11 @@ void ShiftedFloppyDrives::setup() {
     delay(500); // Wait a half second for safety
 
     // Setup timer to handle interrupts for floppy driving
+#ifdef STEP_SCHEDULER
+    MoppyScheduler::initialize(step, shiftBits); // Shift once for all the drives stepped together
+#else
     MoppyTimer::initialize(TIMER_RESOLUTION, tick);
+#endif
 
     // If MoppyConfig wants a startup sound, play the startupSound on the
     // first drive.
@@ -57,18 +67,18 @@ void ShiftedFloppyDrives::setup() {
 
 // Play startup sound to confirm drive functionality
 void ShiftedFloppyDrives::startupSound(byte driveIndex) {
-    unsigned int chargeNotes[] = {
-        noteDoubleTicks[31],
-        noteDoubleTicks[36],
-        noteDoubleTicks[38],
-        noteDoubleTicks[43],
+    period_t chargeNotes[] = {
+        doubleTicksForNote(31),
+        doubleTicksForNote(36),
+        doubleTicksForNote(38),
+        doubleTicksForNote(43),
         0};
     byte i = 0;
     unsigned long lastRun = 0;
     while (i < 5) {
         if (millis() - 200 > lastRun) {
             lastRun = millis();
-            currentPeriod[driveIndex] = chargeNotes[i++];
+            setPeriod(driveIndex, chargeNotes[i++]);
         }
     }
 }
@@ -95,20 +105,22 @@ void ShiftedFloppyDrives::dev_reset(uint8_t subAddress) {
 
 void ShiftedFloppyDrives::dev_noteOn(uint8_t subAddress, uint8_t payload[]) {
     if (payload[0] <= MAX_FLOPPY_NOTE) {
-        currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] = noteDoubleTicks[payload[0]];
+        originalPeriod[subAddress - 1] = doubleTicksForNote(payload[0]);
+        setPeriod(subAddress - 1, originalPeriod[subAddress - 1]);
     }
 };
 void ShiftedFloppyDrives::dev_noteOff(uint8_t subAddress, uint8_t payload[]) {
-    currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] = 0;
+    originalPeriod[subAddress - 1] = 0;
+    setPeriod(subAddress - 1, 0);
 };
 void ShiftedFloppyDrives::dev_bendPitch(uint8_t subAddress, uint8_t payload[]) {
     // A value from -8192 to 8191 representing the pitch deflection
     int16_t bendDeflection = payload[0] << 8 | payload[1];
 
     // A whole octave of bend would double the frequency (halve the the period) of notes
-    // Calculate bend based on BEND_OCTAVES from MoppyInstrument.h and percentage of deflection
+    // Calculate bend based on BEND_OCTAVES (from MoppyTables.h) and percentage of deflection
     //currentPeriod[subAddress] = originalPeriod[subAddress] / 1.4;
-    currentPeriod[subAddress - 1] = originalPeriod[subAddress - 1] / pow(2.0, BEND_OCTAVES * (bendDeflection / (float)8192));
+    setPeriod(subAddress - 1, bendPeriod(originalPeriod[subAddress - 1], bendDeflection));
 };
 
 void ShiftedFloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
@@ -119,6 +131,23 @@ void ShiftedFloppyDrives::deviceMessage(uint8_t subAddress, uint8_t command, uin
     }
 }
 
+#ifdef VOICE_POOL
+// For picking a pooled drive (see MoppyInstrument::preferredVoice()).  A set direction bit means
+// the head's heading back toward MIN_POSITION, and sub-addresses past LAST_DRIVE have no drive.
+bool ShiftedFloppyDrives::driveHead(uint8_t voice, DriveHead &head) {
+    byte d = MIN_SUB_ADDRESS + voice;
+    if (d > LAST_DRIVE) {
+        return false;
+    }
+    byte driveIndex = d - 1;
+    head.position = currentPosition[driveIndex];
+    head.minPosition = MIN_POSITION[driveIndex];
+    head.maxPosition = MAX_POSITION[driveIndex];
+    head.reversed = bitRead(directionBits, driveIndex);
+    return true;
+}
+#endif
+
 void ShiftedFloppyDrives::setMovement(byte driveIndex, bool movementEnabled) {
     if (movementEnabled) {
         MIN_POSITION[driveIndex] = 0;
@@ -156,10 +185,11 @@ void ShiftedFloppyDrives::tick() {
 
     for (int d = 0; d < LAST_DRIVE; d++) {
         if (currentPeriod[d] > 0) {
-            if (++currentTick[d] >= currentPeriod[d]) {
+            currentTick[d] += PERIOD_ONE_TICK;
+            if (currentTick[d] >= currentPeriod[d]) {
                 togglePin(d);
                 shiftNeeded = true;
-                currentTick[d] = 0;
+                currentTick[d] = (currentTick[d] - currentPeriod[d]) & PERIOD_FRACTION_MASK;
             }
         }
     }
@@ -169,6 +199,17 @@ void ShiftedFloppyDrives::tick() {
     }
 }
 
+// Called by the step scheduler (instead of tick()) whenever a drive is due to step
+#ifdef ARDUINO_ARCH_ESP8266
+void ICACHE_RAM_ATTR ShiftedFloppyDrives::step(byte driveIndex) {
+#elif ARDUINO_ARCH_ESP32
+void IRAM_ATTR ShiftedFloppyDrives::step(byte driveIndex) {
+#else
+void ShiftedFloppyDrives::step(byte driveIndex) {
+#endif
+    togglePin(driveIndex);
+}
+
 #ifdef ARDUINO_ARCH_ESP8266
 void ICACHE_RAM_ATTR ShiftedFloppyDrives::togglePin(byte driveIndex) {
 #elif ARDUINO_ARCH_ESP32
@@ -203,20 +244,12 @@ void IRAM_ATTR ShiftedFloppyDrives::shiftBits() {
 #else
 void ShiftedFloppyDrives::shiftBits() {
 #endif
-#ifdef ARDUINO_AVR_UNO
-    PORTD &= B11101111;
-#else
-    digitalWrite(LATCH_PIN, LOW);
-#endif
+    FastPin<LATCH_PIN>::low();
 
     SPI.transfer(directionBits);
     SPI.transfer(stepBits);
 
-#ifdef ARDUINO_AVR_UNO
-    PORTD |= B00010000;
-#else
-    digitalWrite(LATCH_PIN, HIGH);
-#endif
+    FastPin<LATCH_PIN>::high();
 }
 #pragma GCC pop_options
 
@@ -224,10 +257,23 @@ void ShiftedFloppyDrives::shiftBits() {
 //// UTILITY FUNCTIONS
 //
 
+// Sets the period for a drive, letting the step scheduler know about it if that's in use
+void ShiftedFloppyDrives::setPeriod(byte driveIndex, period_t period) {
+    MoppyCriticalSection critical; // period_t is more than one byte, so tick() mustn't see half of it
+    currentPeriod[driveIndex] = period;
+#ifdef STEP_SCHEDULER
+    MoppyScheduler::setPeriod(driveIndex, period);
+#else
+    if (period == 0) {
+        currentTick[driveIndex] = 0; // So the next note starts from the beginning of its period
+    }
+#endif
+}
+
 // Immediately stops all drives
 void ShiftedFloppyDrives::haltAllDrives() {
     for (byte d = 0; d < LAST_DRIVE; d++) {
-        currentPeriod[d] = 0;
+        setPeriod(d, 0);
     }
 }
 
@@ -253,7 +299,7 @@ void ShiftedFloppyDrives::resetAll() {
 
     // Stop all drives and set to reverse
     for (byte d = 0; d < LAST_DRIVE; d++) {
-        currentPeriod[d] = 0;
+        setPeriod(d, 0);
     }
     directionBits = B11111111;
     shiftBits();
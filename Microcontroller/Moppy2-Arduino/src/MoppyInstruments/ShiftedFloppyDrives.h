@@ -3,12 +3,14 @@
  * Floppy drives connected to shift register(s)
  */
 
-#ifndef SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_
-#define SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_
+#ifndef SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_
+#define SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_
 
 #include "../MoppyConfig.h"
 #include "../MoppyNetworks/MoppyNetwork.h"
 #include "MoppyInstrument.h"
+#include "FastPin.h"
+#include "MoppyScheduler.h"
 #include "MoppyTimer.h"
 #include <Arduino.h>
 #include <SPI.h>
@@ -16,7 +18,14 @@ namespace instruments {
 class ShiftedFloppyDrives : public MoppyInstrument {
 public:
     void setup();
-    static const int LATCH_PIN = 2; //RCLK
+    void describe(MoppyCapabilities &capabilities) override;
+    // RCLK.  Uno builds have always latched on pin 4 (through PORTD directly), so existing boards
+    // keep that wiring.
+#ifdef ARDUINO_AVR_UNO
+    static const int LATCH_PIN = 4;
+#else
+    static const int LATCH_PIN = 2;
+#endif
 
 protected:
     void sys_sequenceStop() override;
@@ -27,6 +36,9 @@ protected:
     void dev_noteOff(uint8_t subAddress, uint8_t payload[]) override;
     void dev_bendPitch(uint8_t subAddress, uint8_t payload[]) override;
     void deviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
+#ifdef VOICE_POOL
+    bool driveHead(uint8_t voice, DriveHead &head) override;
+#endif
 
 private:
     static const byte LAST_DRIVE = 8; // Number of drives being used.  This determines the size of some arrays.
@@ -40,11 +52,13 @@ private:
     static unsigned int currentPosition[LAST_DRIVE];
     static uint8_t stepBits;      // Bits that represent the current state of the step pins
     static uint8_t directionBits; // Bits that represent the current state of the direction pins
-    static unsigned int currentPeriod[LAST_DRIVE];
-    static unsigned int currentTick[LAST_DRIVE];
-    static unsigned int originalPeriod[LAST_DRIVE];
+    static period_t currentPeriod[LAST_DRIVE];
+    static period_t currentTick[LAST_DRIVE];
+    static period_t originalPeriod[LAST_DRIVE];
 
     static void tick();
+    static void step(byte driveIndex);
+    static void setPeriod(byte driveIndex, period_t period);
     static void resetAll();
     static void togglePin(byte driveIndex);
     static void shiftBits();
@@ -56,4 +70,4 @@ private:
 };
 } // namespace instruments
 
-#endif /* SRC_MOPPYINSTRUMENTS_FLOPPYDRIVES_H_ */
\ No newline at end of file
+#endif /* SRC_MOPPYINSTRUMENTS_SHIFTEDFLOPPYDRIVES_H_ */
\ No newline at end of file
@@ -6,6 +6,9 @@
 #ifndef MOPPY_SRC_MOPPYMESSAGECONSUMER_H_
 #define MOPPY_SRC_MOPPYMESSAGECONSUMER_H_
 
+#include "MoppyConfig.h"
+#include "MoppyInstruments/MoppyTimer.h"
+#include "MoppyNetworks/MoppyCapabilities.h"
 #include "MoppyNetworks/MoppyNetwork.h"
 #include <Arduino.h>
 
@@ -53,6 +56,32 @@ public:
         };
     };
 
+    /*
+     * Handles the payload of a NETBYTE_DEV_BUNDLE, which packs any number of device messages into
+     * one.  The STEP timer is held until they've all been handled so they take effect on the same
+     * tick (e.g. every note of a chord starts in phase).  Messages for sub-addresses we aren't
+     * listening to are skipped, and one that runs past the end of the bundle ends it.
+     */
+    void handleDeviceBundle(uint8_t records[], uint8_t length) {
+        MoppyTimer::hold(MoppyTimer::STEP);
+        uint8_t pos = 0;
+        while (length - pos >= 3) {
+            uint8_t subAddress = records[pos];
+            uint8_t size = records[pos + 1]; // Command and payload
+            if (size == 0 || size > length - pos - 2) {
+                break;
+            }
+            if (subAddress == 0x00 || (subAddress >= MIN_SUB_ADDRESS && subAddress <= MAX_SUB_ADDRESS)) {
+                handleDeviceMessage(subAddress, records[pos + 2], &records[pos + 3]);
+            }
+            pos += 2 + size;
+        }
+        MoppyTimer::release(MoppyTimer::STEP);
+    };
+
+    // Fills in the instrument's part of an extended NETBYTE_SYS_PONG (see MoppyCapabilities.h)
+    virtual void describe(MoppyCapabilities &capabilities){};
+
 protected:
     virtual void sys_sequenceStart(){};
     virtual void sys_sequenceStop(){};
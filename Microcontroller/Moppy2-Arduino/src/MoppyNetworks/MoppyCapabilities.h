@@ -0,0 +1,83 @@
+/*
+ * MoppyCapabilities.h
+ * What a device can do, for Controllers that want to pick the best way of talking to each one.
+ *
+ * A Controller asks by sending a NETBYTE_SYS_PING with a one-byte payload: the highest version of
+ * the capability block it understands.  The NETBYTE_SYS_PONG in reply is the usual device address
+ * and sub-address range, followed by the capability block.  A NETBYTE_SYS_PING without a payload
+ * still gets just the usual three bytes, so older Controllers are unaffected.
+ *
+ * Capability block (version 1, multi-byte values are big-endian):
+ *  0     - Version of this block (1)
+ *  1     - Length of the rest of the block (later versions only ever add to the end)
+ *  2     - Instrument type (MOPPY_INSTRUMENT_*)
+ *  3     - Number of notes the instrument can play at once
+ *  4-5   - Length of the instrument's timer tick in microseconds (1 with STEP_SCHEDULER)
+ *  6-9   - Fastest baud rate NETBYTE_SYS_SETBAUD accepts (0 if the network doesn't have one)
+ *  10-11 - Most bytes the device can take at once: the size of the receive buffer, or of the
+ *          largest packet for networks that have packets
+ *  12-13 - Features (MOPPY_FEATURE_* bits)
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYCAPABILITIES_H_
+#define SRC_MOPPYNETWORKS_MOPPYCAPABILITIES_H_
+
+#include <stdint.h>
+#include "../MoppyConfig.h"
+
+#define MOPPY_CAPABILITIES_VERSION 1
+#define MOPPY_CAPABILITIES_LENGTH 14
+
+#define MOPPY_INSTRUMENT_UNKNOWN 0x00
+#define MOPPY_INSTRUMENT_FLOPPIES 0x01
+#define MOPPY_INSTRUMENT_EASYDRIVER 0x02
+#define MOPPY_INSTRUMENT_L298N 0x03
+#define MOPPY_INSTRUMENT_SHIFT_REGISTER 0x04
+#define MOPPY_INSTRUMENT_SHIFTED_FLOPPIES 0x05
+
+// Network features
+#define MOPPY_FEATURE_BUNDLE 0x0001            // NETBYTE_DEV_BUNDLE
+#define MOPPY_FEATURE_ENCODING_COMPACT 0x0002  // MOPPY_ENCODING_COMPACT
+#define MOPPY_FEATURE_ENCODING_COBS 0x0004     // MOPPY_ENCODING_COBS
+#define MOPPY_FEATURE_SETBAUD 0x0008           // NETBYTE_SYS_SETBAUD
+#define MOPPY_FEATURE_FLOW_CONTROL 0x0010      // NETBYTE_SYS_SETFLOWCONTROL
+#define MOPPY_FEATURE_LINK_STATS 0x0020        // NETBYTE_SYS_GETLINKSTATS
+#define MOPPY_FEATURE_QUEUE_STATS 0x0040       // NETBYTE_SYS_GETQUEUESTATS
+#define MOPPY_FEATURE_ISR_STATS 0x0080         // NETBYTE_SYS_GETISRSTATS
+// Instrument features
+#define MOPPY_FEATURE_STEP_SCHEDULER 0x0100    // Steps are timed to the microsecond
+#define MOPPY_FEATURE_PHASE_ACCUMULATOR 0x0200 // Steps are timed to a fraction of a tick on average
+#define MOPPY_FEATURE_BATCHED_OUTPUT 0x0400    // Pin changes are a tick late, but all at once
+#define MOPPY_FEATURE_VOICE_POOL 0x0800        // NETBYTE_DEV_POOLNOTEON and NETBYTE_DEV_POOLNOTEOFF
+#define MOPPY_FEATURE_ARPEGGIO 0x1000          // Each drive plays every note sent to it, switching between them
+#define MOPPY_FEATURE_MODULATION 0x2000        // NETBYTE_DEV_GLIDE, NETBYTE_DEV_VIBRATO, and NETBYTE_DEV_BENDRAMP
+
+struct MoppyCapabilities {
+    uint8_t instrumentType = MOPPY_INSTRUMENT_UNKNOWN;
+    uint8_t voices = 0;
+    uint16_t tickMicros = 0;
+    uint32_t maxBaudRate = 0;
+    uint16_t bufferSize = 0;
+    uint16_t features = 0;
+
+    // Writes the capability block to payload (MOPPY_CAPABILITIES_LENGTH bytes) and returns its length
+    uint8_t write(uint8_t payload[]) const {
+        payload[0] = MOPPY_CAPABILITIES_VERSION;
+        payload[1] = MOPPY_CAPABILITIES_LENGTH - 2;
+        payload[2] = instrumentType;
+        payload[3] = voices;
+        payload[4] = tickMicros >> 8;
+        payload[5] = tickMicros;
+        payload[6] = maxBaudRate >> 24;
+        payload[7] = maxBaudRate >> 16;
+        payload[8] = maxBaudRate >> 8;
+        payload[9] = maxBaudRate;
+        payload[10] = bufferSize >> 8;
+        payload[11] = bufferSize;
+        payload[12] = features >> 8;
+        payload[13] = features;
+        return MOPPY_CAPABILITIES_LENGTH;
+    }
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYCAPABILITIES_H_ */
@@ -0,0 +1,72 @@
+/*
+ * MoppyCobs.cpp
+ *
+ */
+#include "MoppyCobs.h"
+
+void MoppyCobsDecoder::reset() {
+    frameLength = 0;
+    decodedLength = 0;
+    blockCode = 0xFF;
+    blockLeft = 0;
+    crc = 0;
+    discarding = false;
+}
+
+uint16_t MoppyCobsDecoder::decode(uint8_t data[], uint16_t length) {
+    bodyLength = 0;
+
+    if (discarding) {
+        // Drop everything up to and including the next delimiter
+        uint16_t used = 0;
+        while (used < length) {
+            if (data[used++] == 0x00) {
+                discarding = false;
+                break;
+            }
+        }
+        return used;
+    }
+
+    while (frameLength < length) {
+        uint8_t b = data[frameLength++];
+
+        if (b == 0x00) {
+            // End of the frame.  An empty one is fine (it's an easy way to make sure we're in sync).
+            uint16_t used = frameLength;
+            if (blockLeft != 0 || (decodedLength > 0 && decodedLength < 4)) {
+                framingErrors++;
+            } else if (crc != 0) {
+                crcErrors++; // A CRC over a message and its own CRC always comes out to 0
+            } else if (decodedLength > 0) {
+                bodyLength = decodedLength - 1;
+            }
+            reset();
+            return used;
+        }
+
+        if (frameLength >= MOPPY_COBS_MAX_FRAME) {
+            framingErrors++;
+            uint16_t used = frameLength;
+            reset();
+            discarding = true;
+            return used;
+        }
+
+        // Decoded bytes are written back over the frame, which never catches up with what's being read
+        if (blockLeft == 0) {
+            // A new code byte: unless the last block was a full one, it ended where a 0x00 was
+            if (frameLength > 1 && blockCode != 0xFF) {
+                data[decodedLength++] = 0x00;
+                crc = crc8Update(crc, 0x00);
+            }
+            blockCode = b;
+            blockLeft = b - 1;
+        } else {
+            data[decodedLength++] = b;
+            crc = crc8Update(crc, b);
+            blockLeft--;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * MoppyCobs.h
+ * Framed encoding for messages from the Controller (MOPPY_ENCODING_COBS), for links where line
+ * noise is a problem.  Each message is sent as:
+ *
+ *   COBS(address, subAddress, command, payload..., CRC-8) 0x00
+ *
+ * COBS (Consistent Overhead Byte Stuffing) replaces every 0x00 in the frame with the distance to
+ * the next one, so 0x00 only ever appears as the delimiter at the end.  However a frame is
+ * damaged, the decoder is back in sync at the next delimiter, and the CRC (polynomial 0x07,
+ * initial value 0, over everything before it) catches the damaged frame so it's just dropped.
+ *
+ * Frames are decoded in place as their bytes arrive, one byte at a time, so the decoded message
+ * takes up the start of the same buffer.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYCOBS_H_
+#define SRC_MOPPYNETWORKS_MOPPYCOBS_H_
+
+#include "Arduino.h"
+#include "../MoppyInstruments/MoppyTables.h"
+#include <stdint.h>
+
+// Longest frame there can be on the wire, including its delimiter.  The smallest receive ring
+// (256 bytes) holds 255, and anything without a delimiter by then has to be given up on.
+#define MOPPY_COBS_MAX_FRAME 255
+// Longest message body (address, subAddress, command, and payload) that fits in that frame
+#define MOPPY_COBS_MAX_BODY (MOPPY_COBS_MAX_FRAME - 4)
+
+/*
+ * CRC-8 lookup table, generated by the compiler like the note tables
+ */
+#define MOPPY_CRC8_POLYNOMIAL 0x07
+
+constexpr uint8_t crc8Bits(uint8_t crc, int bits) {
+    return bits == 0 ? crc : crc8Bits((crc & 0x80) ? (uint8_t)((crc << 1) ^ MOPPY_CRC8_POLYNOMIAL) : (uint8_t)(crc << 1), bits - 1);
+}
+
+template <typename Indexes> struct Crc8Table;
+template <int... Is> struct Crc8Table<TableIndexes<Is...> > {
+    static const uint8_t values[sizeof...(Is)];
+};
+template <int... Is>
+const uint8_t Crc8Table<TableIndexes<Is...> >::values[sizeof...(Is)] TABLE_ATTR = {crc8Bits((uint8_t)Is, 8)...};
+
+typedef Crc8Table<MakeTableIndexes<256>::type> crc8Table;
+
+inline uint8_t crc8Update(uint8_t crc, uint8_t b) {
+    return tableRead(&crc8Table::values[crc ^ b]);
+}
+
+class MoppyCobsDecoder {
+public:
+    /*
+     * Carries on decoding the frame at the start of data, of which length bytes have arrived so far
+     * (data must stay where it is until the frame's done).  Returns 0 while the frame is still
+     * arriving, and otherwise the number of bytes that are done with and can be dropped from data.
+     * bodyLength is then the length of the decoded message at the start of data, or 0 if there
+     * isn't one (the frame was bad, or these were the rest of one that was too long).
+     */
+    uint16_t decode(uint8_t data[], uint16_t length);
+
+    // Starts over with a new frame (without clearing the error counts)
+    void reset();
+
+    uint8_t bodyLength = 0;
+
+    uint16_t crcErrors = 0;     // Frames dropped because their CRC didn't match
+    uint16_t framingErrors = 0; // Frames dropped because they were too short, too long, or not valid COBS
+
+private:
+    uint16_t frameLength = 0;   // Bytes of the current frame read so far
+    uint16_t decodedLength = 0; // Bytes of it decoded so far (including the CRC)
+    uint8_t blockCode = 0xFF;   // Code byte of the current COBS block
+    uint8_t blockLeft = 0;      // Bytes left in the current COBS block
+    uint8_t crc = 0;
+    bool discarding = false; // Skipping the rest of a frame that was too long
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYCOBS_H_ */
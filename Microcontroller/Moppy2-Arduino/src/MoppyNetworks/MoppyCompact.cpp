@@ -0,0 +1,156 @@
+/*
+ * MoppyCompact.cpp
+ *
+ */
+#include "MoppyCompact.h"
+
+#define STATUS_NOTEOFF 0x80
+#define STATUS_NOTEON 0x90
+#define STATUS_NOTEON_VELOCITY 0xA0
+#define STATUS_CHORD 0xB0
+#define STATUS_BENDPITCH 0xC0
+#define STATUS_DEVICE_MESSAGE 0xE0
+#define STATUS_SELECT_DEVICE 0xF0
+#define STATUS_SYSTEM_MESSAGE 0xF1
+#define STATUS_STANDARD 0xFF
+
+MoppyCompactDecoder::MoppyCompactDecoder() {
+    reset();
+}
+
+void MoppyCompactDecoder::reset() {
+    runningStatus = 0;
+    runningSubAddress = 0;
+    velocity = 127;
+    device = DEVICE_ADDRESS;
+}
+
+uint16_t MoppyCompactDecoder::decode(uint8_t data[], uint16_t length, MoppyCompactMessage &message) {
+    message.valid = false;
+    if (length == 0) {
+        return 0;
+    }
+
+    uint16_t pos = 1;
+    uint8_t status = data[0];
+    bool running = status < 0x80;
+    if (running) {
+        if (runningStatus == 0) {
+            return 1; // Nothing to repeat, so skip it
+        }
+        status = runningStatus;
+        pos = 0;
+    }
+
+    // Events without a sub-address
+    switch (status) {
+    case STATUS_SELECT_DEVICE:
+        if (length < 2) {
+            return 0;
+        }
+        device = data[1];
+        runningStatus = 0;
+        return 2;
+    case STATUS_SYSTEM_MESSAGE: {
+        if (length < 3) {
+            return 0;
+        }
+        uint8_t size = data[2];
+        if (size > MOPPY_COMPACT_MAX_PAYLOAD) {
+            return 1; // Can't be right
+        }
+        if (length < 3 + size) {
+            return 0;
+        }
+        message = {true, SYSTEM_ADDRESS, 0x00, data[1], &data[3], size};
+        runningStatus = 0;
+        return 3 + size;
+    }
+    case STATUS_STANDARD:
+        payloadBuffer[0] = MOPPY_ENCODING_STANDARD;
+        message = {true, SYSTEM_ADDRESS, 0x00, NETBYTE_SYS_SETENCODING, payloadBuffer, 1};
+        runningStatus = 0;
+        return 1;
+    }
+
+    uint8_t type = status & 0xF0;
+    uint8_t subAddress;
+    if (running) {
+        subAddress = type == STATUS_CHORD ? runningSubAddress + 1 : runningSubAddress;
+    } else if (status & 0x0F) {
+        subAddress = status & 0x0F;
+    } else {
+        if (length < 2) {
+            return 0;
+        }
+        subAddress = data[pos++];
+    }
+
+    uint8_t *eventData = &data[pos];
+    uint16_t eventLength; // Data bytes after the status byte and sub-address
+    uint8_t command;
+    uint8_t *payload = eventData;
+    uint8_t payloadLength;
+
+    switch (type) {
+    case STATUS_NOTEOFF:
+        eventLength = payloadLength = 1;
+        command = NETBYTE_DEV_NOTEOFF;
+        break;
+    case STATUS_NOTEON:
+        eventLength = payloadLength = 2;
+        command = NETBYTE_DEV_NOTEON;
+        break;
+    case STATUS_NOTEON_VELOCITY:
+    case STATUS_CHORD:
+        eventLength = 1;
+        command = NETBYTE_DEV_NOTEON;
+        payload = payloadBuffer;
+        payloadLength = 2;
+        break;
+    case STATUS_BENDPITCH:
+        eventLength = 2;
+        command = NETBYTE_DEV_BENDPITCH;
+        payload = payloadBuffer;
+        payloadLength = 2;
+        break;
+    case STATUS_DEVICE_MESSAGE:
+        if (length < pos + 2) {
+            return 0;
+        }
+        if (eventData[1] > MOPPY_COMPACT_MAX_PAYLOAD) {
+            return 1;
+        }
+        command = eventData[0];
+        payload = &eventData[2];
+        payloadLength = eventData[1];
+        eventLength = 2 + payloadLength;
+        break;
+    default:
+        return 1; // Nothing uses 0xD0 yet
+    }
+
+    if (length < pos + eventLength) {
+        return 0;
+    }
+
+    // The whole event is there, so now it's safe to update everything
+    if (type == STATUS_NOTEON) {
+        velocity = eventData[1];
+    } else if (type == STATUS_BENDPITCH) {
+        // From MIDI's 14 bits centred on 0x2000 to the standard signed 16-bit value
+        int16_t bend = (int16_t)(((uint16_t)(eventData[1] & 0x7F) << 7 | (eventData[0] & 0x7F)) - 0x2000);
+        payloadBuffer[0] = (uint16_t)bend >> 8;
+        payloadBuffer[1] = (uint16_t)bend;
+    } else if (payload == payloadBuffer) {
+        payloadBuffer[0] = eventData[0];
+        payloadBuffer[1] = velocity;
+    }
+    runningStatus = type == STATUS_DEVICE_MESSAGE ? 0 : status;
+    runningSubAddress = subAddress;
+
+    if (device == DEVICE_ADDRESS && (subAddress == 0x00 || (subAddress >= MIN_SUB_ADDRESS && subAddress <= MAX_SUB_ADDRESS))) {
+        message = {true, DEVICE_ADDRESS, subAddress, command, payload, payloadLength};
+    }
+    return pos + eventLength;
+}
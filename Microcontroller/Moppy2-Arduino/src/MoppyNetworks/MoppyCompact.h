@@ -0,0 +1,71 @@
+/*
+ * MoppyCompact.h
+ * Compact encoding for messages from the Controller, which a network can be switched to with
+ * NETBYTE_SYS_SETENCODING.  Instead of a whole frame for every message it's a stream of events
+ * in the style of MIDI, each a status byte (high bit set) followed by its data bytes:
+ *
+ *   0x8s note                  Note off
+ *   0x9s note velocity         Note on
+ *   0xAs note                  Note on at the last velocity sent
+ *   0xBs note                  Note on at the last velocity sent, where each repeat (see below)
+ *                              goes to the next sub-address up (for chords)
+ *   0xCs lsb msb               Pitch bend, as in MIDI (14 bits with 0x2000 in the middle)
+ *   0xEs command size payload  Any other device message (size is the number of payload bytes)
+ *   0xF0 device                Following events are for this device address
+ *   0xF1 command size payload  System message
+ *   0xFF                       Go back to the standard encoding
+ *
+ * s is the sub-address from 1 to 15.  For a sub-address of 0 or above 15, s is 0 and the actual
+ * sub-address follows the status byte.  Events go to DEVICE_ADDRESS until an 0xF0 says otherwise.
+ *
+ * Note, velocity, and bend data bytes are all below 0x80, so a data byte where a status byte is
+ * expected can only be a repeat of the last note or bend event with new data ("running status"),
+ * and a run of notes only costs one or two bytes each.  Anything else that doesn't make sense is
+ * skipped up to the next status byte.
+ *
+ * Replies from the device are always sent with the standard encoding.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYCOMPACT_H_
+#define SRC_MOPPYNETWORKS_MOPPYCOMPACT_H_
+
+#include <stdint.h>
+#include "../MoppyConfig.h"
+#include "MoppyNetwork.h"
+
+// Longest event there can be (status, sub-address, command, size, and payload).  Like a COBS
+// frame it has to fit in the smallest receive ring, which holds 255 bytes.
+#define MOPPY_COMPACT_MAX_EVENT 255
+#define MOPPY_COMPACT_MAX_PAYLOAD (MOPPY_COMPACT_MAX_EVENT - 4)
+
+// A decoded event, which is the same as a message in the standard encoding
+struct MoppyCompactMessage {
+    bool valid; // False if the event didn't produce a message for this device
+    uint8_t address;
+    uint8_t subAddress;
+    uint8_t command;
+    uint8_t *payload; // Points into the decoded data, or the decoder itself
+    uint8_t payloadLength;
+};
+
+class MoppyCompactDecoder {
+public:
+    MoppyCompactDecoder();
+
+    // Decodes the event at the start of data, returning how many bytes it took up, or 0 if the
+    // whole event isn't there yet (in which case nothing's changed).  message is only valid until
+    // data or the decoder change.
+    uint16_t decode(uint8_t data[], uint16_t length, MoppyCompactMessage &message);
+
+    // Forgets the running status, velocity, and device (e.g. at the start of every datagram)
+    void reset();
+
+private:
+    uint8_t runningStatus;
+    uint8_t runningSubAddress;
+    uint8_t velocity;
+    uint8_t device;
+    uint8_t payloadBuffer[2]; // Payload for messages that aren't all there in the data
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYCOMPACT_H_ */
@@ -0,0 +1,84 @@
+/*
+ * MoppyLinkStats.cpp
+ *
+ */
+#include "MoppyLinkStats.h"
+
+void MoppyLinkStats::handled(uint8_t address, uint8_t command) {
+    messages++;
+    uint8_t group;
+    if (address == SYSTEM_ADDRESS) {
+        group = LINK_STATS_SYSTEM;
+    } else {
+        switch (command) {
+        case NETBYTE_DEV_NOTEON:
+            group = LINK_STATS_NOTEON;
+            break;
+        case NETBYTE_DEV_NOTEOFF:
+            group = LINK_STATS_NOTEOFF;
+            break;
+        case NETBYTE_DEV_BENDPITCH:
+            group = LINK_STATS_BENDPITCH;
+            break;
+        case NETBYTE_DEV_RESET:
+            group = LINK_STATS_DEV_RESET;
+            break;
+        case NETBYTE_DEV_BUNDLE:
+            group = LINK_STATS_BUNDLE;
+            break;
+        default:
+            group = LINK_STATS_DEV_OTHER;
+            break;
+        }
+    }
+    if (commands[group] != 0xFFFF) {
+        commands[group]++;
+    }
+}
+
+static uint8_t *writeShort(uint8_t *out, uint16_t value) {
+    *out++ = value >> 8;
+    *out++ = value;
+    return out;
+}
+
+static uint8_t *writeLong(uint8_t *out, uint32_t value) {
+    out = writeShort(out, value >> 16);
+    return writeShort(out, value);
+}
+
+uint8_t MoppyLinkStats::write(uint8_t payload[]) const {
+    uint8_t *out = payload;
+    *out++ = LINK_STATS_VERSION;
+    *out++ = encoding;
+    out = writeShort(out, overruns);
+    out = writeShort(out, crcErrors);
+    out = writeShort(out, framingErrors);
+    out = writeLong(out, messages);
+    out = writeLong(out, bytes);
+    out = writeShort(out, wrongAddress);
+    out = writeShort(out, badLength);
+    out = writeShort(out, resyncs);
+    out = writeLong(out, maxCheckGap);
+    *out++ = LINK_STATS_COMMANDS;
+    for (uint8_t i = 0; i < LINK_STATS_COMMANDS; i++) {
+        out = writeShort(out, commands[i]);
+    }
+    return out - payload;
+}
+
+void MoppyLinkStats::reset() {
+    overruns = 0;
+    crcErrors = 0;
+    framingErrors = 0;
+    messages = 0;
+    bytes = 0;
+    wrongAddress = 0;
+    badLength = 0;
+    resyncs = 0;
+    maxCheckGap = 0;
+    lastChecked = 0;
+    for (uint8_t i = 0; i < LINK_STATS_COMMANDS; i++) {
+        commands[i] = 0;
+    }
+}
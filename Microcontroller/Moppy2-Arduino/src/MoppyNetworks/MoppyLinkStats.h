@@ -0,0 +1,78 @@
+/*
+ * MoppyLinkStats.h
+ * Traffic and error counts for a network, to tell whether a device is keeping up and how clean
+ * its link is.  Each network keeps its own and sends them in reply to NETBYTE_SYS_GETLINKSTATS.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYLINKSTATS_H_
+#define SRC_MOPPYNETWORKS_MOPPYLINKSTATS_H_
+
+#include <Arduino.h>
+#include <stdint.h>
+#include "MoppyNetwork.h"
+
+#define LINK_STATS_VERSION 2
+
+// Commands are counted in these groups
+#define LINK_STATS_NOTEON 0
+#define LINK_STATS_NOTEOFF 1
+#define LINK_STATS_BENDPITCH 2
+#define LINK_STATS_DEV_RESET 3
+#define LINK_STATS_BUNDLE 4
+#define LINK_STATS_DEV_OTHER 5 // Any other device message
+#define LINK_STATS_SYSTEM 6    // Any system message
+#define LINK_STATS_COMMANDS 7
+
+/*
+ * Payload of a NETBYTE_SYS_LINKSTATS (multi-byte values are big-endian).  Fields that don't apply
+ * to a network are always 0.
+ *  0     - Version of this layout (2; version 1 stopped after byte 7)
+ *  1     - Encoding in use
+ *  2-3   - Bytes (or packets, for networks that have them) dropped because they didn't fit
+ *  4-5   - MOPPY_ENCODING_COBS frames dropped for a bad CRC
+ *  6-7   - MOPPY_ENCODING_COBS frames dropped for bad framing
+ *  8-11  - Messages handled
+ *  12-15 - Bytes received
+ *  16-17 - Messages dropped because they were for another device or sub-address
+ *  18-19 - Messages dropped because their length didn't make sense
+ *  20-21 - Times the parser lost track of messages and had to skip bytes to find the next one
+ *  22-25 - Longest time in microseconds between the network being checked for messages
+ *  26    - Number of command counts (LINK_STATS_COMMANDS)
+ *  27... - Two-byte count for each group of commands (LINK_STATS_*)
+ */
+#define LINK_STATS_PAYLOAD_LENGTH (27 + LINK_STATS_COMMANDS * 2)
+
+class MoppyLinkStats {
+public:
+    // Call at the start of each readMessages() to keep track of the longest gap between them
+    void checked() {
+        unsigned long now = micros();
+        if (lastChecked != 0 && now - lastChecked > maxCheckGap) {
+            maxCheckGap = now - lastChecked;
+        }
+        lastChecked = now;
+    }
+
+    // Counts a message that's been handled
+    void handled(uint8_t address, uint8_t command);
+
+    uint8_t write(uint8_t payload[]) const;
+    void reset();
+
+    uint8_t encoding = MOPPY_ENCODING_STANDARD;
+    uint16_t overruns = 0;
+    uint16_t crcErrors = 0;
+    uint16_t framingErrors = 0;
+    uint32_t messages = 0;
+    uint32_t bytes = 0;
+    uint16_t wrongAddress = 0;
+    uint16_t badLength = 0;
+    uint16_t resyncs = 0;
+
+private:
+    unsigned long lastChecked = 0;
+    uint32_t maxCheckGap = 0;
+    uint16_t commands[LINK_STATS_COMMANDS] = {0};
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYLINKSTATS_H_ */
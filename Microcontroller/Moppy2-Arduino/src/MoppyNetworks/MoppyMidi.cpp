@@ -1,15 +1,36 @@
 #include "../MoppyNetworks/MoppyMidi.h"
 
+#ifdef NETWORK_MIDI
+
 /*
  * Serial communications implementation for Arduino.  Handler
  * functions are called to consume system and device messages received from
  * midi devices.
  */
 
+#define MIDI_NOTEOFF 0x80
+#define MIDI_NOTEON 0x90
+#define MIDI_CONTROLCHANGE 0xB0
+#define MIDI_PROGRAMCHANGE 0xC0
+#define MIDI_CHANNELPRESSURE 0xD0
+#define MIDI_BENDPITCH 0xE0
+#define MIDI_SYSEX 0xF0
+#define MIDI_SYSEX_END 0xF7
+#define MIDI_REALTIME 0xF8 // And everything above
+
+#define MIDI_CC_ALLSOUNDOFF 120
+#define MIDI_CC_ALLNOTESOFF 123
 
-byte actPlayingNote[MAX_SUB_ADDRESS]; // MAX_SUB_ADDRESS = Number of Drives
 MoppyMidi::MoppyMidi(MoppyMessageConsumer *messageConsumer) {
     targetConsumer = messageConsumer;
+    for (uint8_t c = 0; c < 16; c++) {
+        channelNote[c] = MOPPY_NOTE_NONE;
+        channelBend[c] = 0;
+        // Drives that channels are mapped to can't be pooled (in STEREO, nor can their partners)
+        if (channelMap[c] >= MIN_SUB_ADDRESS && channelMap[c] <= MAX_SUB_ADDRESS) {
+            voices.reserve((channelMap[c] - MIN_SUB_ADDRESS) % MIDI_POOL_VOICES);
+        }
+    }
 }
 
 void MoppyMidi::begin() {
@@ -17,97 +38,265 @@ void MoppyMidi::begin() {
 }
 
 void MoppyMidi::readMessages() {
-    
-    // Check if minimum needed data availabel
-    // if minimum neede data is not reached it stops the function
-    if(Serial.available() < 3){
+    stats.checked();
+#ifdef SERIAL_RX_BUFFER_SIZE
+    if (Serial.available() >= SERIAL_RX_BUFFER_SIZE - 1) {
+        stats.overruns++; // The core's buffer is full, so anything else arriving is being lost
+    }
+#endif
+
+    // Only what's already arrived, so this never waits on the next byte
+    for (int available = Serial.available(); available > 0; available--) {
+        parse(Serial.read());
+    }
+}
+
+void MoppyMidi::parse(uint8_t b) {
+    stats.bytes++;
+
+    if (b >= MIDI_REALTIME) {
+        handleRealtime(b); // These can turn up anywhere, even in the middle of another message
         return;
     }
-    
-    // Check if the byte is a "firstByte" (because they are bigger than 127 (128...255))
-    // if it is not a first byte restart the routine
-    byte firstByte = Serial.read(); // also called statusByte
-    if(firstByte < 128){
-        Serial.write(firstByte);
+
+    if (b & 0x80) {
+        if (status == MIDI_SYSEX) {
+            endSysEx(); // Any status byte ends one, not just MIDI_SYSEX_END
+        } else if (dataCount > 0) {
+            stats.badLength++; // The last message was cut off
+        }
+        status = b;
+        dataCount = 0;
+        skipping = false;
+        if (b < MIDI_SYSEX) {
+            uint8_t type = b & 0xF0;
+            dataNeeded = (type == MIDI_PROGRAMCHANGE || type == MIDI_CHANNELPRESSURE) ? 1 : 2;
+        } else if (b == MIDI_SYSEX) {
+            sysexLength = 0;
+        } else {
+            // System common messages cancel running status, but their data still has to be
+            // skipped: 0xF1 and 0xF3 have one byte and 0xF2 has two
+            dataNeeded = (b == 0xF2) ? 2 : (b == 0xF1 || b == 0xF3) ? 1 : 0;
+            if (dataNeeded == 0) {
+                status = 0;
+            }
+        }
+        return;
+    }
+
+    // Data byte
+    if (status == MIDI_SYSEX) {
+        if (sysexLength < MIDI_SYSEX_MAX_LENGTH) {
+            sysex[sysexLength] = b;
+        }
+        if (sysexLength < 0xFF) {
+            sysexLength++; // Longer ones aren't ours, but are still read up to the end
+        }
         return;
     }
-    
-    
-    // Check if the byte is a "secondByte"/"thirdByte" (because they are smaller than 128  (0...127))
-    byte secondByte = Serial.read(); // Databyte
-    if(secondByte > 127){
-        Serial.write(firstByte);
-        Serial.write(secondByte);
+    if (status == 0) {
+        if (!skipping) {
+            stats.resyncs++; // Data without a status (e.g. we started listening mid-message)
+            skipping = true;
+        }
         return;
     }
-    
-    
-    // Can be deleted because data is not needed
-    byte thirdByte = Serial.read(); // dataByte
-    if(thirdByte > 127){
-        Serial.write(firstByte);
-        Serial.write(secondByte);
-        Serial.write(thirdByte);
 
+    data[dataCount++] = b;
+    if (dataCount == dataNeeded) {
+        dataCount = 0;
+        if (status < MIDI_SYSEX) {
+            handleChannelMessage(); // Running status: the next data bytes are another one of these
+        } else {
+            status = 0;
+        }
+    }
+}
+
+void MoppyMidi::handleRealtime(uint8_t b) {
+    // Start, Stop, and Reset have the same values as the system messages
+    if (b == NETBYTE_SYS_START || b == NETBYTE_SYS_STOP || b == NETBYTE_SYS_RESET) {
+        if (b == NETBYTE_SYS_RESET) {
+            // Every drive's about to be stopped
+            voices.reset();
+            for (uint8_t c = 0; c < 16; c++) {
+                channelNote[c] = MOPPY_NOTE_NONE;
+                channelBend[c] = 0;
+            }
+        }
+        stats.handled(SYSTEM_ADDRESS, b);
+        targetConsumer->handleSystemMessage(b, data);
+    }
+}
+
+void MoppyMidi::handleChannelMessage() {
+    uint8_t channel = status & 0x0F;
+    if (channelMap[channel] == MIDI_CHANNEL_IGNORE) {
+        stats.wrongAddress++;
         return;
     }
-    
-    // start docode
-    boolean firstBits[8];// = getBits(firstByte); // Not used because of limitations of C++/INO
-    
-    
-    
-    for( int i = 0; i < 8; i++){
-        firstBits[i] = bitRead(firstByte, 7-i);
-    }
-    
-    // Debug:
-    //Serial.println(String(firstByte) + " : " + String(secondByte) + " : " + String(thirdByte));
-    
-    // Not needed, information will be get direct out of byte
-    //boolean secondBits[8] = getBits(secondByte);
-    
-    //Not needed, Floppy has no dynmaics ("loudness")
-    //boolean thirdBits[8] = getBits(thirdByte);
-    
-    
-    if( (firstBits[1] == 0 && firstBits[2] == 0 && firstBits[3] == 1)){
-        if(secondByte == 0){
-            firstBits[3] = 0;
-        }else{
-            if(STEREO){
-                for(int i = 0; i <= MAX_SUB_ADDRESS/2; i++){
-                    if(actPlayingNote[i] == 0){
-                        actPlayingNote[i] = secondByte;
-                        actPlayingNote[i+MAX_SUB_ADDRESS/2] = secondByte;
-                        targetConsumer->handleDeviceMessage(i+1, NETBYTE_DEV_NOTEON, &secondByte);
-                        targetConsumer->handleDeviceMessage(i+1+MAX_SUB_ADDRESS/2, NETBYTE_DEV_NOTEON, &secondByte);
-                        i = MAX_SUB_ADDRESS + 1;
-                        return;
-                    }
-                }
-            }else{
-                for(int i = 0; i <= MAX_SUB_ADDRESS; i++){
-                    if(actPlayingNote[i] == 0){
-                        actPlayingNote[i] = secondByte;
-                        targetConsumer->handleDeviceMessage(i+1, NETBYTE_DEV_NOTEON, &secondByte);
-                        i = MAX_SUB_ADDRESS + 1;
-                        return;
-                    }
-                }
+
+    switch (status & 0xF0) {
+    case MIDI_NOTEON:
+        if (data[1] > 0) {
+            noteOn(channel, data[0], data[1]);
+        } else {
+            noteOff(channel, data[0]); // A velocity of 0 is a note off
+        }
+        break;
+    case MIDI_NOTEOFF:
+        noteOff(channel, data[0]);
+        break;
+    case MIDI_BENDPITCH:
+        bendPitch(channel, data[0], data[1]);
+        break;
+    case MIDI_CONTROLCHANGE:
+        controlChange(channel, data[0], data[1]);
+        break;
+    }
+}
+
+void MoppyMidi::endSysEx() {
+    if (sysexLength >= 3 && sysexLength <= 4 && sysex[0] == MIDI_SYSEX_ID && sysex[1] == MIDI_SYSEX_MOPPY && sysex[2] == MIDI_SYSEX_GETLINKSTATS) {
+        stats.handled(SYSTEM_ADDRESS, NETBYTE_SYS_GETLINKSTATS);
+        sendLinkStats(sysexLength == 4 && sysex[3] == 0x01);
+    }
+    status = 0;
+}
+
+void MoppyMidi::noteOn(uint8_t channel, uint8_t note, uint8_t velocity) {
+    uint8_t payload[2] = {note, velocity};
+    uint8_t subAddress = channelMap[channel];
+
+    if (subAddress == MIDI_CHANNEL_POOL) {
+        uint8_t stolenNote;
+        uint8_t voice = voices.noteOn(note, velocity, channel, stolenNote);
+        if (voice == MOPPY_VOICE_NONE) {
+            return; // Every drive's busy and MIDI_STEAL_POLICY is MOPPY_STEAL_NONE
+        }
+        if (stolenNote != MOPPY_NOTE_NONE) {
+            sendToVoice(voice, NETBYTE_DEV_NOTEOFF, &stolenNote);
+        }
+        startNote(MIN_SUB_ADDRESS + voice, channel, payload);
+        if (STEREO) {
+            startNote(MIN_SUB_ADDRESS + voice + MIDI_POOL_VOICES, channel, payload);
+        }
+    } else {
+        channelNote[channel] = note;
+        startNote(subAddress, channel, payload);
+    }
+}
+
+void MoppyMidi::startNote(uint8_t subAddress, uint8_t channel, uint8_t payload[]) {
+    sendDeviceMessage(subAddress, NETBYTE_DEV_NOTEON, payload);
+    // Notes start unbent, so carry on any bend the channel already has
+    if (channelBend[channel] != 0) {
+        sendBend(subAddress, channelBend[channel]);
+    }
+}
+
+void MoppyMidi::sendToVoice(uint8_t voice, uint8_t command, uint8_t payload[]) {
+    sendDeviceMessage(MIN_SUB_ADDRESS + voice, command, payload);
+    if (STEREO) {
+        sendDeviceMessage(MIN_SUB_ADDRESS + voice + MIDI_POOL_VOICES, command, payload);
+    }
+}
+
+void MoppyMidi::noteOff(uint8_t channel, uint8_t note) {
+    uint8_t subAddress = channelMap[channel];
+
+    if (subAddress == MIDI_CHANNEL_POOL) {
+        uint8_t voice = voices.noteOff(note, channel);
+        if (voice != MOPPY_VOICE_NONE) {
+            sendToVoice(voice, NETBYTE_DEV_NOTEOFF, &note);
+        }
+    } else if (MIDI_MAPPED_CHORDS || channelNote[channel] == note) {
+        // Otherwise a newer note's already taken over the drive
+        if (channelNote[channel] == note) {
+            channelNote[channel] = MOPPY_NOTE_NONE;
+        }
+        sendDeviceMessage(subAddress, NETBYTE_DEV_NOTEOFF, &note);
+    }
+}
+
+void MoppyMidi::allNotesOff(uint8_t channel) {
+    if (channelMap[channel] == MIDI_CHANNEL_POOL) {
+        uint8_t voice = voices.first();
+        while (voice != MOPPY_VOICE_NONE) {
+            uint8_t next = voices.next(voice);
+            if (voices.channel(voice) == channel) {
+                noteOff(channel, voices.note(voice));
             }
+            voice = next;
+        }
+    } else if (MIDI_MAPPED_CHORDS) {
+        // Only the newest note of the chord is kept track of here, so turn off every note
+        for (uint8_t note = 0; note < 128; note++) {
+            noteOff(channel, note);
         }
+    } else if (channelNote[channel] != MOPPY_NOTE_NONE) {
+        noteOff(channel, channelNote[channel]);
     }
-    if( (firstBits[1] == 0 && firstBits[2] == 0 && firstBits[3] == 0)){
-        for (int i = 0; i <= MAX_SUB_ADDRESS; i++){
-            if(secondByte == actPlayingNote[i]){
-                actPlayingNote[i] = 0;
-                targetConsumer->handleDeviceMessage(i + 1, NETBYTE_DEV_NOTEON, &secondByte);
-                return;
+}
+
+void MoppyMidi::bendPitch(uint8_t channel, uint8_t lsb, uint8_t msb) {
+    // From MIDI's 14 bits centred on 0x2000 to the signed 16-bit value instruments expect
+    int16_t bend = (int16_t)(((uint16_t)msb << 7 | lsb) - 0x2000);
+    channelBend[channel] = bend;
+
+    uint8_t subAddress = channelMap[channel];
+    if (subAddress == MIDI_CHANNEL_POOL) {
+        for (uint8_t voice = voices.first(); voice != MOPPY_VOICE_NONE; voice = voices.next(voice)) {
+            if (voices.channel(voice) == channel) {
+                sendBend(MIN_SUB_ADDRESS + voice, bend);
+                if (STEREO) {
+                    sendBend(MIN_SUB_ADDRESS + voice + MIDI_POOL_VOICES, bend);
+                }
             }
         }
+    } else {
+        sendBend(subAddress, bend);
+    }
+}
+
+void MoppyMidi::sendBend(uint8_t subAddress, int16_t bend) {
+    uint8_t payload[2] = {(uint8_t)((uint16_t)bend >> 8), (uint8_t)bend};
+    sendDeviceMessage(subAddress, NETBYTE_DEV_BENDPITCH, payload);
+}
+
+void MoppyMidi::controlChange(uint8_t channel, uint8_t controller, uint8_t value) {
+    if (controller == MIDI_CC_ALLSOUNDOFF || controller == MIDI_CC_ALLNOTESOFF) {
+        allNotesOff(channel);
+        return;
     }
-    Serial.write(firstByte);
-    Serial.write(secondByte);
-    Serial.write(thirdByte);
+    // Pooled channels don't have a drive of their own, so their controllers go to the whole device
+    uint8_t payload[2] = {controller, value};
+    uint8_t subAddress = channelMap[channel];
+    sendDeviceMessage(subAddress == MIDI_CHANNEL_POOL ? 0x00 : subAddress, NETBYTE_DEV_CONTROLCHANGE, payload);
 }
+
+void MoppyMidi::sendDeviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) {
+    if (subAddress != 0x00 && (subAddress < MIN_SUB_ADDRESS || subAddress > MAX_SUB_ADDRESS)) {
+        stats.wrongAddress++; // Mapped to a sub-address we don't have
+        return;
+    }
+    stats.handled(DEVICE_ADDRESS, command);
+    targetConsumer->handleDeviceMessage(subAddress, command, payload);
+}
+
+void MoppyMidi::sendLinkStats(bool reset) {
+    uint8_t payload[LINK_STATS_PAYLOAD_LENGTH];
+    uint8_t length = stats.write(payload);
+    if (reset) {
+        stats.reset();
+    }
+    const uint8_t header[] = {MIDI_SYSEX, MIDI_SYSEX_ID, MIDI_SYSEX_MOPPY, MIDI_SYSEX_LINKSTATS};
+    Serial.write(header, sizeof(header));
+    for (uint8_t i = 0; i < length; i++) {
+        Serial.write(payload[i] >> 4);
+        Serial.write(payload[i] & 0x0F);
+    }
+    Serial.write(MIDI_SYSEX_END);
+}
+
+#endif /* NETWORK_MIDI */
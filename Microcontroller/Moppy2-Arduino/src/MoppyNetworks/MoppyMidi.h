@@ -1,29 +1,111 @@
 /*
  * MoppyMidi.h
+ * Plays MIDI straight from a MIDI device (e.g. a keyboard) instead of the Controller.
  *
+ * Bytes are parsed one at a time as they arrive, with running status, so a message is handled as
+ * soon as its last byte is in.  Note on/off, pitch bend, and control change are passed to the
+ * instrument as device messages, going by the channel's entry in MIDI_CHANNEL_MAP.  MIDI Start,
+ * Stop, and Reset are passed on as the matching system messages.  Everything else (including
+ * SysEx other than the query below) is skipped.
  */
 
-#ifndef SRC_MOPPYNETWORKS_MOPPYSERIAL_H_
-#define SRC_MOPPYNETWORKS_MOPPYSERIAL_H_
+#ifndef SRC_MOPPYNETWORKS_MOPPYMIDI_H_
+#define SRC_MOPPYNETWORKS_MOPPYMIDI_H_
 
 #include <stdint.h>
 #include "Arduino.h"
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
+#include "../MoppyVoices.h"
+#include "MoppyLinkStats.h"
 #include "MoppyNetwork.h"
 
 #define MOPPY_BAUD_RATE 31250
-#define STEREO false
-#define ONLY3BYTE false
+#define STEREO false // Play every pooled note on two drives, one from each half
+
+// Which pooled note to cut off when a new one arrives and every drive is playing (MOPPY_STEAL_*
+// from MoppyVoices.h, or MOPPY_STEAL_NONE to drop the new note instead)
+#ifndef MIDI_STEAL_POLICY
+#define MIDI_STEAL_POLICY MOPPY_STEAL_OLDEST
+#endif
+
+/*
+ * What to do with each MIDI channel (1 to 16, in order):
+ *  MIDI_CHANNEL_POOL   - Notes go to whichever drive is free (that isn't mapped to a channel)
+ *  MIDI_CHANNEL_IGNORE - Skip the channel
+ *  Anything else       - Play the channel on that sub-address, one note at a time (unless
+ *                        MIDI_MAPPED_CHORDS)
+ */
+#define MIDI_CHANNEL_POOL 0x00
+#define MIDI_CHANNEL_IGNORE 0xFF
+#ifndef MIDI_CHANNEL_MAP
+#define MIDI_CHANNEL_MAP {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
+#endif
+
+// With ARPEGGIO a drive plays every note it's sent, so a mapped channel plays chords on its drive
+// (each note is turned off by its own note off, rather than the next note replacing it)
+#ifdef ARPEGGIO
+#define MIDI_MAPPED_CHORDS true
+#else
+#define MIDI_MAPPED_CHORDS false
+#endif
+
+/*
+ * There's no Controller to send system messages over MIDI, so link statistics are requested with
+ * a SysEx message instead: F0 7D 4D 08 F7, or F0 7D 4D 08 01 F7 to reset them afterwards (7D is
+ * the ID for non-commercial use).  The reply is F0 7D 4D 09, then the NETBYTE_SYS_LINKSTATS
+ * payload as two bytes per byte (high nibble first), then F7.
+ */
+#define MIDI_SYSEX_ID 0x7D
+#define MIDI_SYSEX_MOPPY 0x4D
+#define MIDI_SYSEX_GETLINKSTATS (NETBYTE_SYS_GETLINKSTATS & 0x7F)
+#define MIDI_SYSEX_LINKSTATS (NETBYTE_SYS_LINKSTATS & 0x7F)
+#define MIDI_SYSEX_MAX_LENGTH 6
+
+// Pooled voices, each playing on sub-address MIN_SUB_ADDRESS + voice (and on the matching drive in
+// the second half as well in STEREO)
+#define MIDI_POOL_VOICES ((MAX_SUB_ADDRESS - MIN_SUB_ADDRESS + 1) / (STEREO ? 2 : 1))
 
 class MoppyMidi {
   public:
     MoppyMidi(MoppyMessageConsumer *messageConsumer);
     void begin();
     void readMessages();
+
   private:
-      MoppyMessageConsumer *targetConsumer;
+    MoppyMessageConsumer *targetConsumer;
+    MoppyLinkStats stats;
+
+    // Parser state
+    uint8_t status = 0;     // Status of the message being read (kept between messages for running status)
+    uint8_t dataNeeded = 0; // Data bytes in a message with that status
+    uint8_t dataCount = 0;  // Data bytes read so far
+    uint8_t data[2];
+    bool skipping = false;  // Skipping data bytes without a status
+    uint8_t sysex[MIDI_SYSEX_MAX_LENGTH]; // SysEx message being read (after the F0)
+    uint8_t sysexLength = 0;
+
+    // Where notes go
+    uint8_t channelMap[16] = MIDI_CHANNEL_MAP;
+    uint8_t channelNote[16]; // Note playing on each mapped channel's sub-address
+    int16_t channelBend[16]; // Last bend on each channel (0 is centred)
+    MoppyVoices<MIDI_POOL_VOICES> voices{MIDI_STEAL_POLICY}; // Notes on pooled channels
+
+    void parse(uint8_t b);
+    void handleRealtime(uint8_t b);
+    void handleChannelMessage();
+    void endSysEx();
+    void noteOn(uint8_t channel, uint8_t note, uint8_t velocity);
+    void startNote(uint8_t subAddress, uint8_t channel, uint8_t payload[]);
+    void sendToVoice(uint8_t voice, uint8_t command, uint8_t payload[]);
+    void noteOff(uint8_t channel, uint8_t note);
+    void allNotesOff(uint8_t channel);
+    void bendPitch(uint8_t channel, uint8_t lsb, uint8_t msb);
+    void sendBend(uint8_t subAddress, int16_t bend);
+    void controlChange(uint8_t channel, uint8_t controller, uint8_t value);
+    void sendDeviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]);
+    void sendLinkStats(bool reset);
 };
 
 
-#endif /* SRC_MOPPYNETWORKS_MOPPYSERIAL_H_ */
+#endif /* SRC_MOPPYNETWORKS_MOPPYMIDI_H_ */
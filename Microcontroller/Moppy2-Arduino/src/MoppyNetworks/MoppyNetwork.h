@@ -6,6 +6,11 @@
 #ifndef SRC_MOPPYNETWORKS_MOPPYNETWORK_H_
 #define SRC_MOPPYNETWORKS_MOPPYNETWORK_H_
 
+// Encodings for messages from the Controller (replies are always standard)
+#define MOPPY_ENCODING_STANDARD 0x00 // A frame per message, as described in each network
+#define MOPPY_ENCODING_COMPACT 0x01  // See MoppyCompact.h
+#define MOPPY_ENCODING_COBS 0x02     // See MoppyCobs.h (MoppySerial only)
+
 // Definitions for command byte values
 
 #define START_BYTE 0x4d
@@ -13,6 +18,18 @@
 
 #define NETBYTE_SYS_PING 0x80
 #define NETBYTE_SYS_PONG 0x81
+#define NETBYTE_SYS_GETISRSTATS 0x82 // Optional payload: 0x01 to reset the statistics after sending them
+#define NETBYTE_SYS_ISRSTATS 0x83
+#define NETBYTE_SYS_SETBAUD 0x84 // Payload: proposed baud rate (4 bytes, big-endian)
+#define NETBYTE_SYS_BAUDACK 0x85 // Payload: baud rate the device is switching to (its current rate if the proposal was refused)
+#define NETBYTE_SYS_SETENCODING 0x86 // Payload: encoding for messages to the device from now on (one of the below)
+#define NETBYTE_SYS_ENCODINGACK 0x87 // Payload: encoding the device is now using
+#define NETBYTE_SYS_GETLINKSTATS 0x88 // Optional payload: 0x01 to reset the statistics after sending them
+#define NETBYTE_SYS_LINKSTATS 0x89
+#define NETBYTE_SYS_GETQUEUESTATS 0x8A // Optional payload: 0x01 to reset the statistics after sending them
+#define NETBYTE_SYS_QUEUESTATS 0x8B
+#define NETBYTE_SYS_SETFLOWCONTROL 0x8C // Payload: 0x01 to start sending NETBYTE_SYS_CREDIT, 0x00 to stop
+#define NETBYTE_SYS_CREDIT 0x8D // Payload: credit limit (2 bytes, big-endian), see MoppySerial.h
 #define NETBYTE_SYS_RESET 0xff
 #define NETBYTE_SYS_START 0xfa
 #define NETBYTE_SYS_STOP 0xfc
@@ -20,7 +37,14 @@
 #define NETBYTE_DEV_RESET 0x00
 #define NETBYTE_DEV_NOTEOFF 0x08
 #define NETBYTE_DEV_NOTEON 0x09
+#define NETBYTE_DEV_CONTROLCHANGE 0x0b // Payload: MIDI controller number, value
 #define NETBYTE_DEV_BENDPITCH 0x0e
+#define NETBYTE_DEV_BUNDLE 0x10 // Payload: device messages, each as (subAddress, size of command and payload, command, payload...)
+#define NETBYTE_DEV_POOLNOTEOFF 0x18 // Payload: note (to sub-address 0 with VOICE_POOL, see MoppyInstrument.h)
+#define NETBYTE_DEV_POOLNOTEON 0x19 // Payload: note, velocity (to sub-address 0 with VOICE_POOL)
+#define NETBYTE_DEV_GLIDE 0x20 // Payload: glide time in milliseconds (2 bytes, big-endian), see MoppyModulation.h
+#define NETBYTE_DEV_VIBRATO 0x21 // Payload: depth in cents, rate in tenths of a Hz
+#define NETBYTE_DEV_BENDRAMP 0x22 // Payload: deflection to bend to (2 bytes, as NETBYTE_DEV_BENDPITCH), time in milliseconds (2 bytes)
 
 // Microcontroller/device-specific commands (still defined here to prevent overlap)
 #define NETBYTE_DEV_SETTARGETCOLOR 0x61
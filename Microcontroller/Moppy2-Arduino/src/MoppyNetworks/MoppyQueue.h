@@ -0,0 +1,65 @@
+/*
+ * MoppyQueue.h
+ * Fixed-size queue of entries passed from a single producer to a single consumer, which can be
+ * running at the same time on different cores (e.g. the network task and loop() on the ESP32).
+ * Neither side ever blocks or takes a lock: each only writes its own index, and the index is
+ * published with release ordering after the entry it covers has been written (or read).
+ *
+ * Entries are filled and read in place: the producer gets a free one from reserve() and hands it
+ * over with commit(), and the consumer gets the oldest one from front() and gives it back with
+ * pop().
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYQUEUE_H_
+#define SRC_MOPPYNETWORKS_MOPPYQUEUE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <typename T, uint16_t SIZE>
+class MoppyQueue {
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "Queue size must be a power of two");
+
+public:
+    // Producer side.  Returns NULL if the queue is full.
+    T *reserve() {
+        uint16_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        if (((h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) & INDEX_MASK) == SIZE) {
+            return NULL;
+        }
+        return &entries[h & MASK];
+    }
+
+    void commit() {
+        __atomic_store_n(&head, (uint16_t)((head + 1) & INDEX_MASK), __ATOMIC_RELEASE);
+    }
+
+    // Consumer side.  Returns NULL if the queue is empty.
+    T *front() {
+        uint16_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        if (t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        return &entries[t & MASK];
+    }
+
+    void pop() {
+        __atomic_store_n(&tail, (uint16_t)((tail + 1) & INDEX_MASK), __ATOMIC_RELEASE);
+    }
+
+    // Number of entries waiting (from either side, although it may be out of date by the time
+    // it's used)
+    uint16_t depth() const {
+        return (__atomic_load_n(&head, __ATOMIC_ACQUIRE) - __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) & INDEX_MASK;
+    }
+
+private:
+    static const uint16_t MASK = SIZE - 1;
+    // Indexes run to twice the size so that a full queue can be told apart from an empty one
+    static const uint16_t INDEX_MASK = (SIZE * 2) - 1;
+    T entries[SIZE];
+    uint16_t head = 0; // Only written by the producer
+    uint16_t tail = 0; // Only written by the consumer
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYQUEUE_H_ */
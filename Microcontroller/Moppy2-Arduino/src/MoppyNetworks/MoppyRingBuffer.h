@@ -0,0 +1,75 @@
+/*
+ * MoppyRingBuffer.h
+ * Byte ring for received network data, filled by a single producer (usually the receive
+ * interrupt) and emptied by a single consumer (the parser, from loop()).
+ *
+ * The first MIRROR bytes of the ring are also written just past its end, so a run of up to
+ * MIRROR + 1 bytes starting anywhere in the ring can be read in one piece through view(), even
+ * when it wraps around.  The parser hands message payloads to the instrument straight out of the
+ * ring this way instead of copying them into a separate message buffer.
+ */
+
+#ifndef SRC_MOPPYNETWORKS_MOPPYRINGBUFFER_H_
+#define SRC_MOPPYNETWORKS_MOPPYRINGBUFFER_H_
+
+#include <stdint.h>
+#include "../MoppyInstruments/MoppyTimer.h"
+
+template <uint16_t SIZE, uint16_t MIRROR>
+class MoppyRingBuffer {
+    static_assert(SIZE >= 2 && (SIZE & (SIZE - 1)) == 0, "Ring size must be a power of two");
+    static_assert(MIRROR < SIZE, "Mirror must be smaller than the ring");
+
+public:
+    // Producer side.  When the ring is full the byte is dropped and counted in overflows.
+    inline void push(uint8_t b) {
+        uint16_t next = (head + 1) & MASK;
+        if (next == tail) {
+            overflows++;
+            return;
+        }
+        buffer[head] = b;
+        if (head < MIRROR) {
+            buffer[SIZE + head] = b;
+        }
+        head = next;
+    }
+
+    // Consumer side.  Nothing written after a byte is pushed is touched until it's been skipped,
+    // so a view() stays valid (and unchanged) until then.
+    uint16_t available() const {
+        MoppyCriticalSection critical;
+        return (head - tail) & MASK;
+    }
+
+    uint16_t space() const {
+        return (SIZE - 1) - available();
+    }
+
+    uint8_t read() {
+        uint8_t b = buffer[tail];
+        skip(1);
+        return b;
+    }
+
+    uint8_t *view() {
+        return &buffer[tail];
+    }
+
+    void skip(uint16_t count) {
+        consumed += count;
+        MoppyCriticalSection critical;
+        tail = (tail + count) & MASK;
+    }
+
+    volatile uint16_t overflows = 0; // Bytes dropped because the ring was full
+    uint16_t consumed = 0;           // Bytes read or skipped so far (wrapping around)
+
+private:
+    static const uint16_t MASK = SIZE - 1;
+    uint8_t buffer[SIZE + MIRROR];
+    volatile uint16_t head = 0; // Only written by the producer
+    volatile uint16_t tail = 0; // Only written by the consumer
+};
+
+#endif /* SRC_MOPPYNETWORKS_MOPPYRINGBUFFER_H_ */
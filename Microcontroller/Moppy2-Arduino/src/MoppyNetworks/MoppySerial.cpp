@@ -4,12 +4,123 @@
  * Serial communications implementation for Arduino.  Instrument
  * has its handler functions called for device and system messages
  */
+#ifdef NETWORK_SERIAL
+
+static_assert(MOPPY_SERIAL_BUFFER_SIZE > MAX_MESSAGE_BODY, "MOPPY_SERIAL_BUFFER_SIZE must be able to hold the longest message body");
+
+static MoppyRingBuffer<MOPPY_SERIAL_BUFFER_SIZE, MAX_MESSAGE_BODY> rxBuffer;
+
+#ifdef SERIAL_RX_ISR
+// Parity errors are dropped (like HardwareSerial does), everything else goes straight in the ring
+ISR(USART_RX_vect) {
+    if (UCSR0A & _BV(UPE0)) {
+        (void)UDR0;
+        return;
+    }
+    rxBuffer.push(UDR0);
+}
+#endif
+
 MoppySerial::MoppySerial(MoppyMessageConsumer *messageConsumer) {
     targetConsumer = messageConsumer;
 }
 
 void MoppySerial::begin() {
-    Serial.begin(MOPPY_BAUD_RATE);
+#ifdef SERIAL_RX_ISR
+    setBaudRate(baudRate);
+#else
+#if defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
+    Serial.setRxBufferSize(MOPPY_SERIAL_BUFFER_SIZE); // Enough to hold everything flow control allows
+#endif
+    Serial.begin(baudRate);
+#endif
+}
+
+#ifdef SERIAL_RX_ISR
+/*
+ * Picks the USART setup the same way HardwareSerial does: double speed (U2X0), except at 57600 on
+ * a 16MHz board (where the Uno's 16U2 runs at the 58824 that normal speed gives) or when the
+ * divider would be too big for UBRR0.
+ */
+static bool useDoubleSpeed(unsigned long rate) {
+#if F_CPU == 16000000UL
+    if (rate == 57600) {
+        return false;
+    }
+#endif
+    return (F_CPU / 4 / rate - 1) / 2 <= 4095;
+}
+
+static uint16_t baudSetting(unsigned long rate, bool doubleSpeed) {
+    return doubleSpeed ? (F_CPU / 4 / rate - 1) / 2 : (F_CPU / 8 / rate - 1) / 2;
+}
+#endif
+
+// Actual rate the UART runs at when set to the given rate
+static unsigned long achievableBaudRate(unsigned long rate) {
+#ifdef SERIAL_RX_ISR
+    // Same as setBaudRate() below
+    if (rate > F_CPU / 8) {
+        return 0;
+    }
+    bool doubleSpeed = useDoubleSpeed(rate);
+    return F_CPU / (doubleSpeed ? 8 : 16) / (baudSetting(rate, doubleSpeed) + 1UL);
+#elif defined(ARDUINO_ARCH_ESP8266) || defined(ARDUINO_ARCH_ESP32)
+    // Both divide down an 80MHz UART clock (the ESP32 can do fractions, but not the ESP8266)
+    return 80000000UL / (80000000UL / rate);
+#else
+    return rate;
+#endif
+}
+
+void MoppySerial::setBaudRate(unsigned long rate) {
+    baudRate = rate;
+#ifdef SERIAL_RX_ISR
+    // Same setup HardwareSerial uses, 8N1
+    bool doubleSpeed = useDoubleSpeed(rate);
+    UCSR0A = doubleSpeed ? _BV(U2X0) : 0;
+    UBRR0 = baudSetting(rate, doubleSpeed);
+    UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+#else
+    Serial.updateBaudRate(rate);
+#endif
+}
+
+/*
+ * Handles a NETBYTE_SYS_SETBAUD.  Whatever rate is being switched to is acknowledged (at the
+ * current rate) before switching, so the Controller knows when to switch too.
+ */
+void MoppySerial::changeBaudRate(unsigned long rate) {
+    unsigned long actual = rate > 0 && rate <= MOPPY_MAX_BAUD_RATE ? achievableBaudRate(rate) : 0;
+    unsigned long error = actual > rate ? actual - rate : rate - actual;
+    // The default rate is always fine, since it's what the device starts at anyway (and on an Uno
+    // it's 2% off at both ends of the link)
+    if (actual == 0 || (error * 1000 / rate > MOPPY_MAX_BAUD_ERROR && rate != MOPPY_BAUD_RATE)) {
+        rate = baudRate; // Can't do that, stay where we are
+    }
+
+    uint8_t payload[4] = {(uint8_t)(rate >> 24), (uint8_t)(rate >> 16), (uint8_t)(rate >> 8), (uint8_t)rate};
+#ifdef SERIAL_RX_ISR
+    UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0); // Clear the transmit complete flag so it shows when the acknowledgement is out
+#endif
+    sendSystemMessage(NETBYTE_SYS_BAUDACK, payload, sizeof(payload));
+    if (rate == baudRate) {
+        return;
+    }
+
+    // Finish sending the acknowledgement before switching
+#ifdef SERIAL_RX_ISR
+    while (!(UCSR0A & _BV(TXC0))) {
+    }
+#else
+    Serial.flush();
+#endif
+    if (fallbackBaudRate == 0) {
+        fallbackBaudRate = baudRate; // Otherwise keep going back to the last rate that was confirmed
+    }
+    setBaudRate(rate);
+    baudChangeTime = millis();
 }
 
 /* MoppyMessages contain the following bytes:
@@ -22,30 +133,100 @@ void MoppySerial::begin() {
  */
 
 void MoppySerial::readMessages() {
+    stats.checked();
+
+    // A new baud rate that nothing valid has been received at is given up on after a while
+    if (fallbackBaudRate != 0 && millis() - baudChangeTime > MOPPY_BAUD_TIMEOUT) {
+        setBaudRate(fallbackBaudRate);
+        fallbackBaudRate = 0;
+        messagePos = 0; // Anything half-read was probably noise
+    }
+
+#ifndef SERIAL_RX_ISR
+    // Move whatever the core has received into the ring.  Anything that doesn't fit yet is left
+    // in the core's buffer for next time.
+    for (uint16_t space = rxBuffer.space(); space > 0 && Serial.available(); space--) {
+        rxBuffer.push(Serial.read());
+    }
+#endif
+
+    // Only what's already arrived is parsed, anything received meanwhile waits for the next call
+    uint16_t available = rxBuffer.available();
+    while (available > 0) {
+        if (creditStarting) {
+            break; // Counting starts from the next byte
+        }
 
-    // If we're waiting for position 4, then we know how many bytes we're waiting for, no need
-    // to start reading until they're all there.
-    // TODO: This will break for large messages because the Arduino buffer size is only 64 bytes.
-    // This should be optimized a bit.
-    while ((messagePos != 4 && Serial.available()) || (messagePos == 4 && Serial.available() >= messageBuffer[3])) {
+        if (encoding == MOPPY_ENCODING_COBS) {
+            // Frames are decoded in place as they arrive, and the ring's mirror keeps them in one piece
+            uint8_t *frame = rxBuffer.view();
+            uint16_t used = cobsDecoder.decode(frame, available < MOPPY_COBS_MAX_FRAME ? available : MOPPY_COBS_MAX_FRAME);
+            if (used == 0) {
+                break; // Wait for the rest of the frame
+            }
+            if (cobsDecoder.bodyLength > 0) {
+                handleFrame(frame, cobsDecoder.bodyLength);
+            }
+            rxBuffer.skip(used);
+            available -= used;
+            continue;
+        }
+
+        if (encoding == MOPPY_ENCODING_COMPACT) {
+            // Decode events right where they are in the ring too (enough of it is mirrored to
+            // always have a whole event in one piece)
+            MoppyCompactMessage message;
+            uint16_t used = compactDecoder.decode(rxBuffer.view(), available < MOPPY_COMPACT_MAX_EVENT ? available : MOPPY_COMPACT_MAX_EVENT, message);
+            if (used == 0) {
+                break; // Wait for the rest of the event
+            }
+            if (message.valid) {
+                handleMessage(message.address, message.subAddress, message.command, message.payload, message.payloadLength);
+            }
+            rxBuffer.skip(used);
+            available -= used;
+            continue;
+        }
+
+        if (messagePos == 4) {
+            // Wait for the whole body, then use it right where it is in the ring
+            if (available < messageHeader[3]) {
+                break;
+            }
+            uint8_t *body = rxBuffer.view();
+            handleMessage(messageHeader[1], messageHeader[2], body[0], &body[1], messageHeader[3] - 1);
+            rxBuffer.skip(messageHeader[3]);
+            available -= messageHeader[3];
+            messagePos = 0; // Start looking for a new message
+            continue;
+        }
+
+        uint8_t b = rxBuffer.read();
+        available--;
 
         switch (messagePos) {
         case 0:
-            if (Serial.read() == START_BYTE) {
+            if (b == START_BYTE) {
                 messagePos = 1;
+                hunting = false;
+            } else if (!hunting) {
+                stats.resyncs++; // Not the start of a message where one was expected
+                hunting = true;
             }
             break;
         case 1:
-            messageBuffer[1] = Serial.read(); // Read device address
+            messageHeader[1] = b; // Read device address
 
-            if (messageBuffer[1] == SYSTEM_ADDRESS) {
+            if (messageHeader[1] == SYSTEM_ADDRESS) {
                 messagePos = 2; // System messages are for everyone, move to subAddress
                 break;
             }
 
             // For Serial communications it's extremely unlikely that we'll be receiving messages not meant
             // for us, but this can help squash noise from being treated as a message
-            if (messageBuffer[1] != DEVICE_ADDRESS) {
+            if (messageHeader[1] != DEVICE_ADDRESS) {
+                stats.wrongAddress++;
+                hunting = true;
                 messagePos = 0; // This message isn't for us
                 break;
             }
@@ -53,39 +234,186 @@ void MoppySerial::readMessages() {
             messagePos = 2; // Get subAddress next
             break;
         case 2:
-            messageBuffer[2] = Serial.read(); // Read sub address
+            messageHeader[2] = b; // Read sub address
 
-            if (messageBuffer[2] == 0x00 || (messageBuffer[2] >= MIN_SUB_ADDRESS && messageBuffer[2] <= MAX_SUB_ADDRESS)) {
+            if (messageHeader[2] == 0x00 || (messageHeader[2] >= MIN_SUB_ADDRESS && messageHeader[2] <= MAX_SUB_ADDRESS)) {
                 messagePos++; // Valid subAddress, continue
                 break;
             }
 
+            stats.wrongAddress++;
+            hunting = true;
             messagePos = 0; // Not listening to this subAddress, skip this message
             break;
         case 3:
-            messageBuffer[3] = Serial.read(); // Read message body size
-            messagePos++;
+            messageHeader[3] = b; // Read message body size
+            messagePos = b > 0 ? 4 : 0; // A message without even a command byte is just ignored
+            if (b == 0) {
+                stats.badLength++;
+            }
             break;
-        case 4:
-            // Read command and payload
-            Serial.readBytes(messageBuffer + 4, messageBuffer[3]);
-
-            // Call appropriate handler
-            if (messageBuffer[1] == SYSTEM_ADDRESS) {
-                if (messageBuffer[4] == NETBYTE_SYS_PING) {
-                    sendPong(); // Respond with pong if requested
-                } else {
-                    targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
-                }
-            } else {
-                targetConsumer->handleDeviceMessage(messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
+        }
+    }
+
+    countBytes();
+
+    if (creditStarting) {
+        creditStarting = false;
+        creditBase = rxBuffer.consumed;
+        sendCredit();
+    } else if (creditEnabled && ((uint16_t)(rxBuffer.consumed - creditAdvertised) >= MOPPY_CREDIT_STEP || millis() - creditTime >= MOPPY_CREDIT_INTERVAL)) {
+        sendCredit();
+    }
+}
+
+// Checks the address of a decoded MOPPY_ENCODING_COBS frame (address, subAddress, command, payload)
+void MoppySerial::handleFrame(uint8_t body[], uint8_t length) {
+    if (length < 3) {
+        stats.badLength++;
+        return;
+    }
+    if (body[0] == SYSTEM_ADDRESS) {
+        handleMessage(body[0], body[1], body[2], &body[3], length - 3);
+    } else if (body[0] == DEVICE_ADDRESS && (body[1] == 0x00 || (body[1] >= MIN_SUB_ADDRESS && body[1] <= MAX_SUB_ADDRESS))) {
+        handleMessage(body[0], body[1], body[2], &body[3], length - 3);
+    } else {
+        stats.wrongAddress++;
+    }
+}
+
+// Calls the appropriate handler for a complete message.  payload points into the receive ring
+// (or the compact decoder), and is only valid until this returns.
+void MoppySerial::handleMessage(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength) {
+    stats.handled(address, command);
+    fallbackBaudRate = 0; // A whole message got through, so the current baud rate works
+
+    if (address == SYSTEM_ADDRESS) {
+        if (command == NETBYTE_SYS_PING) {
+            sendPong(payloadLength > 0 && payload[0] >= MOPPY_CAPABILITIES_VERSION); // Respond with pong if requested
+        } else if (command == NETBYTE_SYS_SETBAUD) {
+            if (payloadLength >= 4) {
+                changeBaudRate((unsigned long)payload[0] << 24 | (unsigned long)payload[1] << 16 | (unsigned long)payload[2] << 8 | payload[3]);
+            }
+        } else if (command == NETBYTE_SYS_SETENCODING) {
+            if (payloadLength >= 1) {
+                changeEncoding(payload[0]);
             }
+        } else if (command == NETBYTE_SYS_SETFLOWCONTROL) {
+            if (payloadLength >= 1) {
+                creditEnabled = payload[0] == 0x01;
+                creditStarting = creditEnabled;
+            }
+        } else if (command == NETBYTE_SYS_GETLINKSTATS) {
+            sendLinkStats(payloadLength > 0 && payload[0] == 0x01);
+#ifdef ISR_STATS
+        } else if (command == NETBYTE_SYS_GETISRSTATS) {
+            sendIsrStats(payloadLength > 0 && payload[0] == 0x01);
+#endif
+        } else {
+            targetConsumer->handleSystemMessage(command, payload);
+        }
+    } else if (command == NETBYTE_DEV_BUNDLE) {
+        targetConsumer->handleDeviceBundle(payload, payloadLength);
+    } else {
+        targetConsumer->handleDeviceMessage(subAddress, command, payload);
+    }
+}
 
-            messagePos = 0; // Start looking for a new message
+// Handles a NETBYTE_SYS_SETENCODING, acknowledging with whichever encoding is used from now on
+void MoppySerial::changeEncoding(uint8_t requested) {
+    if (requested == MOPPY_ENCODING_STANDARD || requested == MOPPY_ENCODING_COMPACT || requested == MOPPY_ENCODING_COBS) {
+        encoding = requested;
+        messagePos = 0;
+        compactDecoder.reset();
+        cobsDecoder.reset();
+    }
+    sendSystemMessage(NETBYTE_SYS_ENCODINGACK, &encoding, 1);
+}
+
+void MoppySerial::writeBytes(const uint8_t bytes[], uint8_t length) {
+#ifdef SERIAL_RX_ISR
+    // Replies are few and short, so they're just sent one byte at a time as the USART is ready
+    for (uint8_t i = 0; i < length; i++) {
+        while (!(UCSR0A & _BV(UDRE0))) {
         }
+        UDR0 = bytes[i];
+    }
+#else
+    Serial.write(bytes, length);
+#endif
+}
+
+void MoppySerial::sendPong(bool extended) {
+    if (!extended) {
+        writeBytes(pongBytes, sizeof(pongBytes));
+        return;
+    }
+
+    MoppyCapabilities capabilities;
+    targetConsumer->describe(capabilities);
+    capabilities.maxBaudRate = MOPPY_MAX_BAUD_RATE;
+    capabilities.bufferSize = MOPPY_SERIAL_BUFFER_SIZE - 1;
+    capabilities.features |= MOPPY_FEATURE_BUNDLE | MOPPY_FEATURE_ENCODING_COMPACT | MOPPY_FEATURE_ENCODING_COBS |
+                             MOPPY_FEATURE_SETBAUD | MOPPY_FEATURE_FLOW_CONTROL | MOPPY_FEATURE_LINK_STATS;
+#ifdef ISR_STATS
+    capabilities.features |= MOPPY_FEATURE_ISR_STATS;
+#endif
+    uint8_t payload[3 + MOPPY_CAPABILITIES_LENGTH] = {DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
+    sendSystemMessage(NETBYTE_SYS_PONG, payload, 3 + capabilities.write(&payload[3]));
+}
+
+// Sends a system message (from this device) back to the Controller
+void MoppySerial::sendSystemMessage(uint8_t command, const uint8_t payload[], uint8_t payloadLength) {
+    uint8_t header[5] = {START_BYTE, SYSTEM_ADDRESS, 0x00, (uint8_t)(payloadLength + 1), command};
+    writeBytes(header, sizeof(header));
+    writeBytes(payload, payloadLength);
+}
+
+void MoppySerial::sendCredit() {
+    uint16_t limit = rxBuffer.consumed - creditBase + (MOPPY_SERIAL_BUFFER_SIZE - 1);
+    uint8_t payload[2] = {(uint8_t)(limit >> 8), (uint8_t)limit};
+    sendSystemMessage(NETBYTE_SYS_CREDIT, payload, sizeof(payload));
+    creditAdvertised = rxBuffer.consumed;
+    creditTime = millis();
+}
+
+// Adds everything the parser's been through since last time to the byte count
+void MoppySerial::countBytes() {
+    stats.bytes += (uint16_t)(rxBuffer.consumed - statsConsumed);
+    statsConsumed = rxBuffer.consumed;
+}
+
+void MoppySerial::sendLinkStats(bool reset) {
+    countBytes();
+    {
+        MoppyCriticalSection critical; // The receive interrupt counts overflows
+        stats.overruns = rxBuffer.overflows;
+        if (reset) {
+            rxBuffer.overflows = 0;
+        }
+    }
+    stats.encoding = encoding;
+    stats.crcErrors = cobsDecoder.crcErrors;
+    stats.framingErrors = cobsDecoder.framingErrors;
+    uint8_t payload[LINK_STATS_PAYLOAD_LENGTH];
+    uint8_t length = stats.write(payload);
+    if (reset) {
+        stats.reset();
+        cobsDecoder.crcErrors = 0;
+        cobsDecoder.framingErrors = 0;
+    }
+    sendSystemMessage(NETBYTE_SYS_LINKSTATS, payload, length);
+}
+
+#ifdef ISR_STATS
+void MoppySerial::sendIsrStats(bool reset) {
+    uint8_t payload[ISR_STATS_PAYLOAD_LENGTH];
+    uint8_t length = MoppyIsrStats::write(payload);
+    if (reset) {
+        MoppyIsrStats::reset();
     }
+    sendSystemMessage(NETBYTE_SYS_ISRSTATS, payload, length);
 }
+#endif
 
-void MoppySerial::sendPong() {
-    Serial.write(pongBytes, sizeof(pongBytes));
-}
\ No newline at end of file
+#endif /* NETWORK_SERIAL */
@@ -11,9 +11,65 @@
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
 #include "MoppyNetwork.h"
+#include "../MoppyInstruments/MoppyIsrStats.h"
+#include "MoppyCobs.h"
+#include "MoppyCompact.h"
+#include "MoppyLinkStats.h"
+#include "MoppyRingBuffer.h"
 
 #define MOPPY_BAUD_RATE 57600
 
+/*
+ * The Controller can ask for a faster rate with NETBYTE_SYS_SETBAUD.  Rates up to
+ * MOPPY_MAX_BAUD_RATE are accepted as long as the UART can generate them to within
+ * MOPPY_MAX_BAUD_ERROR (in tenths of a percent), which on a 16MHz AVR means 250000, 500000,
+ * 1000000, or 2000000.  The device acknowledges at the old rate and then switches, and if no
+ * valid message arrives within MOPPY_BAUD_TIMEOUT milliseconds of switching it goes back to the
+ * old rate (e.g. because the Controller never saw the acknowledgement).
+ */
+#define MOPPY_MAX_BAUD_RATE 2000000UL
+#define MOPPY_MAX_BAUD_ERROR 20
+#define MOPPY_BAUD_TIMEOUT 1000
+
+// Received bytes wait here until the parser gets to them (see MoppyConfig.h)
+#ifndef MOPPY_SERIAL_BUFFER_SIZE
+#ifdef ARDUINO_ARCH_AVR
+#define MOPPY_SERIAL_BUFFER_SIZE 256
+#else
+#define MOPPY_SERIAL_BUFFER_SIZE 1024
+#endif
+#endif
+
+// Longest message body (command and payload) there can be, which the ring mirrors enough of to
+// always be able to hand it over in one piece
+#define MAX_MESSAGE_BODY 255
+static_assert(MOPPY_COMPACT_MAX_EVENT <= MAX_MESSAGE_BODY + 1, "Compact events must fit in the ring's mirror");
+static_assert(MOPPY_COMPACT_MAX_EVENT <= MOPPY_SERIAL_BUFFER_SIZE - 1, "Compact events must fit in the ring");
+static_assert(MOPPY_COBS_MAX_FRAME <= MAX_MESSAGE_BODY + 1, "COBS frames must fit in the ring's mirror");
+static_assert(MOPPY_COBS_MAX_FRAME <= MOPPY_SERIAL_BUFFER_SIZE - 1, "COBS frames must fit in the ring");
+
+/*
+ * Credit-based flow control, which the Controller can turn on with NETBYTE_SYS_SETFLOWCONTROL so
+ * it can send as fast as the link allows without overflowing the receive buffer.  The device
+ * then sends a NETBYTE_SYS_CREDIT every MOPPY_CREDIT_INTERVAL milliseconds, and sooner whenever
+ * it's made room for another MOPPY_CREDIT_STEP bytes.  Its payload is the credit limit: the
+ * number of bytes (counting from the one after the NETBYTE_SYS_SETFLOWCONTROL, and wrapping
+ * around at 65536) that the Controller may have sent in total.  Since it's a running total rather
+ * than the free space right now, bytes still on their way and lost credit messages don't matter:
+ * the Controller just never sends past the last limit it received.
+ */
+#define MOPPY_CREDIT_INTERVAL 100
+#define MOPPY_CREDIT_STEP (MOPPY_SERIAL_BUFFER_SIZE / 4)
+
+/*
+ * On AVR boards the USART's receive interrupt feeds the ring directly, in place of Arduino's
+ * HardwareSerial (which must then not be used anywhere else).  Everywhere else the core's own
+ * interrupt-driven Serial buffer is emptied into the ring each time messages are read.
+ */
+#if defined(ARDUINO_ARCH_AVR) && defined(USART_RX_vect)
+#define SERIAL_RX_ISR
+#endif
+
 class MoppySerial {
   public:
       MoppySerial(MoppyMessageConsumer *messageConsumer);
@@ -22,9 +78,36 @@ class MoppySerial {
   private:
     MoppyMessageConsumer *targetConsumer;
     uint8_t messagePos = 0; // Track current message read position
-    uint8_t messageBuffer[259]; // Max message length for Moppy messages is 259
+    uint8_t messageHeader[4]; // The message body is read straight out of the receive ring
+    uint8_t encoding = MOPPY_ENCODING_STANDARD;
+    MoppyCompactDecoder compactDecoder;
+    MoppyCobsDecoder cobsDecoder;
+    MoppyLinkStats stats;
+    uint16_t statsConsumed = 0; // rxBuffer.consumed when bytes were last counted
+    bool hunting = false;       // Skipping bytes to find a START_BYTE
+    unsigned long baudRate = MOPPY_BAUD_RATE;
+    unsigned long fallbackBaudRate = 0; // Rate to go back to if the current one isn't confirmed in time (0 if confirmed)
+    unsigned long baudChangeTime;
+    bool creditEnabled = false;
+    bool creditStarting = false; // Start counting once the NETBYTE_SYS_SETFLOWCONTROL's been skipped
+    uint16_t creditBase;         // rxBuffer.consumed when counting started
+    uint16_t creditAdvertised;   // rxBuffer.consumed when the last NETBYTE_SYS_CREDIT was sent
+    unsigned long creditTime;
     uint8_t pongBytes[8] = {START_BYTE, 0x00, 0x00, 0x04, 0x81, DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
-    void sendPong();
+    void handleMessage(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength);
+    void changeEncoding(uint8_t requested);
+    void handleFrame(uint8_t body[], uint8_t length);
+    void writeBytes(const uint8_t bytes[], uint8_t length);
+    void setBaudRate(unsigned long rate);
+    void changeBaudRate(unsigned long rate);
+    void sendPong(bool extended);
+    void sendSystemMessage(uint8_t command, const uint8_t payload[], uint8_t payloadLength);
+    void countBytes();
+    void sendLinkStats(bool reset);
+    void sendCredit();
+#ifdef ISR_STATS
+    void sendIsrStats(bool reset);
+#endif
 };
 
 
@@ -16,6 +16,16 @@ MoppyUDP::MoppyUDP(MoppyMessageConsumer *messageConsumer) {
 void MoppyUDP::begin() {
     Serial.begin(115200); // For debugging
 
+    targetConsumer->describe(capabilities);
+    capabilities.bufferSize = MOPPY_MAX_PACKET_LENGTH;
+    capabilities.features |= MOPPY_FEATURE_BUNDLE | MOPPY_FEATURE_ENCODING_COMPACT | MOPPY_FEATURE_LINK_STATS;
+#ifdef MOPPY_UDP_TASK
+    capabilities.features |= MOPPY_FEATURE_QUEUE_STATS;
+#endif
+#ifdef ISR_STATS
+    capabilities.features |= MOPPY_FEATURE_ISR_STATS;
+#endif
+
     // Setup and connect to WiFi
     AsyncWebServer server(80);
     DNSServer dns;
@@ -23,6 +33,9 @@ void MoppyUDP::begin() {
     wifiManager.autoConnect("FloppyDrives", "m0ppydrives");
     startOTA();
     startUDP();
+#ifdef MOPPY_UDP_TASK
+    xTaskCreatePinnedToCore(networkTask, "MoppyUDP", MOPPY_UDP_TASK_STACK, this, MOPPY_UDP_TASK_PRIORITY, NULL, MOPPY_UDP_TASK_CORE);
+#endif
 }
 
 // connect to UDP – returns true if successful or false if not
@@ -85,32 +98,63 @@ void MoppyUDP::startOTA() {
 }
 
 void MoppyUDP::readMessages() {
+#ifdef MOPPY_UDP_TASK
+    // Everything's received by networkTask(), so just pass on what it's queued up (stats belongs
+    // to the task too, so it isn't touched here)
+    dispatchQueued();
+#else
+    stats.checked();
+
     // Handle OTA
     ArduinoOTA.handle();
 
-    // Handle UDP packets
-    int packetSize = UDP.parsePacket();
-    if (packetSize) {
+    receivePackets();
+#endif
+}
+
+void MoppyUDP::receivePackets() {
+    // Handle every UDP packet that's waiting (parsePacket() drops whatever's left of the last
+    // one), but leave the rest for next time if it's taking too long
+    unsigned long start = micros();
+    int packetSize;
+    while ((packetSize = UDP.parsePacket()) > 0) {
         // Serial.println("");
         // Serial.print("Received packet of size ");
         // Serial.println(packetSize);
-        // Serial.print("From ");
-        // IPAddress remote = UDP.remoteIP();
-        // for (int i = 0; i < 4; i++) {
-        //     Serial.print(remote[i], DEC);
-        //     if (i < 3) {
-        //         Serial.print(".");
-        //     }
-        // }
-        // Serial.print(", port ");
-        // Serial.println(UDP.remotePort());
+
+        stats.bytes += packetSize;
+        if (packetSize > MOPPY_MAX_PACKET_LENGTH) {
+            stats.overruns++; // Whatever doesn't fit is dropped
+        }
 
         // read the packet into messageBuffer
-        int messageLength = UDP.read(messageBuffer, MOPPY_MAX_PACKET_LENGTH);
+        int packetLength = UDP.read(messageBuffer, MOPPY_MAX_PACKET_LENGTH);
+#ifdef MOPPY_UDP_TASK
+        packetTime = micros();
+#endif
         // Parse
-        parseMessage(messageBuffer, messageLength);
+        parsePacket(messageBuffer, packetLength);
+
+        if (micros() - start >= MOPPY_UDP_DRAIN_MICROS) {
+            break;
+        }
+    }
+}
 
-        UDP.flush(); // Just incase we got a really long packet
+// Handles each message in a packet in turn.  A SETENCODING part way through applies to the rest
+// of the packet.
+void MoppyUDP::parsePacket(uint8_t packet[], int length) {
+    // Compact events start over from scratch with each datagram (so that losing one doesn't
+    // affect the next)
+    compactDecoder.reset();
+    int pos = 0;
+    while (pos < length) {
+        int used = encoding == MOPPY_ENCODING_COMPACT ? parseEvent(&packet[pos], length - pos)
+                                                      : parseMessage(&packet[pos], length - pos);
+        if (used == 0) {
+            return; // The rest of the packet doesn't make sense
+        }
+        pos += used;
     }
 }
 
@@ -121,27 +165,205 @@ void MoppyUDP::readMessages() {
  *  3    - Size of message body (number of bytes following this one)
  *  4    - Command byte
  *  5... - Optional payload
+ *
+ * Returns the length of the message, or 0 if there isn't a whole one
  */
-void MoppyUDP::parseMessage(uint8_t message[], int length) {
-    if (length < 5 || message[0] != START_BYTE || length != (4 + message[3])) {
-        return; // Message is too short, not a Moppy Message, or wrongly sized
+int MoppyUDP::parseMessage(uint8_t message[], int length) {
+    if (length < 5 || message[0] != START_BYTE || message[3] == 0 || length < (4 + message[3])) {
+        stats.badLength++;
+        return 0; // Message is too short, not a Moppy Message, or cut off
     }
 
     // Only worry about this if it's addressed to us
-    if (message[1] == SYSTEM_ADDRESS) {
-        if (messageBuffer[4] == NETBYTE_SYS_PING) {
-            sendPong(); // Respond with pong if requested
+    if (message[1] == SYSTEM_ADDRESS || message[1] == DEVICE_ADDRESS) {
+        handleMessage(message[1], message[2], message[4], &message[5], message[3] - 1);
+    } else {
+        stats.wrongAddress++;
+    }
+    return 4 + message[3];
+}
+
+// Decodes a MOPPY_ENCODING_COMPACT event, returning its length or 0 if it's cut off
+int MoppyUDP::parseEvent(uint8_t data[], int length) {
+    MoppyCompactMessage event;
+    uint16_t used = compactDecoder.decode(data, length, event);
+    if (event.valid) {
+        handleMessage(event.address, event.subAddress, event.command, event.payload, event.payloadLength);
+    }
+    return used;
+}
+
+void MoppyUDP::handleMessage(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength) {
+    stats.handled(address, command);
+    if (address == SYSTEM_ADDRESS) {
+        if (command == NETBYTE_SYS_PING) {
+            sendPong(payloadLength > 0 && payload[0] >= MOPPY_CAPABILITIES_VERSION); // Respond with pong if requested
+        } else if (command == NETBYTE_SYS_SETENCODING) {
+            if (payloadLength >= 1) {
+                changeEncoding(payload[0]);
+            }
+        } else if (command == NETBYTE_SYS_GETLINKSTATS) {
+            sendLinkStats(payloadLength > 0 && payload[0] == 0x01);
+#ifdef ISR_STATS
+        } else if (command == NETBYTE_SYS_GETISRSTATS) {
+            sendIsrStats(payloadLength > 0 && payload[0] == 0x01);
+#endif
+#ifdef MOPPY_UDP_TASK
+        } else if (command == NETBYTE_SYS_GETQUEUESTATS) {
+            sendQueueStats(payloadLength > 0 && payload[0] == 0x01);
+#endif
         } else {
-            targetConsumer->handleSystemMessage(messageBuffer[4], &messageBuffer[5]);
+            deliver(address, subAddress, command, payload, payloadLength);
         }
-    } else if (message[1] == DEVICE_ADDRESS) {
-        targetConsumer->handleDeviceMessage(messageBuffer[2], messageBuffer[4], &messageBuffer[5]);
+    } else {
+        deliver(address, subAddress, command, payload, payloadLength);
+    }
+}
+
+// Passes a message on to the instrument, through the queue if there's a network task
+void MoppyUDP::deliver(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength) {
+#ifdef MOPPY_UDP_TASK
+    MoppyQueuedMessage *queued = queue.reserve();
+    if (queued == NULL) {
+        drops++;
+        return;
+    }
+    queued->received = packetTime;
+    queued->address = address;
+    queued->subAddress = subAddress;
+    queued->command = command;
+    queued->payloadLength = payloadLength;
+    memcpy(queued->payload, payload, payloadLength);
+    queue.commit();
+
+    uint16_t depth = queue.depth();
+    if (depth > maxDepth) {
+        maxDepth = depth;
+    }
+#else
+    consume(address, subAddress, command, payload, payloadLength);
+#endif
+}
+
+void MoppyUDP::consume(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength) {
+    if (address == SYSTEM_ADDRESS) {
+        targetConsumer->handleSystemMessage(command, payload);
+    } else if (command == NETBYTE_DEV_BUNDLE) {
+        targetConsumer->handleDeviceBundle(payload, payloadLength);
+    } else {
+        targetConsumer->handleDeviceMessage(subAddress, command, payload);
     }
 }
 
-void MoppyUDP::sendPong() {
-    UDP.beginPacket(IPAddress(239, 2, 2, 7), 30994);
-    UDP.write(pongBytes, sizeof(pongBytes));
+// Handles a NETBYTE_SYS_SETENCODING, acknowledging with whichever encoding is used from now on
+void MoppyUDP::changeEncoding(uint8_t requested) {
+    if (requested == MOPPY_ENCODING_STANDARD || requested == MOPPY_ENCODING_COMPACT) {
+        encoding = requested;
+    }
+    sendSystemMessage(NETBYTE_SYS_ENCODINGACK, &encoding, 1);
+}
+
+void MoppyUDP::sendPong(bool extended) {
+    if (!extended) {
+        UDP.beginPacket(IPAddress(239, 2, 2, 7), 30994);
+        UDP.write(pongBytes, sizeof(pongBytes));
+        UDP.endPacket();
+        return;
+    }
+
+    uint8_t payload[3 + MOPPY_CAPABILITIES_LENGTH] = {DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
+    sendSystemMessage(NETBYTE_SYS_PONG, payload, 3 + capabilities.write(&payload[3]));
+}
+
+// Sends a system message (from this device) back to the Controller
+void MoppyUDP::sendSystemMessage(uint8_t command, const uint8_t payload[], uint8_t payloadLength) {
+    uint8_t header[5] = {START_BYTE, SYSTEM_ADDRESS, 0x00, (uint8_t)(payloadLength + 1), command};
+    UDP.beginPacket(IPAddress(239, 2, 2, 7), MOPPY_UDP_PORT);
+    UDP.write(header, sizeof(header));
+    UDP.write(payload, payloadLength);
     UDP.endPacket();
 }
+
+void MoppyUDP::sendLinkStats(bool reset) {
+    stats.encoding = encoding;
+    uint8_t payload[LINK_STATS_PAYLOAD_LENGTH];
+    uint8_t length = stats.write(payload);
+    if (reset) {
+        stats.reset();
+    }
+    sendSystemMessage(NETBYTE_SYS_LINKSTATS, payload, length);
+}
+
+#ifdef ISR_STATS
+void MoppyUDP::sendIsrStats(bool reset) {
+    uint8_t payload[ISR_STATS_PAYLOAD_LENGTH];
+    uint8_t length = MoppyIsrStats::write(payload);
+    if (reset) {
+        MoppyIsrStats::reset();
+    }
+    sendSystemMessage(NETBYTE_SYS_ISRSTATS, payload, length);
+}
+#endif
+
+#ifdef MOPPY_UDP_TASK
+// Receives everything from the network, on MOPPY_UDP_TASK_CORE.  This is the only place the link
+// stats are updated from, so the gap between checks is the gap between polls here.
+void MoppyUDP::networkTask(void *param) {
+    MoppyUDP *udp = (MoppyUDP *)param;
+    for (;;) {
+        udp->stats.checked();
+        ArduinoOTA.handle();
+        udp->receivePackets();
+        vTaskDelay(1); // WiFiUDP can only be polled, so give everything else on this core a turn
+    }
+}
+
+// Hands queued messages to the instrument, from loop()
+void MoppyUDP::dispatchQueued() {
+    unsigned long start = micros();
+    MoppyQueuedMessage *queued;
+    while ((queued = queue.front()) != NULL) {
+        recordLatency(micros() - queued->received);
+        consume(queued->address, queued->subAddress, queued->command, queued->payload, queued->payloadLength);
+        queue.pop();
+
+        if (micros() - start >= MOPPY_UDP_DRAIN_MICROS) {
+            break;
+        }
+    }
+}
+
+void MoppyUDP::recordLatency(uint32_t latency) {
+    if (latencyReset) {
+        latencyAverage = 0;
+        latencyMax = 0;
+        latencyReset = false;
+    }
+    // Average over roughly the last 16 messages
+    latencyAverage = latencyAverage == 0 ? latency : latencyAverage + ((int32_t)(latency - latencyAverage) >> 4);
+    if (latency > latencyMax) {
+        latencyMax = latency;
+    }
+}
+
+void MoppyUDP::sendQueueStats(bool reset) {
+    uint16_t depth = queue.depth();
+    uint32_t average = latencyAverage;
+    uint32_t max = latencyMax;
+    uint8_t payload[QUEUE_STATS_PAYLOAD_LENGTH] = {
+        1,
+        (uint8_t)(MOPPY_UDP_QUEUE_SIZE >> 8), (uint8_t)MOPPY_UDP_QUEUE_SIZE,
+        (uint8_t)(depth >> 8), (uint8_t)depth,
+        (uint8_t)(maxDepth >> 8), (uint8_t)maxDepth,
+        (uint8_t)(drops >> 8), (uint8_t)drops,
+        (uint8_t)(average >> 24), (uint8_t)(average >> 16), (uint8_t)(average >> 8), (uint8_t)average,
+        (uint8_t)(max >> 24), (uint8_t)(max >> 16), (uint8_t)(max >> 8), (uint8_t)max};
+    if (reset) {
+        maxDepth = 0;
+        drops = 0;
+        latencyReset = true; // loop() owns the latencies, so it clears them
+    }
+    sendSystemMessage(NETBYTE_SYS_QUEUESTATS, payload, sizeof(payload));
+}
+#endif
 #endif /* ARDUINO_ARCH_ESP8266 or ARDUINO_ARCH_ESP32 */
@@ -11,7 +11,10 @@
 #include "../MoppyConfig.h"
 #include "../MoppyMessageConsumer.h"
 #include "Arduino.h"
+#include "MoppyCompact.h"
+#include "MoppyLinkStats.h"
 #include "MoppyNetwork.h"
+#include "../MoppyInstruments/MoppyIsrStats.h"
 #include <ArduinoOTA.h>
 #ifdef ARDUINO_ARCH_ESP8266
 #include <ESP8266WiFi.h>
@@ -24,7 +27,51 @@
 #include <stdint.h>
 
 #define MOPPY_UDP_PORT 30994
-#define MOPPY_MAX_PACKET_LENGTH 259
+// Longest packet that's read, which can hold several messages one after another (anything past
+// this is dropped).  This is as much as fits in an unfragmented datagram over Ethernet.
+#define MOPPY_MAX_PACKET_LENGTH 1472
+// How long (in microseconds) readMessages() keeps reading packets before leaving the rest for
+// the next call
+#ifndef MOPPY_UDP_DRAIN_MICROS
+#define MOPPY_UDP_DRAIN_MICROS 2000
+#endif
+
+#if defined ARDUINO_ARCH_ESP32 && defined UDP_NETWORK_TASK
+#define MOPPY_UDP_TASK
+#include "MoppyQueue.h"
+
+// Core for the network task, which is the one WiFi runs on (loop() runs on the other)
+#define MOPPY_UDP_TASK_CORE 0
+#define MOPPY_UDP_TASK_PRIORITY 2
+#define MOPPY_UDP_TASK_STACK 4096
+// Messages that can be waiting for the instrument (must be a power of two)
+#ifndef MOPPY_UDP_QUEUE_SIZE
+#define MOPPY_UDP_QUEUE_SIZE 32
+#endif
+
+// A message on its way from the network task to the instrument
+struct MoppyQueuedMessage {
+    unsigned long received; // micros() when the packet it came in was read
+    uint8_t address;
+    uint8_t subAddress;
+    uint8_t command;
+    uint8_t payloadLength;
+    uint8_t payload[255];
+};
+
+/*
+ * Payload of a NETBYTE_SYS_QUEUESTATS (multi-byte values are big-endian):
+ *  0     - Version of this layout (1)
+ *  1-2   - Size of the queue
+ *  3-4   - Messages waiting in the queue right now
+ *  5-6   - Most messages that have been waiting at once
+ *  7-8   - Messages dropped because the queue was full
+ *  9-12  - Recent average time in microseconds from a packet being read to its messages being
+ *          handed to the instrument
+ *  13-16 - Longest of those times
+ */
+#define QUEUE_STATS_PAYLOAD_LENGTH 17
+#endif
 
 class MoppyUDP {
 public:
@@ -34,13 +81,45 @@ public:
 
 private:
     MoppyMessageConsumer *targetConsumer;
-    uint8_t messagePos = 0;                         // Track current message read position
-    uint8_t messageBuffer[MOPPY_MAX_PACKET_LENGTH]; // Max message length for Moppy messages is 259
+    uint8_t messageBuffer[MOPPY_MAX_PACKET_LENGTH];
+    uint8_t encoding = MOPPY_ENCODING_STANDARD;
+    MoppyCompactDecoder compactDecoder;
+    MoppyLinkStats stats; // Only ever updated from where packets are received (the network task, if there is one)
+    // Filled in by begin(), so an extended pong never has to call into the instrument (which
+    // might be on the other core)
+    MoppyCapabilities capabilities;
     const uint8_t pongBytes[8] = {START_BYTE, 0x00, 0x00, 0x04, 0x81, DEVICE_ADDRESS, MIN_SUB_ADDRESS, MAX_SUB_ADDRESS};
     void startOTA();
     bool startUDP();
-    void parseMessage(uint8_t message[], int length);
-    void sendPong();
+    void receivePackets();
+    void parsePacket(uint8_t packet[], int length);
+    int parseMessage(uint8_t message[], int length);
+    int parseEvent(uint8_t data[], int length);
+    void handleMessage(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength);
+    void changeEncoding(uint8_t requested);
+    void deliver(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength);
+    void consume(uint8_t address, uint8_t subAddress, uint8_t command, uint8_t payload[], uint8_t payloadLength);
+    void sendPong(bool extended);
+    void sendSystemMessage(uint8_t command, const uint8_t payload[], uint8_t payloadLength);
+    void sendLinkStats(bool reset);
+#ifdef ISR_STATS
+    void sendIsrStats(bool reset);
+#endif
+#ifdef MOPPY_UDP_TASK
+    MoppyQueue<MoppyQueuedMessage, MOPPY_UDP_QUEUE_SIZE> queue;
+    unsigned long packetTime = 0; // When the packet being parsed was read
+    // Written by the network task
+    uint16_t maxDepth = 0;
+    uint16_t drops = 0;
+    // Written by loop()
+    volatile uint32_t latencyAverage = 0;
+    volatile uint32_t latencyMax = 0;
+    volatile bool latencyReset = false; // Set by the network task for loop() to clear the above
+    static void networkTask(void *param);
+    void dispatchQueued();
+    void recordLatency(uint32_t latency);
+    void sendQueueStats(bool reset);
+#endif
 };
 
 #endif /* SRC_MOPPYNETWORKS_MOPPYUDP_H_ */
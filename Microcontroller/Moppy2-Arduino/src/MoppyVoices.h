@@ -0,0 +1,210 @@
+/*
+ * MoppyVoices.h
+ * Keeps track of which note each of a fixed number of voices (e.g. drives) is playing, for
+ * handing notes out to whichever voice is free.
+ *
+ * Finding a voice for a note and releasing it are constant-time: notes are looked up with a
+ * 128-entry index, free voices are kept in a queue (so the voice that's been free longest is used
+ * next, unless the caller would rather have a particular one), and playing voices are kept in a
+ * list from oldest to newest.  When every voice is playing, a new note takes over (steals) a voice
+ * according to the stealing policy: the oldest voice is at the front of the list, while the
+ * lowest or quietest note is found by walking through it.
+ */
+
+#ifndef SRC_MOPPYVOICES_H_
+#define SRC_MOPPYVOICES_H_
+
+#include <stdint.h>
+
+#define MOPPY_VOICE_NONE 0xFF
+#define MOPPY_NOTE_NONE 0xFF
+
+// What to do with a new note when every voice is already playing
+#define MOPPY_STEAL_NONE 0     // Drop the new note
+#define MOPPY_STEAL_OLDEST 1   // Take over the voice that's been playing longest
+#define MOPPY_STEAL_LOWEST 2   // Take over the voice playing the lowest note
+#define MOPPY_STEAL_QUIETEST 3 // Take over the voice with the lowest velocity (the oldest of those if there's a tie)
+
+template <uint8_t VOICES>
+class MoppyVoices {
+    static_assert(VOICES > 0 && VOICES < MOPPY_VOICE_NONE, "Voice count must be between 1 and 254");
+
+public:
+    uint8_t policy;
+
+    MoppyVoices(uint8_t stealPolicy = MOPPY_STEAL_OLDEST) : policy(stealPolicy) {
+        for (uint8_t v = 0; v < VOICES; v++) {
+            voiceNote[v] = MOPPY_NOTE_NONE;
+        }
+        reset();
+    }
+
+    // Releases every voice
+    void reset() {
+        for (uint8_t n = 0; n < 128; n++) {
+            noteVoice[n] = MOPPY_VOICE_NONE;
+        }
+        oldest = newest = freeFirst = freeLast = MOPPY_VOICE_NONE;
+        for (uint8_t v = 0; v < VOICES; v++) {
+            if (voiceNote[v] != RESERVED) {
+                voiceNote[v] = MOPPY_NOTE_NONE;
+                pushFree(v);
+            }
+        }
+    }
+
+    // Keeps a voice from ever being handed out (e.g. because it's being used for something else).
+    // Releases every voice, so should be done before any notes are played.
+    void reserve(uint8_t voice) {
+        voiceNote[voice] = RESERVED;
+        reset();
+    }
+
+    // Finds a voice for a note, and returns it (or MOPPY_VOICE_NONE if there isn't one).  A note
+    // that's already playing keeps its voice, otherwise preferred is used if it's free.  If a voice
+    // had to be stolen, the note it was playing is put in stolenNote (otherwise it's set to
+    // MOPPY_NOTE_NONE).
+    uint8_t noteOn(uint8_t note, uint8_t velocity, uint8_t channel, uint8_t &stolenNote, uint8_t preferred = MOPPY_VOICE_NONE) {
+        note &= 0x7F;
+        stolenNote = MOPPY_NOTE_NONE;
+        uint8_t v = noteVoice[note];
+        if (v != MOPPY_VOICE_NONE) {
+            unlink(v); // Played again, so it's now the newest
+        } else if (preferred < VOICES && isFree(preferred)) {
+            v = preferred;
+            unlinkFree(v);
+        } else if (freeFirst != MOPPY_VOICE_NONE) {
+            v = freeFirst;
+            unlinkFree(v);
+        } else {
+            v = victim();
+            if (v == MOPPY_VOICE_NONE) {
+                return MOPPY_VOICE_NONE;
+            }
+            stolenNote = voiceNote[v];
+            noteVoice[stolenNote] = MOPPY_VOICE_NONE;
+            unlink(v);
+        }
+
+        voiceNote[v] = note;
+        voiceVelocity[v] = velocity;
+        voiceChannel[v] = channel;
+        noteVoice[note] = v;
+        older[v] = newest;
+        newer[v] = MOPPY_VOICE_NONE;
+        if (newest != MOPPY_VOICE_NONE) {
+            newer[newest] = v;
+        } else {
+            oldest = v;
+        }
+        newest = v;
+        return v;
+    }
+
+    // Releases the voice playing a note from a channel, and returns it (or MOPPY_VOICE_NONE if the
+    // note isn't playing, e.g. because its voice was stolen)
+    uint8_t noteOff(uint8_t note, uint8_t channel) {
+        note &= 0x7F;
+        uint8_t v = noteVoice[note];
+        if (v == MOPPY_VOICE_NONE || voiceChannel[v] != channel) {
+            return MOPPY_VOICE_NONE;
+        }
+        release(v);
+        return v;
+    }
+
+    // Releases a voice whatever it's playing (e.g. because its drive was reset), and returns the
+    // note it was playing (or MOPPY_NOTE_NONE if it was free or reserved)
+    uint8_t release(uint8_t voice) {
+        uint8_t note = voiceNote[voice];
+        if (note == MOPPY_NOTE_NONE || note == RESERVED) {
+            return MOPPY_NOTE_NONE;
+        }
+        noteVoice[note] = MOPPY_VOICE_NONE;
+        voiceNote[voice] = MOPPY_NOTE_NONE;
+        unlink(voice);
+        pushFree(voice);
+        return note;
+    }
+
+    bool isFree(uint8_t voice) const { return voiceNote[voice] == MOPPY_NOTE_NONE; }
+    uint8_t voiceFor(uint8_t note) const { return noteVoice[note & 0x7F]; }
+    uint8_t note(uint8_t voice) const { return voiceNote[voice]; }
+    uint8_t channel(uint8_t voice) const { return voiceChannel[voice]; }
+
+    // For going through the playing voices from oldest to newest (MOPPY_VOICE_NONE at the end).
+    // Get the next voice before releasing the current one.
+    uint8_t first() const { return oldest; }
+    uint8_t next(uint8_t voice) const { return newer[voice]; }
+
+private:
+    static const uint8_t RESERVED = 0xFE;
+
+    uint8_t noteVoice[128]; // Voice playing each note
+    uint8_t voiceNote[VOICES];
+    uint8_t voiceVelocity[VOICES];
+    uint8_t voiceChannel[VOICES];
+    // Playing voices are linked from oldest to newest, and free voices from first to last
+    uint8_t older[VOICES];
+    uint8_t newer[VOICES];
+    uint8_t oldest, newest;
+    uint8_t freeFirst, freeLast;
+
+    uint8_t victim() const {
+        if (policy == MOPPY_STEAL_NONE) {
+            return MOPPY_VOICE_NONE;
+        }
+        if (policy == MOPPY_STEAL_OLDEST) {
+            return oldest;
+        }
+        uint8_t best = oldest;
+        for (uint8_t v = oldest; v != MOPPY_VOICE_NONE; v = newer[v]) {
+            // Strictly less, so ties go to the oldest
+            if (policy == MOPPY_STEAL_LOWEST ? voiceNote[v] < voiceNote[best] : voiceVelocity[v] < voiceVelocity[best]) {
+                best = v;
+            }
+        }
+        return best;
+    }
+
+    // Takes a playing voice out of the list
+    void unlink(uint8_t v) {
+        if (older[v] != MOPPY_VOICE_NONE) {
+            newer[older[v]] = newer[v];
+        } else {
+            oldest = newer[v];
+        }
+        if (newer[v] != MOPPY_VOICE_NONE) {
+            older[newer[v]] = older[v];
+        } else {
+            newest = older[v];
+        }
+    }
+
+    // Takes a free voice out of the queue
+    void unlinkFree(uint8_t v) {
+        if (older[v] != MOPPY_VOICE_NONE) {
+            newer[older[v]] = newer[v];
+        } else {
+            freeFirst = newer[v];
+        }
+        if (newer[v] != MOPPY_VOICE_NONE) {
+            older[newer[v]] = older[v];
+        } else {
+            freeLast = older[v];
+        }
+    }
+
+    void pushFree(uint8_t v) {
+        older[v] = freeLast;
+        newer[v] = MOPPY_VOICE_NONE;
+        if (freeLast != MOPPY_VOICE_NONE) {
+            newer[freeLast] = v;
+        } else {
+            freeFirst = v;
+        }
+        freeLast = v;
+    }
+};
+
+#endif /* SRC_MOPPYVOICES_H_ */
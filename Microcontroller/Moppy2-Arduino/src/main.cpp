@@ -55,6 +55,12 @@ MoppyInstrument *instrument = new instruments::ShiftedFloppyDrives();
 MoppySerial network = MoppySerial(instrument);
 #endif
 
+// MIDI messages received directly over serial
+#ifdef NETWORK_MIDI
+#include "MoppyNetworks/MoppyMidi.h"
+MoppyMidi network = MoppyMidi(instrument);
+#endif
+
 //// UDP Implementation using some sort of network stack?  (Not implemented yet)
 #ifdef NETWORK_UDP
 #include "MoppyNetworks/MoppyUDP.h"
@@ -77,4 +83,7 @@ void loop()
 	// Endlessly read messages on the network.  The network implementation
 	// will call the system or device handlers on the intrument whenever a message is received.
     network.readMessages();
+
+    // Give the instrument a chance to do anything it does outside of its timer interrupt
+    instrument->update();
 }
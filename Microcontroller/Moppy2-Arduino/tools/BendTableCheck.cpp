@@ -0,0 +1,131 @@
+/*
+ * BendTableCheck.cpp
+ * Host-side check of the integer pitch-bend path in MoppyTables.h against the pow() calculation
+ * it replaced.  Build and run from this directory with:
+ *
+ *   g++ -std=c++11 -O2 -o BendTableCheck BendTableCheck.cpp && ./BendTableCheck
+ *
+ * Exits non-zero if the bend factor is ever off by more than MAX_CENTS_ERROR, or if a bent period
+ * differs from the old (float) result by more than a tick.  Every note table a build can use (see
+ * PERIOD_CONFIGS) is checked too: each bent note has to be within a tick of the exact period (or
+ * within MAX_PERIOD_CENTS_ERROR, for the long microsecond periods of STEP_SCHEDULER), and the
+ * longest one has to fit in that build's period_t.  Deflections outside -8192 to 8191 have to
+ * come out the same as the nearest end of the range.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include "../src/MoppyInstruments/MoppyTables.h"
+
+#define MAX_CENTS_ERROR 0.1
+#define MAX_PERIOD_CENTS_ERROR 0.2 // The factor's error plus rounding the bent period
+
+// The note tables (and period_t) for each timing mode in MoppyInstrument.h, with the tick length
+// of the single and double-tick tables
+struct PeriodConfig {
+    const char *name;
+    long resolution;  // TIMER_RESOLUTION
+    int fractionBits; // PERIOD_FRACTION_BITS
+    int periodBits;   // Size of period_t
+};
+
+static const PeriodConfig PERIOD_CONFIGS[] = {
+    {"Ticks (AVR)", 40, 0, 16},
+    {"Ticks (ESP)", 20, 0, 32},
+    {"PHASE_ACCUMULATOR (AVR)", 40, 12, 32},
+    {"PHASE_ACCUMULATOR (ESP)", 20, 12, 32},
+    {"STEP_SCHEDULER", 1, 0, 32},
+};
+
+// Checks every note in one table at every deflection, returning false if any fail
+static bool checkTable(const PeriodConfig &config, long divisor) {
+    double worstTicks = 0;
+    int worstNote = 0;
+    int worstDeflection = 0;
+    bool accurate = true;
+    for (int note = FIRST_TABLE_NOTE; note <= LAST_TABLE_NOTE; note++) {
+        uint32_t period = noteTableEntry(note, divisor, config.fractionBits);
+        for (int deflection = -8192; deflection <= 8191; deflection++) {
+            double exact = period * pow(2.0, -(double)(BEND_OCTAVES) * deflection / 8192.0);
+            double bent = bendPeriod(period, deflection);
+            double ticks = fabs(bent - exact) / (1UL << config.fractionBits);
+            if (ticks > 1 && fabs(1200.0 * log2(bent / exact)) > MAX_PERIOD_CENTS_ERROR) {
+                accurate = false;
+            }
+            if (ticks > worstTicks) {
+                worstTicks = ticks;
+                worstNote = note;
+                worstDeflection = deflection;
+            }
+        }
+    }
+
+    uint32_t longest = maxBentPeriod(divisor, config.fractionBits);
+    bool fits = config.periodBits == 32 || longest <= 0xFFFFUL;
+    // bendPeriod only takes periods of up to 24 bits
+    bool scalable = noteTableEntry(FIRST_TABLE_NOTE, divisor, config.fractionBits) < (1UL << 24);
+
+    bool passed = accurate && fits && scalable;
+    printf("%-24s /%-3ld longest %8lu (%s), worst %.3f tick(s) (note %d, deflection %d) %s\n",
+           config.name, divisor, (unsigned long)longest, fits ? "fits" : "OVERFLOWS period_t",
+           worstTicks, worstNote, worstDeflection, passed ? "ok" : "FAIL");
+    return passed;
+}
+
+// The old calculation, including its float precision and truncation
+static unsigned long floatBend(unsigned long period, int16_t deflection) {
+    return period / pow(2.0, BEND_OCTAVES * (deflection / (float)8192));
+}
+
+int main() {
+    double worstCents = 0;
+    int worstCentsDeflection = 0;
+    long worstTicks = 0;
+    unsigned long worstTicksPeriod = 0;
+    int worstTicksDeflection = 0;
+
+    for (int deflection = -8192; deflection <= 8191; deflection++) {
+        double exact = pow(2.0, -(double)(BEND_OCTAVES) * deflection / 8192.0);
+        double cents = fabs(1200.0 * log2((bendFactor(deflection) / 32768.0) / exact));
+        if (cents > worstCents) {
+            worstCents = cents;
+            worstCentsDeflection = deflection;
+        }
+
+        // Every period a note can have in ticks (with the smallest TIMER_RESOLUTION in use)
+        for (unsigned long period = 1; period <= 61162 / 20; period++) {
+            long difference = labs((long)bendPeriod(period, deflection) - (long)floatBend(period, deflection));
+            if (difference > worstTicks) {
+                worstTicks = difference;
+                worstTicksPeriod = period;
+                worstTicksDeflection = deflection;
+            }
+        }
+    }
+
+    printf("Bend table: %d entries, %d bytes\n", BEND_TABLE_SIZE, (int)sizeof(bendTable::factors));
+    printf("Worst factor error: %.4f cents (deflection %d)\n", worstCents, worstCentsDeflection);
+    printf("Worst difference from pow(): %ld tick(s) (period %lu, deflection %d)\n",
+           worstTicks, worstTicksPeriod, worstTicksDeflection);
+
+    bool passed = worstCents <= MAX_CENTS_ERROR && worstTicks <= 1;
+
+    // Deflections outside the MIDI range are clamped rather than read past the table
+    const int16_t outOfRange[] = {-32768, -8193, 8192, 32767};
+    for (int16_t deflection : outOfRange) {
+        uint16_t expected = bendFactor(deflection < 0 ? -8192 : 8191);
+        if (bendFactor(deflection) != expected) {
+            printf("Deflection %d: factor %u, expected %u\n", deflection, bendFactor(deflection), expected);
+            passed = false;
+        }
+    }
+
+    // Both the single (TIMER_RESOLUTION) and double-tick tables of every mode
+    for (const PeriodConfig &config : PERIOD_CONFIGS) {
+        passed &= checkTable(config, config.resolution);
+        passed &= checkTable(config, config.resolution * 2);
+    }
+
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
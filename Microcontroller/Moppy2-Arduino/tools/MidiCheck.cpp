@@ -0,0 +1,131 @@
+/*
+ * MidiCheck.cpp
+ * Host-side check of MoppyMidi's byte parser, run on the native build's mock Arduino API.  Build
+ * and run from this directory with:
+ *
+ *   g++ -std=gnu++11 -O2 -DARDUINO_ARCH_NATIVE -DNETWORK_MIDI -I../native -o MidiCheck MidiCheck.cpp \
+ *       ../src/MoppyNetworks/MoppyMidi.cpp ../src/MoppyNetworks/MoppyLinkStats.cpp ../native/MoppySim.cpp && ./MidiCheck
+ *
+ * Each case feeds a few MIDI bytes to a fresh MoppyMidi (with the default MIDI_CHANNEL_MAP, so
+ * every channel is pooled) and compares what the instrument is sent with what it should be.
+ * Exits non-zero if any case fails.
+ */
+
+#include <stdio.h>
+#include <vector>
+#include "../native/MoppySim.h"
+#include "../src/MoppyNetworks/MoppyMidi.h"
+
+// A message as the instrument saw it (notes off only have the note)
+struct Received {
+    bool system;
+    uint8_t subAddress;
+    uint8_t command;
+    uint8_t note;
+    uint8_t velocity;
+};
+
+class RecordingConsumer : public MoppyMessageConsumer {
+public:
+    std::vector<Received> received;
+
+    void handleSystemMessage(uint8_t command, uint8_t payload[]) override {
+        Received r = {true, 0, command, 0, 0};
+        received.push_back(r);
+    }
+
+    void handleDeviceMessage(uint8_t subAddress, uint8_t command, uint8_t payload[]) override {
+        Received r = {false, subAddress, command, payload[0], command == NETBYTE_DEV_NOTEOFF ? (uint8_t)0 : payload[1]};
+        received.push_back(r);
+    }
+};
+
+struct MidiCase {
+    const char *name;
+    std::vector<uint8_t> bytes;
+    std::vector<Received> expected;
+};
+
+static Received on(uint8_t subAddress, uint8_t note, uint8_t velocity) {
+    Received r = {false, subAddress, NETBYTE_DEV_NOTEON, note, velocity};
+    return r;
+}
+
+static Received off(uint8_t subAddress, uint8_t note) {
+    Received r = {false, subAddress, NETBYTE_DEV_NOTEOFF, note, 0};
+    return r;
+}
+
+static Received systemMessage(uint8_t command) {
+    Received r = {true, 0, command, 0, 0};
+    return r;
+}
+
+static bool same(const Received &a, const Received &b) {
+    return a.system == b.system && a.subAddress == b.subAddress && a.command == b.command && a.note == b.note && a.velocity == b.velocity;
+}
+
+static void print(const char *label, const std::vector<Received> &messages) {
+    printf("    %s:", label);
+    for (size_t i = 0; i < messages.size(); i++) {
+        const Received &m = messages[i];
+        if (m.system) {
+            printf(" sys %02X", m.command);
+        } else {
+            printf(" %u:%02X:%u/%u", m.subAddress, m.command, m.note, m.velocity);
+        }
+    }
+    printf("\n");
+}
+
+static bool runCase(const MidiCase &c) {
+    MoppySim::reset();
+    RecordingConsumer consumer;
+    MoppyMidi midi(&consumer);
+    MoppySim::serialInput(c.bytes.data(), c.bytes.size());
+    midi.readMessages();
+
+    bool passed = consumer.received.size() == c.expected.size();
+    for (size_t i = 0; passed && i < c.expected.size(); i++) {
+        passed = same(consumer.received[i], c.expected[i]);
+    }
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", c.name);
+    if (!passed) {
+        print("expected", c.expected);
+        print("received", consumer.received);
+    }
+    return passed;
+}
+
+int main() {
+    const MidiCase cases[] = {
+        {"running status",
+         {0x90, 60, 100, 62, 100},
+         {on(1, 60, 100), on(2, 62, 100)}},
+        {"realtime bytes inside messages under running status",
+         {0x90, 60, 0xF8, 100, 62, NETBYTE_SYS_STOP, 100, 0xF8},
+         {on(1, 60, 100), systemMessage(NETBYTE_SYS_STOP), on(2, 62, 100)}},
+        {"note on with velocity 0",
+         {0x90, 60, 100, 0x90, 60, 0},
+         {on(1, 60, 100), off(1, 60)}},
+        {"note on with velocity 0 under running status",
+         {0x90, 60, 100, 62, 100, 60, 0, 62, 0},
+         {on(1, 60, 100), on(2, 62, 100), off(1, 60), off(2, 62)}},
+        {"note off",
+         {0x90, 60, 100, 0x80, 60, 64},
+         {on(1, 60, 100), off(1, 60)}},
+        {"data without a status is skipped",
+         {60, 100, 0x90, 62, 100},
+         {on(1, 62, 100)}},
+        {"system common message cancels running status",
+         {0x90, 60, 100, 0xF3, 5, 62, 100, 0x90, 64, 100},
+         {on(1, 60, 100), on(2, 64, 100)}},
+    };
+
+    bool passed = true;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        passed = runCase(cases[i]) && passed;
+    }
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
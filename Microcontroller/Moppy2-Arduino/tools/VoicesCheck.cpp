@@ -0,0 +1,131 @@
+/*
+ * VoicesCheck.cpp
+ * Host-side check of the voice allocation in MoppyVoices.h.  Build and run from this directory
+ * with:
+ *
+ *   g++ -std=c++11 -O2 -o VoicesCheck VoicesCheck.cpp && ./VoicesCheck
+ *
+ * Covers which voice a note gets (free voices in the order they were freed, a preferred voice,
+ * a repeated note keeping its voice), notes off from the wrong channel, releasing a voice
+ * directly, reserved voices, and each stealing policy.  Exits non-zero if anything fails.
+ */
+
+#include <stdio.h>
+#include "../src/MoppyVoices.h"
+
+static int failures = 0;
+
+static void expect(const char *what, unsigned actual, unsigned expected) {
+    if (actual != expected) {
+        printf("FAIL: %s: got %u, expected %u\n", what, actual, expected);
+        failures++;
+    }
+}
+
+static void checkAllocation() {
+    MoppyVoices<4> voices;
+    uint8_t stolen;
+
+    expect("first note gets the first voice", voices.noteOn(60, 127, 0, stolen), 0);
+    expect("second note gets the next voice", voices.noteOn(62, 127, 0, stolen), 1);
+    expect("nothing stolen while voices are free", stolen, MOPPY_NOTE_NONE);
+    expect("repeated note keeps its voice", voices.noteOn(60, 100, 0, stolen), 0);
+    expect("preferred voice is used when free", voices.noteOn(64, 127, 0, stolen, 3), 3);
+    expect("busy preferred voice is passed over", voices.noteOn(65, 127, 0, stolen, 0), 2);
+
+    expect("note off from another channel is ignored", voices.noteOff(62, 1), MOPPY_VOICE_NONE);
+    expect("note off releases the voice", voices.noteOff(62, 0), 1);
+    expect("released voice is free", voices.isFree(1), true);
+    expect("released note has no voice", voices.voiceFor(62), MOPPY_VOICE_NONE);
+    expect("note off for a note that isn't playing", voices.noteOff(62, 0), MOPPY_VOICE_NONE);
+
+    // Voices come back in the order they were freed
+    voices.noteOff(60, 0);
+    expect("longest-free voice is used first", voices.noteOn(70, 127, 0, stolen), 1);
+    expect("then the next", voices.noteOn(71, 127, 0, stolen), 0);
+
+    // Playing voices go from oldest to newest (64 on 3, 65 on 2, 70 on 1, 71 on 0)
+    uint8_t order[4] = {3, 2, 1, 0};
+    uint8_t v = voices.first();
+    for (uint8_t i = 0; i < 4; i++) {
+        expect("playing voices from oldest to newest", v, order[i]);
+        v = voices.next(v);
+    }
+    expect("end of the playing voices", v, MOPPY_VOICE_NONE);
+
+    // Releasing a voice directly forgets its note, and the voice goes to the back of the free queue
+    expect("release returns the voice's note", voices.release(1), 70);
+    expect("released voice is free", voices.isFree(1), true);
+    expect("released voice's note has no voice", voices.voiceFor(70), MOPPY_VOICE_NONE);
+    expect("note off after release is ignored", voices.noteOff(70, 0), MOPPY_VOICE_NONE);
+    expect("releasing a free voice does nothing", voices.release(1), MOPPY_NOTE_NONE);
+    expect("released voice is used next", voices.noteOn(72, 127, 0, stolen), 1);
+
+    voices.reset();
+    for (uint8_t i = 0; i < 4; i++) {
+        expect("reset frees every voice", voices.isFree(i), true);
+    }
+    expect("nothing playing after reset", voices.first(), MOPPY_VOICE_NONE);
+}
+
+static void checkReserved() {
+    MoppyVoices<3> voices;
+    voices.reserve(1);
+    uint8_t stolen;
+
+    expect("first free voice", voices.noteOn(60, 127, 0, stolen), 0);
+    expect("reserved voice is skipped", voices.noteOn(61, 127, 0, stolen), 2);
+    expect("reserved voice can't be preferred", voices.noteOn(62, 127, 0, stolen, 1), 0);
+    expect("reserved voice isn't stolen either", stolen, 60);
+    expect("reserved voice isn't free", voices.isFree(1), false);
+    expect("reserved voice can't be released", voices.release(1), MOPPY_NOTE_NONE);
+
+    voices.reset();
+    expect("reserved voice stays reserved after reset", voices.noteOn(60, 127, 0, stolen, 1), 0);
+}
+
+// Fills two voices (note 50 at velocity 40 first, then note 40 at velocity 90) and plays a third
+// note, returning the voice it gets
+static uint8_t steal(uint8_t policy, uint8_t &stolen) {
+    MoppyVoices<2> voices(policy);
+    voices.noteOn(50, 40, 0, stolen);
+    voices.noteOn(40, 90, 0, stolen);
+    return voices.noteOn(60, 127, 0, stolen);
+}
+
+static void checkStealing() {
+    uint8_t stolen;
+
+    expect("MOPPY_STEAL_NONE drops the new note", steal(MOPPY_STEAL_NONE, stolen), MOPPY_VOICE_NONE);
+    expect("MOPPY_STEAL_NONE stops nothing", stolen, MOPPY_NOTE_NONE);
+    expect("MOPPY_STEAL_OLDEST takes the oldest voice", steal(MOPPY_STEAL_OLDEST, stolen), 0);
+    expect("MOPPY_STEAL_OLDEST stops its note", stolen, 50);
+    expect("MOPPY_STEAL_LOWEST takes the lowest note's voice", steal(MOPPY_STEAL_LOWEST, stolen), 1);
+    expect("MOPPY_STEAL_LOWEST stops it", stolen, 40);
+    expect("MOPPY_STEAL_QUIETEST takes the quietest note's voice", steal(MOPPY_STEAL_QUIETEST, stolen), 0);
+    expect("MOPPY_STEAL_QUIETEST stops it", stolen, 50);
+
+    // A stolen note is forgotten, and the voice is now the newest
+    MoppyVoices<2> voices(MOPPY_STEAL_OLDEST);
+    voices.noteOn(50, 127, 0, stolen);
+    voices.noteOn(52, 127, 0, stolen);
+    voices.noteOn(54, 127, 0, stolen);
+    expect("stolen note has no voice", voices.voiceFor(50), MOPPY_VOICE_NONE);
+    expect("note off for a stolen note is ignored", voices.noteOff(50, 0), MOPPY_VOICE_NONE);
+    expect("the next steal takes the next oldest", voices.noteOn(56, 127, 0, stolen), 1);
+    expect("which was playing", stolen, 52);
+
+    // Ties go to the oldest
+    MoppyVoices<2> quiet(MOPPY_STEAL_QUIETEST);
+    quiet.noteOn(50, 64, 0, stolen);
+    quiet.noteOn(52, 64, 0, stolen);
+    expect("MOPPY_STEAL_QUIETEST tie goes to the oldest", quiet.noteOn(54, 127, 0, stolen), 0);
+}
+
+int main() {
+    checkAllocation();
+    checkReserved();
+    checkStealing();
+    printf("%s\n", failures == 0 ? "PASS" : "FAIL");
+    return failures == 0 ? 0 : 1;
+}